@@ -10,10 +10,50 @@ extern "C" {
 /*
  * Class:     com_etb_lab_svg2png_Svg2Png
  * Method:    renderSVG
- * Signature: (Ljava/lang/String;Ljava/lang/String;DII)I
+ * Signature: (Ljava/lang/String;Ljava/lang/String;DIII)I
  */
 JNIEXPORT jint JNICALL Java_com_etb_1lab_svg2png_Svg2Png_renderSVG
-  (JNIEnv *, jclass, jstring, jstring, jdouble, jint, jint);
+  (JNIEnv *, jclass, jstring, jstring, jdouble, jint, jint, jint);
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    renderSVGToPixels
+ * Signature: (Ljava/lang/String;Ljava/nio/ByteBuffer;IDIII)I
+ */
+JNIEXPORT jint JNICALL Java_com_etb_1lab_svg2png_Svg2Png_renderSVGToPixels
+  (JNIEnv *, jclass, jstring, jobject, jint, jdouble, jint, jint, jint);
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    setPngOptions
+ * Signature: (IIIZ)V
+ */
+JNIEXPORT void JNICALL Java_com_etb_1lab_svg2png_Svg2Png_setPngOptions
+  (JNIEnv *, jclass, jint, jint, jint, jboolean);
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    setPngThreads
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_com_etb_1lab_svg2png_Svg2Png_setPngThreads
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    renderSVGToJPEG
+ * Signature: (Ljava/lang/String;Ljava/lang/String;DIII)I
+ */
+JNIEXPORT jint JNICALL Java_com_etb_1lab_svg2png_Svg2Png_renderSVGToJPEG
+  (JNIEnv *, jclass, jstring, jstring, jdouble, jint, jint, jint);
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    setJpegOptions
+ * Signature: (II)V
+ */
+JNIEXPORT void JNICALL Java_com_etb_1lab_svg2png_Svg2Png_setJpegOptions
+  (JNIEnv *, jclass, jint, jint);
 
 #ifdef __cplusplus
 }
@@ -3,7 +3,12 @@ LIBSVG_CAIRO_SOURCES = \
 	libsvg-cairo/svg-cairo.h \
 	libsvg-cairo/svg-cairo-internal.h \
 	libsvg-cairo/svg_cairo_sprintf_alloc.c \
-	libsvg-cairo/svg_cairo_state.c
+	libsvg-cairo/svg_cairo_jpeg.c \
+	libsvg-cairo/svg_cairo_pixels.c \
+	libsvg-cairo/svg_cairo_png.c \
+	libsvg-cairo/svg_cairo_splat.c \
+	libsvg-cairo/svg_cairo_state.c \
+	libsvg-cairo/svg_cairo_surface_pool.c
 
 
 LIBSVG_CAIRO_CFLAGS:=                 \
@@ -15,7 +20,7 @@ LIBSVG_CAIRO_CFLAGS:=                 \
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := libsvg-cairo
-LOCAL_CFLAGS    := -O2 $(LIBSVG_CAIRO_CFLAGS) -Ijni/libsvg -Ijni/libsvg-cairo -Ijni/pixman/pixman -Ijni/cairo/src -Ijni/cairo-extra -Ijni/pixman-extra -Wno-missing-field-initializers -Wno-attributes
+LOCAL_CFLAGS    := -O2 $(LIBSVG_CAIRO_CFLAGS) -Ijni/libsvg -Ijni/libsvg-cairo -Ijni/libpng -Ijni/libjpeg -Ijni/zlib -Ijni/pixman/pixman -Ijni/cairo/src -Ijni/cairo-extra -Ijni/pixman-extra -Wno-missing-field-initializers -Wno-attributes
 LOCAL_SRC_FILES := $(LIBSVG_CAIRO_SOURCES)
 LOCAL_STATIC_LIBRARIES := libcairo libpixman libexpat libsvg
 
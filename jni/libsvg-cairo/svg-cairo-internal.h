@@ -24,6 +24,7 @@
 
 #include "svg-cairo.h"
 #include "svg-cairo-version.h"
+#include "svg_pixels.h"
 
 #include <stdarg.h>
 
@@ -40,10 +41,35 @@ typedef enum svg_cairo_render_type {
     SVG_CAIRO_RENDER_TYPE_STROKE
 } svg_cairo_render_type_t;
 
+/* The parts of the cairo state libsvg-cairo sets from the style */
+typedef struct svg_cairo_gstate {
+    double line_width;
+    cairo_line_cap_t line_cap;
+    cairo_line_join_t line_join;
+    double miter_limit;
+    cairo_fill_rule_t fill_rule;
+
+    const double *dash;
+    int num_dashes;
+    double dash_offset;
+
+    const char *font_family;
+    double font_size;
+    svg_font_style_t font_style;
+    unsigned int font_weight;
+} svg_cairo_gstate_t;
+
 typedef struct svg_cairo_state {
-    cairo_surface_t *child_surface;
+    /* pooled layer of a group with opacity, and where it goes */
+    cairo_t *child_cr;
+    svg_bounding_box_t child_box;
     cairo_t *saved_cr;
 
+    /* whether a transform or clip made us cairo_save, and what had
+       been applied to the context before that */
+    int gstate_saved;
+    svg_cairo_gstate_t saved_gstate;
+
     svg_color_t color;
 
     svg_paint_t fill_paint;
@@ -51,15 +77,8 @@ typedef struct svg_cairo_state {
     double fill_opacity;
     double stroke_opacity;
 
-    char *font_family;
-    double font_size;
-    svg_font_style_t font_style;
-    unsigned int font_weight;
-    int font_dirty;
-
-    double *dash;
-    int num_dashes;
-    double dash_offset;
+    /* the font family and dashes are interned, see svg_cairo_state.c */
+    svg_cairo_gstate_t gstate;
 
     double opacity;
 
@@ -68,19 +87,163 @@ typedef struct svg_cairo_state {
 
     int bbox;
 
-    svg_text_anchor_t text_anchor;
+    /* what 1% comes to, for each svg_length_orientation_t, in the
+       viewport or the unit bounding box as bbox says */
+    double percent[3];
+
+    /* whether what cr draws is clipped to exactly clip_box, whole
+       device pixels of its target, and nothing else */
+    int clip_boxed;
+    svg_bounding_box_t clip_box;
 
-    struct svg_cairo_state *next;
+    svg_text_anchor_t text_anchor;
 } svg_cairo_state_t;
 
+/* An immutable value shared by every state using it */
+typedef struct svg_cairo_interned {
+    struct svg_cairo_interned *next;
+    size_t size;
+    union {
+	double dash[1];
+	char str[1];
+    } u;
+} svg_cairo_interned_t;
+
+/* A <pattern> rendered into a repeating surface pattern, with the
+   opacity of the fill or stroke it is for */
+typedef struct svg_cairo_pattern_tile {
+    svg_element_t *pattern_element;
+    int width;
+    int height;
+    double opacity;
+    cairo_pattern_t *pattern;
+
+    struct svg_cairo_pattern_tile *next;
+} svg_cairo_pattern_tile_t;
+
+/* A gradient with its stops, spread and filter set up in unit
+   geometry, which leaves only the pattern matrix to set per use */
+typedef struct svg_cairo_gradient_pattern {
+    svg_gradient_t *gradient;
+    double focus_x;
+    double focus_y;
+    cairo_pattern_t *pattern;
+
+    struct svg_cairo_gradient_pattern *next;
+} svg_cairo_gradient_pattern_t;
+
+/* The font of a text state, resolved for one transform */
+typedef struct svg_cairo_scaled_font {
+    const char *font_family;
+    double font_size;
+    svg_font_style_t font_style;
+    unsigned int font_weight;
+    double xx, yx, xy, yy;
+    cairo_scaled_font_t *scaled_font;
+
+    struct svg_cairo_scaled_font *next;
+} svg_cairo_scaled_font_t;
+
+/* A string as glyphs of a scaled font, laid out from the origin */
+typedef struct svg_cairo_glyph_run {
+    cairo_scaled_font_t *scaled_font;
+    unsigned long hash;
+    cairo_glyph_t *glyphs;
+    int num_glyphs;
+    double x_advance;
+    double y_advance;
+
+    struct svg_cairo_glyph_run *next;
+    char utf8[1];
+} svg_cairo_glyph_run_t;
+
+/* Splats waiting to go onto cr, see svg_cairo_splat.c */
+typedef struct svg_cairo_splats {
+    cairo_t *cr;
+    cairo_t *buffer;
+    int x;
+    int y;
+    int width;
+    int height;
+    svg_bounding_box_t dirty;
+} svg_cairo_splats_t;
+
 struct svg_cairo {
     svg_t *svg;
     cairo_t *cr;
+    /* the context the render was given, under any layers */
+    cairo_t *target_cr;
+
+    /* what the style has set on cr so far */
+    svg_cairo_gstate_t gstate;
 
+    /* the top of the state stack, in chunks that never move */
     svg_cairo_state_t *state;
+    svg_cairo_state_t **state_chunks;
+    unsigned int num_states;
+    unsigned int num_state_chunks;
+
+    svg_cairo_interned_t *interned;
+    unsigned int num_interned;
+
+    /* heap allocations made during the last render */
+    unsigned int allocations;
 
     unsigned int viewport_width;
     unsigned int viewport_height;
+
+    /* what one of each absolute svg_length_unit_t comes to at dpi */
+    double dpi;
+    double unit_pixels[SVG_LENGTH_UNIT_PX + 1];
+
+    /* device extents of the last path or image drawn */
+    svg_bounding_box_t last_bbox;
+
+    /* user space extents of the path being painted, if known */
+    double path_x1, path_y1, path_x2, path_y2;
+    int path_extents_valid;
+
+    svg_cairo_surface_pool_t *pool;
+    int owns_pool;
+
+    /* the document recorded by svg_cairo_render, if recording */
+    int record;
+    double record_scale;
+    cairo_surface_t *recording;
+    unsigned int recording_serial;
+
+    /* the target of the last render, held on to, and what the user
+       space it drew in came to there, for svg_cairo_render_damage */
+    cairo_surface_t *damage_target;
+    cairo_matrix_t damage_matrix;
+
+    /* how much finer than the current transform pattern tiles get */
+    double raster_scale;
+
+    svg_cairo_quality_t quality;
+    cairo_filter_t filter;
+    /* in device pixels, thinner strokes are not drawn */
+    double min_stroke_width;
+
+    svg_cairo_splats_t splats;
+
+    /* most recently used first, all from the same document serial */
+    svg_cairo_pattern_tile_t *pattern_tiles;
+    unsigned int num_pattern_tiles;
+    /* how many tiles are being rendered, one inside the other */
+    unsigned int pattern_depth;
+    svg_cairo_gradient_pattern_t *gradient_patterns;
+    unsigned int num_gradient_patterns;
+    unsigned int paint_cache_serial;
+
+    /* kept across documents, fonts and text not depending on them */
+    svg_cairo_scaled_font_t *scaled_fonts;
+    unsigned int num_scaled_fonts;
+    svg_cairo_glyph_run_t **glyph_runs;
+    unsigned int num_glyph_runs;
+    /* where a run gets placed for drawing */
+    cairo_glyph_t *glyphs;
+    int glyphs_size;
 };
 
 /* svg_cairo_sprintf_alloc.c */
@@ -93,26 +256,54 @@ _svg_cairo_vsprintf_alloc (char **str, const char *fmt, va_list ap);
 
 /* svg_cairo_state.c */
 
-svg_cairo_status_t
-_svg_cairo_state_create (svg_cairo_state_t **state);
+void *
+_svg_cairo_alloc (svg_cairo_t *svg_cairo, size_t size);
 
 svg_cairo_status_t
 _svg_cairo_state_init (svg_cairo_state_t *state);
 
-svg_cairo_status_t
-_svg_cairo_state_init_copy (svg_cairo_state_t *state, const svg_cairo_state_t *other);
-
 svg_cairo_status_t
 _svg_cairo_state_deinit (svg_cairo_state_t *state);
 
-svg_cairo_status_t
-_svg_cairo_state_destroy (svg_cairo_state_t *state);
-
 svg_cairo_state_t *
-_svg_cairo_state_push (svg_cairo_state_t *state);
+_svg_cairo_state_push (svg_cairo_t *svg_cairo);
 
 svg_cairo_state_t *
-_svg_cairo_state_pop (svg_cairo_state_t *state);
+_svg_cairo_state_pop (svg_cairo_t *svg_cairo);
+
+void
+_svg_cairo_state_stack_fini (svg_cairo_t *svg_cairo);
+
+const char *
+_svg_cairo_intern_string (svg_cairo_t *svg_cairo, const char *str);
+
+const double *
+_svg_cairo_intern_dash (svg_cairo_t *svg_cairo, const double *dash, int num_dashes);
+
+int
+_svg_cairo_interned_trim (svg_cairo_t *svg_cairo);
+
+/* svg_cairo_splat.c */
+
+svg_status_t
+_svg_cairo_splat (svg_cairo_t		*svg_cairo,
+		  const svg_rect_t	*rect,
+		  const svg_color_t	*color,
+		  double		opacity);
+
+void
+_svg_cairo_splats_flush (svg_cairo_t *svg_cairo);
+
+/* svg_cairo_surface_pool.c */
+
+cairo_t *
+_svg_cairo_surface_pool_acquire (svg_cairo_surface_pool_t *pool,
+				 int width, int height,
+				 int used_width, int used_height);
+
+/* svg_cairo_pixels.c */
 
+void
+_svg_cairo_argb32_to_rgba8888 (unsigned char *data, int width, int height, int stride);
 
 #endif
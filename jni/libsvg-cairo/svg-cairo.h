@@ -69,6 +69,15 @@ svg_cairo_parse_chunk_end   (svg_cairo_t *svg_cairo);
 svg_cairo_status_t
 svg_cairo_render (svg_cairo_t *svg_cairo, cairo_t *xrs);
 
+/* Draws what the edits since the last render changed, see
+ * svg_render_damage, over what that render left on the target of cr.
+ * The damage is cleared to transparent first, so anything the caller
+ * put under the document there is lost. Given another target or
+ * transform than the last render, or with recording on, it draws the
+ * document in full, over a cleared target. */
+svg_cairo_status_t
+svg_cairo_render_damage (svg_cairo_t *svg_cairo, cairo_t *cr);
+
 /* XXX: Ugh... this inconsistent interface needs to be cleaned up. */
 svg_cairo_status_t
 svg_cairo_set_viewport_dimension (svg_cairo_t *svg_cairo, unsigned int width, unsigned int height);
@@ -78,6 +87,199 @@ svg_cairo_get_size (svg_cairo_t  *svg_cairo,
 		    unsigned int *width,
 		    unsigned int *height);
 
+void
+svg_cairo_get_render_stats (svg_cairo_t *svg_cairo, svg_render_stats_t *stats);
+
+/* A cache of offscreen image surfaces, reused for group layers and
+ * pattern tiles during a render, and across renders by anyone sharing
+ * the pool. Idle surfaces beyond max_bytes are freed, least recently
+ * used first. A pool is not thread-safe. */
+typedef struct svg_cairo_surface_pool svg_cairo_surface_pool_t;
+
+typedef struct svg_cairo_surface_pool_stats {
+    unsigned int hits;
+    unsigned int misses;
+    size_t bytes;
+    size_t max_bytes;
+} svg_cairo_surface_pool_stats_t;
+
+#define SVG_CAIRO_SURFACE_POOL_DEFAULT_MAX_BYTES (32 * 1024 * 1024)
+
+svg_cairo_status_t
+svg_cairo_surface_pool_create (svg_cairo_surface_pool_t **pool, size_t max_bytes);
+
+void
+svg_cairo_surface_pool_destroy (svg_cairo_surface_pool_t *pool);
+
+void
+svg_cairo_surface_pool_set_max_bytes (svg_cairo_surface_pool_t *pool, size_t max_bytes);
+
+void
+svg_cairo_surface_pool_get_stats (svg_cairo_surface_pool_t	 *pool,
+				  svg_cairo_surface_pool_stats_t *stats);
+
+/* Returns a context drawing on an ARGB32 image surface of exactly
+ * width x height, whose contents are undefined, or NULL if out of
+ * memory. Hand it back with svg_cairo_surface_pool_release instead of
+ * destroying it. */
+cairo_t *
+svg_cairo_surface_pool_acquire (svg_cairo_surface_pool_t *pool, int width, int height);
+
+void
+svg_cairo_surface_pool_release (svg_cairo_surface_pool_t *pool, cairo_t *cr);
+
+/* Use pool, which the caller keeps ownership of, instead of the one
+ * every svg_cairo_t starts out with. NULL goes back to a private
+ * pool. */
+svg_cairo_status_t
+svg_cairo_set_surface_pool (svg_cairo_t *svg_cairo, svg_cairo_surface_pool_t *pool);
+
+svg_cairo_surface_pool_t *
+svg_cairo_get_surface_pool (svg_cairo_t *svg_cairo);
+
+/* With recording on, svg_cairo_render draws the document once into a
+ * cairo recording surface in user space, clipped to svg_cairo_get_size,
+ * and from then on replays it under the transform of whatever context
+ * it is given, until the document changes. Pattern tiles are recorded
+ * as pixels, detailed enough to be replayed at up to max_scale.
+ * Bounding boxes are those of the recording pass. */
+svg_cairo_status_t
+svg_cairo_set_recording (svg_cairo_t *svg_cairo, int enabled, double max_scale);
+
+/* How much precision svg_cairo_render spends: the curve flattening
+ * tolerance, the antialiasing, the filter images and gradients are
+ * sampled with and, at FAST, whether strokes thinner than a quarter
+ * of a device pixel are drawn at all. FAST is meant for thumbnails,
+ * where it also flattens more coarsely the smaller the output is. */
+typedef enum svg_cairo_quality {
+    SVG_CAIRO_QUALITY_FAST,
+    SVG_CAIRO_QUALITY_DEFAULT,
+    SVG_CAIRO_QUALITY_BEST
+} svg_cairo_quality_t;
+
+svg_cairo_status_t
+svg_cairo_set_quality (svg_cairo_t *svg_cairo, svg_cairo_quality_t quality);
+
+/* Level of detail for small outputs, see svg_set_lod. Elements and
+ * groups spanning no more than threshold device pixels either way are
+ * left out, or with SPLAT drawn as a box in their average color. With
+ * recording on, sizes are those of the recording pass. */
+typedef enum svg_cairo_lod {
+    SVG_CAIRO_LOD_NONE = SVG_LOD_NONE,
+    SVG_CAIRO_LOD_SKIP = SVG_LOD_SKIP,
+    SVG_CAIRO_LOD_SPLAT = SVG_LOD_SPLAT
+} svg_cairo_lod_t;
+
+svg_cairo_status_t
+svg_cairo_set_lod (svg_cairo_t *svg_cairo, svg_cairo_lod_t lod, double threshold);
+
+/* Skipping what opaque rectangles paint over, see
+ * svg_set_occlusion_culling. Doesn't apply to recordings. */
+svg_cairo_status_t
+svg_cairo_set_occlusion_culling (svg_cairo_t *svg_cairo, int enabled);
+
+/* Resolution absolute units are drawn at, see svg_set_dpi */
+svg_cairo_status_t
+svg_cairo_set_dpi (svg_cairo_t *svg_cairo, double dpi);
+
+/* Starts decoding the document's images for a render at scale, see
+ * svg_prefetch_images. Call it once parsed, as early as possible. */
+svg_cairo_status_t
+svg_cairo_prefetch_images (svg_cairo_t *svg_cairo, double scale, unsigned int threads);
+
+/* Pixel layouts svg_cairo_render_pixels can write. ARGB32 is cairo's
+ * own, premultiplied in native-endian 32-bit words. RGBA8888 is R, G,
+ * B, A bytes with straight alpha, as Android bitmaps are laid out.
+ * RGB565 is for opaque documents: what they leave transparent comes
+ * out black. A8 keeps the coverage only, for masks and icons. */
+typedef enum svg_cairo_pixel_format {
+    SVG_CAIRO_PIXEL_FORMAT_ARGB32,
+    SVG_CAIRO_PIXEL_FORMAT_RGBA8888,
+    SVG_CAIRO_PIXEL_FORMAT_RGB565,
+    SVG_CAIRO_PIXEL_FORMAT_A8
+} svg_cairo_pixel_format_t;
+
+int
+svg_cairo_pixel_format_bytes_per_pixel (svg_cairo_pixel_format_t format);
+
+/* Renders the document into width x height pixels of format at data,
+ * rows stride bytes apart, under matrix (the identity if NULL). The
+ * pixels are cleared first. */
+svg_cairo_status_t
+svg_cairo_render_pixels (svg_cairo_t			*svg_cairo,
+			 const cairo_matrix_t		*matrix,
+			 svg_cairo_pixel_format_t	format,
+			 unsigned char			*data,
+			 int				width,
+			 int				height,
+			 int				stride);
+
+/* How svg_cairo_write_png encodes. compression_level is zlib's, 0 to
+ * 9, or -1 for its default. The DEFAULT strategy is libpng's. RLE at
+ * level 1 is the fast choice for icons, which are mostly runs of one
+ * color. ADAPTIVE picks a filter per row, or none for palette images.
+ * With reduce_color_type the pixels are written as a palette, gray or
+ * RGB where that loses nothing, else as RGBA. Large images are
+ * deflated on up to threads threads, 0 for one per CPU, in bands of
+ * rows that make one IDAT chunk each. */
+typedef enum svg_cairo_png_strategy {
+    SVG_CAIRO_PNG_STRATEGY_DEFAULT,
+    SVG_CAIRO_PNG_STRATEGY_FILTERED,
+    SVG_CAIRO_PNG_STRATEGY_HUFFMAN_ONLY,
+    SVG_CAIRO_PNG_STRATEGY_RLE
+} svg_cairo_png_strategy_t;
+
+typedef enum svg_cairo_png_filter {
+    SVG_CAIRO_PNG_FILTER_NONE,
+    SVG_CAIRO_PNG_FILTER_SUB,
+    SVG_CAIRO_PNG_FILTER_UP,
+    SVG_CAIRO_PNG_FILTER_AVG,
+    SVG_CAIRO_PNG_FILTER_PAETH,
+    SVG_CAIRO_PNG_FILTER_ADAPTIVE
+} svg_cairo_png_filter_t;
+
+typedef struct svg_cairo_png_options {
+    int compression_level;
+    svg_cairo_png_strategy_t strategy;
+    svg_cairo_png_filter_t filter;
+    int reduce_color_type;
+    unsigned int threads;
+} svg_cairo_png_options_t;
+
+/* Default level and strategy, adaptive filtering, reduced color type,
+ * one thread */
+void
+svg_cairo_png_options_init (svg_cairo_png_options_t *options);
+
+/* Writes an ARGB32 or RGB24 image surface as a PNG through write_func,
+ * with options, or the defaults if NULL */
+svg_cairo_status_t
+svg_cairo_write_png (cairo_surface_t			*surface,
+		     const svg_cairo_png_options_t	*options,
+		     cairo_write_func_t			write_func,
+		     void				*closure);
+
+/* How svg_cairo_write_jpeg encodes. quality is libjpeg's, 1 to 100.
+ * JPEG has no alpha, so the image is flattened over background, an
+ * opaque 0xRRGGBB color. */
+typedef struct svg_cairo_jpeg_options {
+    int quality;
+    unsigned int background;
+} svg_cairo_jpeg_options_t;
+
+/* Quality 90 over white */
+void
+svg_cairo_jpeg_options_init (svg_cairo_jpeg_options_t *options);
+
+/* Writes an ARGB32 or RGB24 image surface as a baseline JPEG through
+ * write_func, with options, or the defaults if NULL. The rows are
+ * encoded straight from the surface, with no copy of the image. */
+svg_cairo_status_t
+svg_cairo_write_jpeg (cairo_surface_t			*surface,
+		      const svg_cairo_jpeg_options_t	*options,
+		      cairo_write_func_t		write_func,
+		      void				*closure);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,17 +19,22 @@
  * Author: Carl D. Worth <cworth@isi.edu>
  */
 
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pixman.h>
+
 #include "svg-cairo-internal.h"
 #include "math.h"
 
 static svg_status_t
-_svg_cairo_begin_group (void *closure, double opacity);
+_svg_cairo_begin_group (void *closure, double opacity, const svg_rect_t *extents);
 
 static svg_status_t
-_svg_cairo_begin_element (void *closure);
+_svg_cairo_begin_element (void *closure, void *path_cache);
 
 static svg_status_t
 _svg_cairo_end_element (void *closure);
@@ -74,6 +79,9 @@ _svg_path_arc_segment (cairo_t *cr,
 static svg_status_t
 _svg_cairo_close_path (void *closure);
 
+static svg_status_t
+_svg_cairo_free_path_cache (void *closure, void **path_cache);
+
 static svg_status_t
 _svg_cairo_set_color (void *closure, const svg_color_t *color);
 
@@ -131,6 +139,13 @@ _svg_cairo_set_stroke_width (void *closure, svg_length_t *width);
 static svg_status_t
 _svg_cairo_set_text_anchor (void *closure, svg_text_anchor_t text_anchor);
 
+static svg_status_t
+_svg_cairo_apply_clip_box (void *closure,
+			   svg_length_t *x,
+			   svg_length_t *y,
+			   svg_length_t *width,
+			   svg_length_t *height);
+
 static svg_status_t
 _svg_cairo_transform (void *closure,
 		      double a, double b,
@@ -154,7 +169,7 @@ _svg_cairo_render_line (void *closure,
 			svg_length_t *x2_len, svg_length_t *y2_len);
 
 static svg_status_t
-_svg_cairo_render_path (void *closure);
+_svg_cairo_render_path (void *closure, void **path_cache);
 
 static svg_status_t
 _svg_cairo_render_ellipse (void *closure,
@@ -188,19 +203,87 @@ _svg_cairo_render_image (void		*closure,
 			 svg_length_t	*width,
 			 svg_length_t	*height);
 
+static int
+_svg_cairo_get_last_bounding_box (void *closure, svg_bounding_box_t *bbox);
+
+static int
+_svg_cairo_get_rect_bounding_box (void *closure, const svg_rect_t *rect, svg_bounding_box_t *bbox);
+
+static svg_status_t
+_svg_cairo_render_splat (void		    *closure,
+			 const svg_rect_t   *rect,
+			 const svg_color_t  *color,
+			 double		    opacity);
+
+static int
+_svg_cairo_get_rect_covered_box (void *closure, const svg_rect_t *rect, svg_bounding_box_t *bbox);
+
+static svg_status_t
+_svg_cairo_clip_damage (void *closure, const svg_bounding_box_t *box);
+
 static svg_status_t
 _cairo_status_to_svg_status (cairo_status_t xr_status);
 
 static svg_status_t
-_svg_cairo_push_state (svg_cairo_t     *svg_cairo,
-		       cairo_surface_t *child_surface);
+_svg_cairo_push_state (svg_cairo_t *svg_cairo,
+		       cairo_t     *child_cr);
 
 static svg_status_t
 _svg_cairo_pop_state (svg_cairo_t *svg_cairo);
 
+static void
+_svg_cairo_save_gstate (svg_cairo_t *svg_cairo);
+
+static void
+_svg_cairo_apply_gstate (svg_cairo_t *svg_cairo);
+
+static void
+_svg_cairo_invalidate_gstate (svg_cairo_t *svg_cairo);
+
+static void
+_svg_cairo_apply_quality (svg_cairo_t *svg_cairo, cairo_t *cr);
+
+static int
+_svg_cairo_stroke_is_visible (svg_cairo_t *svg_cairo);
+
 static svg_status_t
 _svg_cairo_length_to_pixel (svg_cairo_t *svg_cairo, svg_length_t *length, double *pixel);
 
+static void
+_svg_cairo_update_dpi (svg_cairo_t *svg_cairo);
+
+static void
+_svg_cairo_update_percent (svg_cairo_state_t *state);
+
+static int
+_svg_cairo_pixel_box (cairo_t *cr,
+		      double x1, double y1,
+		      double x2, double y2,
+		      int *left, int *top, int *right, int *bottom);
+
+static void
+_svg_cairo_clip_init (svg_cairo_t *svg_cairo);
+
+static void
+_svg_cairo_clip_intersect (svg_cairo_t *svg_cairo,
+			   double x1, double y1,
+			   double x2, double y2);
+
+static void
+_svg_cairo_user_to_device_bbox (svg_cairo_t *svg_cairo,
+				double x1, double y1,
+				double x2, double y2,
+				svg_bounding_box_t *bbox);
+
+static void
+_svg_cairo_pattern_tiles_clear (svg_cairo_t *svg_cairo);
+
+static void
+_svg_cairo_gradient_patterns_clear (svg_cairo_t *svg_cairo);
+
+static void
+_svg_cairo_text_cache_clear (svg_cairo_t *svg_cairo);
+
 static svg_render_engine_t SVG_CAIRO_RENDER_ENGINE = {
     /* hierarchy */
     _svg_cairo_begin_group,
@@ -214,6 +297,7 @@ static svg_render_engine_t SVG_CAIRO_RENDER_ENGINE = {
     _svg_cairo_quadratic_curve_to,
     _svg_cairo_arc_to,
     _svg_cairo_close_path,
+    _svg_cairo_free_path_cache,
     /* style */
     _svg_cairo_set_color,
     _svg_cairo_set_fill_opacity,
@@ -234,6 +318,7 @@ static svg_render_engine_t SVG_CAIRO_RENDER_ENGINE = {
     _svg_cairo_set_stroke_width,
     _svg_cairo_set_text_anchor,
     /* transform */
+    _svg_cairo_apply_clip_box,
     _svg_cairo_transform,
     _svg_cairo_apply_view_box,
     _svg_cairo_set_viewport_dimension,
@@ -243,7 +328,13 @@ static svg_render_engine_t SVG_CAIRO_RENDER_ENGINE = {
     _svg_cairo_render_ellipse,
     _svg_cairo_render_rect,
     _svg_cairo_render_text,
-    _svg_cairo_render_image
+    _svg_cairo_render_image,
+    /* extents */
+    _svg_cairo_get_last_bounding_box,
+    _svg_cairo_get_rect_bounding_box,
+    _svg_cairo_render_splat,
+    _svg_cairo_get_rect_covered_box,
+    _svg_cairo_clip_damage
 };
 
 svg_cairo_status_t
@@ -257,16 +348,61 @@ svg_cairo_create (svg_cairo_t **svg_cairo)
     }
 
     (*svg_cairo)->cr = NULL;
+    (*svg_cairo)->target_cr = NULL;
     (*svg_cairo)->state = NULL;
+    (*svg_cairo)->state_chunks = NULL;
+    (*svg_cairo)->num_states = 0;
+    (*svg_cairo)->num_state_chunks = 0;
+    (*svg_cairo)->interned = NULL;
+    (*svg_cairo)->num_interned = 0;
+    (*svg_cairo)->allocations = 0;
     /* XXX: These arbitrary constants don't belong. The viewport
      * handling should be reworked. */
     (*svg_cairo)->viewport_width = 450;
     (*svg_cairo)->viewport_height = 450;
+    memset (&(*svg_cairo)->last_bbox, 0, sizeof (svg_bounding_box_t));
+    (*svg_cairo)->path_extents_valid = 0;
  
     status = svg_create (&(*svg_cairo)->svg);
     if (status)
 	return status;
 
+    (*svg_cairo)->dpi = 0.0;
+    _svg_cairo_update_dpi (*svg_cairo);
+
+    status = svg_cairo_surface_pool_create (&(*svg_cairo)->pool,
+					    SVG_CAIRO_SURFACE_POOL_DEFAULT_MAX_BYTES);
+    if (status)
+	return status;
+    (*svg_cairo)->owns_pool = 1;
+
+    (*svg_cairo)->record = 0;
+    (*svg_cairo)->record_scale = 1.0;
+    (*svg_cairo)->recording = NULL;
+    (*svg_cairo)->recording_serial = 0;
+    (*svg_cairo)->damage_target = NULL;
+    (*svg_cairo)->raster_scale = 1.0;
+
+    (*svg_cairo)->quality = SVG_CAIRO_QUALITY_DEFAULT;
+    (*svg_cairo)->filter = CAIRO_FILTER_BILINEAR;
+    (*svg_cairo)->min_stroke_width = 0.0;
+    (*svg_cairo)->splats.cr = NULL;
+    (*svg_cairo)->splats.buffer = NULL;
+
+    (*svg_cairo)->pattern_tiles = NULL;
+    (*svg_cairo)->num_pattern_tiles = 0;
+    (*svg_cairo)->pattern_depth = 0;
+    (*svg_cairo)->gradient_patterns = NULL;
+    (*svg_cairo)->num_gradient_patterns = 0;
+    (*svg_cairo)->paint_cache_serial = 0;
+
+    (*svg_cairo)->scaled_fonts = NULL;
+    (*svg_cairo)->num_scaled_fonts = 0;
+    (*svg_cairo)->glyph_runs = NULL;
+    (*svg_cairo)->num_glyph_runs = 0;
+    (*svg_cairo)->glyphs = NULL;
+    (*svg_cairo)->glyphs_size = 0;
+
     _svg_cairo_push_state (*svg_cairo, NULL);
 
     return SVG_CAIRO_STATUS_SUCCESS;
@@ -278,9 +414,22 @@ svg_cairo_destroy (svg_cairo_t *svg_cairo)
     svg_cairo_status_t status;
 
     _svg_cairo_pop_state (svg_cairo);
+    _svg_cairo_state_stack_fini (svg_cairo);
+
+    _svg_cairo_pattern_tiles_clear (svg_cairo);
+    _svg_cairo_gradient_patterns_clear (svg_cairo);
+    _svg_cairo_text_cache_clear (svg_cairo);
+
+    if (svg_cairo->recording)
+	cairo_surface_destroy (svg_cairo->recording);
+    if (svg_cairo->damage_target)
+	cairo_surface_destroy (svg_cairo->damage_target);
 
     status = svg_destroy (svg_cairo->svg);
 
+    if (svg_cairo->owns_pool)
+	svg_cairo_surface_pool_destroy (svg_cairo->pool);
+
     free (svg_cairo);
 
     return status;
@@ -322,11 +471,278 @@ svg_cairo_parse_chunk_end (svg_cairo_t *svg_cairo)
     return svg_parse_chunk_end (svg_cairo->svg);
 }
 
+static svg_status_t
+_svg_cairo_render_document (svg_cairo_t *svg_cairo, cairo_t *cr, int damage)
+{
+    svg_status_t status;
+
+    svg_cairo->cr = cr;
+    svg_cairo->target_cr = cr;
+    svg_cairo->allocations = 0;
+    /* scaled fonts are looked up by their interned family */
+    if (_svg_cairo_interned_trim (svg_cairo))
+	_svg_cairo_text_cache_clear (svg_cairo);
+    _svg_cairo_update_dpi (svg_cairo);
+
+    /* the style goes onto cr lazily, and only ever comes off of it
+       here */
+    cairo_save (cr);
+    _svg_cairo_invalidate_gstate (svg_cairo);
+    _svg_cairo_apply_quality (svg_cairo, cr);
+    _svg_cairo_clip_init (svg_cairo);
+
+    if (damage)
+	status = svg_render_damage (svg_cairo->svg, &SVG_CAIRO_RENDER_ENGINE, svg_cairo);
+    else
+	status = svg_render (svg_cairo->svg, &SVG_CAIRO_RENDER_ENGINE, svg_cairo);
+    _svg_cairo_splats_flush (svg_cairo);
+
+    cairo_restore (cr);
+
+    return status;
+}
+
+/* Brings the recording up to date with the document */
+static svg_status_t
+_svg_cairo_record (svg_cairo_t *svg_cairo)
+{
+    svg_status_t status;
+    cairo_rectangle_t extents;
+    cairo_surface_t *recording;
+    cairo_t *cr;
+    unsigned int serial = svg_get_serial (svg_cairo->svg);
+    unsigned int width, height;
+    double image_scale;
+
+    if (svg_cairo->recording && svg_cairo->recording_serial == serial)
+	return SVG_STATUS_SUCCESS;
+
+    if (svg_cairo->recording) {
+	cairo_surface_destroy (svg_cairo->recording);
+	svg_cairo->recording = NULL;
+    }
+
+    svg_cairo_get_size (svg_cairo, &width, &height);
+    extents.x = 0;
+    extents.y = 0;
+    extents.width = width;
+    extents.height = height;
+
+    recording = cairo_recording_surface_create (CAIRO_CONTENT_COLOR_ALPHA, &extents);
+    cr = cairo_create (recording);
+
+    /* the caller's image scale is for direct renders, leave it be */
+    image_scale = svg_get_image_scale (svg_cairo->svg);
+    svg_cairo->raster_scale = svg_cairo->record_scale;
+    svg_set_image_scale (svg_cairo->svg, svg_cairo->record_scale);
+    status = _svg_cairo_render_document (svg_cairo, cr, 0);
+    svg_set_image_scale (svg_cairo->svg, image_scale);
+    svg_cairo->raster_scale = 1.0;
+
+    if (status == SVG_STATUS_SUCCESS)
+	status = _cairo_status_to_svg_status (cairo_status (cr));
+    cairo_destroy (cr);
+
+    if (status) {
+	cairo_surface_destroy (recording);
+	return status;
+    }
+
+    svg_cairo->recording = recording;
+    svg_cairo->recording_serial = serial;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+/* What the user space of cr comes to on its target, device offset
+   included */
+static void
+_svg_cairo_get_target_matrix (cairo_t *cr, cairo_matrix_t *matrix)
+{
+    double offset_x, offset_y;
+
+    cairo_get_matrix (cr, matrix);
+    cairo_surface_get_device_offset (cairo_get_target (cr), &offset_x, &offset_y);
+    matrix->x0 += offset_x;
+    matrix->y0 += offset_y;
+}
+
+/* Remembers what cr drew on, or with NULL that the last render can't
+   be drawn over */
+static void
+_svg_cairo_set_damage_target (svg_cairo_t *svg_cairo, cairo_t *cr)
+{
+    if (svg_cairo->damage_target)
+	cairo_surface_destroy (svg_cairo->damage_target);
+    svg_cairo->damage_target = NULL;
+
+    if (cr) {
+	svg_cairo->damage_target = cairo_surface_reference (cairo_get_target (cr));
+	_svg_cairo_get_target_matrix (cr, &svg_cairo->damage_matrix);
+    }
+}
+
+static int
+_svg_cairo_is_damage_target (svg_cairo_t *svg_cairo, cairo_t *cr)
+{
+    cairo_matrix_t matrix;
+
+    if (svg_cairo->damage_target != cairo_get_target (cr))
+	return 0;
+
+    _svg_cairo_get_target_matrix (cr, &matrix);
+
+    return matrix.xx == svg_cairo->damage_matrix.xx &&
+	matrix.yx == svg_cairo->damage_matrix.yx &&
+	matrix.xy == svg_cairo->damage_matrix.xy &&
+	matrix.yy == svg_cairo->damage_matrix.yy &&
+	matrix.x0 == svg_cairo->damage_matrix.x0 &&
+	matrix.y0 == svg_cairo->damage_matrix.y0;
+}
+
 svg_cairo_status_t
 svg_cairo_render (svg_cairo_t *svg_cairo, cairo_t *cr)
 {
-    svg_cairo->cr = cr;
-    return svg_render (svg_cairo->svg, &SVG_CAIRO_RENDER_ENGINE, svg_cairo);
+    svg_status_t status;
+
+    if (! svg_cairo->record) {
+	_svg_cairo_set_damage_target (svg_cairo, cr);
+	return _svg_cairo_render_document (svg_cairo, cr, 0);
+    }
+
+    _svg_cairo_set_damage_target (svg_cairo, NULL);
+    status = _svg_cairo_record (svg_cairo);
+    if (status)
+	return status;
+
+    cairo_save (cr);
+    cairo_set_source_surface (cr, svg_cairo->recording, 0, 0);
+    cairo_paint (cr);
+    cairo_restore (cr);
+
+    return _cairo_status_to_svg_status (cairo_status (cr));
+}
+
+svg_cairo_status_t
+svg_cairo_render_damage (svg_cairo_t *svg_cairo, cairo_t *cr)
+{
+    /* a replay can only be had in full, over a cleared target */
+    if (svg_cairo->record) {
+	cairo_save (cr);
+	cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint (cr);
+	cairo_restore (cr);
+	return svg_cairo_render (svg_cairo, cr);
+    }
+
+    if (! _svg_cairo_is_damage_target (svg_cairo, cr)) {
+	svg_damage_all (svg_cairo->svg);
+	_svg_cairo_set_damage_target (svg_cairo, cr);
+    }
+
+    return _svg_cairo_render_document (svg_cairo, cr, 1);
+}
+
+svg_cairo_status_t
+svg_cairo_set_recording (svg_cairo_t *svg_cairo, int enabled, double max_scale)
+{
+    if (max_scale < 1.0)
+	max_scale = 1.0;
+
+    if (svg_cairo->recording &&
+	(! enabled || max_scale != svg_cairo->record_scale)) {
+	cairo_surface_destroy (svg_cairo->recording);
+	svg_cairo->recording = NULL;
+    }
+
+    svg_cairo->record = enabled;
+    svg_cairo->record_scale = max_scale;
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+svg_cairo_status_t
+svg_cairo_set_quality (svg_cairo_t *svg_cairo, svg_cairo_quality_t quality)
+{
+    switch (quality) {
+    case SVG_CAIRO_QUALITY_FAST:
+	svg_cairo->filter = CAIRO_FILTER_FAST;
+	svg_cairo->min_stroke_width = 0.25;
+	break;
+    case SVG_CAIRO_QUALITY_DEFAULT:
+	svg_cairo->filter = CAIRO_FILTER_BILINEAR;
+	svg_cairo->min_stroke_width = 0.0;
+	break;
+    case SVG_CAIRO_QUALITY_BEST:
+	svg_cairo->filter = CAIRO_FILTER_BEST;
+	svg_cairo->min_stroke_width = 0.0;
+	break;
+    default:
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+    }
+
+    /* the recording and pattern tiles were drawn with the old
+       settings */
+    if (quality != svg_cairo->quality) {
+	if (svg_cairo->recording) {
+	    cairo_surface_destroy (svg_cairo->recording);
+	    svg_cairo->recording = NULL;
+	}
+	_svg_cairo_pattern_tiles_clear (svg_cairo);
+	svg_damage_all (svg_cairo->svg);
+    }
+
+    svg_cairo->quality = quality;
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+svg_cairo_status_t
+svg_cairo_set_lod (svg_cairo_t *svg_cairo, svg_cairo_lod_t lod, double threshold)
+{
+    if (lod != SVG_CAIRO_LOD_NONE && lod != SVG_CAIRO_LOD_SKIP && lod != SVG_CAIRO_LOD_SPLAT)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    /* the recording may be missing what is too small now */
+    if (svg_cairo->recording) {
+	cairo_surface_destroy (svg_cairo->recording);
+	svg_cairo->recording = NULL;
+    }
+
+    svg_set_lod (svg_cairo->svg, (svg_lod_t) lod, threshold);
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+svg_cairo_status_t
+svg_cairo_set_occlusion_culling (svg_cairo_t *svg_cairo, int enabled)
+{
+    svg_set_occlusion_culling (svg_cairo->svg, enabled);
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+svg_cairo_status_t
+svg_cairo_set_dpi (svg_cairo_t *svg_cairo, double dpi)
+{
+    if (dpi <= 0.0)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    /* the recording goes stale with the document serial */
+    svg_set_dpi (svg_cairo->svg, dpi);
+    _svg_cairo_update_dpi (svg_cairo);
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+svg_cairo_status_t
+svg_cairo_prefetch_images (svg_cairo_t *svg_cairo, double scale, unsigned int threads)
+{
+    /* a recording is made at its own scale, whatever it is replayed at */
+    if (svg_cairo->record)
+	scale = svg_cairo->record_scale;
+
+    return svg_prefetch_images (svg_cairo->svg, scale, threads);
 }
 
 static svg_status_t
@@ -344,6 +760,7 @@ _svg_cairo_set_viewport_dimension (void *closure,
        if that accuracy is needed. */
     svg_cairo->state->viewport_width  = (unsigned int)vwidth;
     svg_cairo->state->viewport_height = (unsigned int)vheight;
+    _svg_cairo_update_percent (svg_cairo->state);
 
     return SVG_CAIRO_STATUS_SUCCESS;
 }
@@ -351,9 +768,23 @@ _svg_cairo_set_viewport_dimension (void *closure,
 svg_cairo_status_t
 svg_cairo_set_viewport_dimension (svg_cairo_t *svg_cairo, unsigned int width, unsigned int height)
 {
+    /* percentages in the recording would be off */
+    if (svg_cairo->recording &&
+	(width != svg_cairo->viewport_width || height != svg_cairo->viewport_height)) {
+	cairo_surface_destroy (svg_cairo->recording);
+	svg_cairo->recording = NULL;
+    }
+    if (width != svg_cairo->viewport_width || height != svg_cairo->viewport_height)
+	svg_damage_all (svg_cairo->svg);
+
     svg_cairo->viewport_width = width;
     svg_cairo->viewport_height = height;
 
+    /* outside of a render, the state is the root one */
+    svg_cairo->state->viewport_width = width;
+    svg_cairo->state->viewport_height = height;
+    _svg_cairo_update_percent (svg_cairo->state);
+
     return SVG_CAIRO_STATUS_SUCCESS;
 }
 
@@ -365,6 +796,7 @@ svg_cairo_get_size (svg_cairo_t  *svg_cairo,
     svg_length_t width_len, height_len;
     double width_d, height_d;
 
+    _svg_cairo_update_dpi (svg_cairo);
     svg_get_size (svg_cairo->svg, &width_len, &height_len);
     _svg_cairo_length_to_pixel (svg_cairo, &width_len, &width_d);
     _svg_cairo_length_to_pixel (svg_cairo, &height_len, &height_d);
@@ -372,36 +804,147 @@ svg_cairo_get_size (svg_cairo_t  *svg_cairo,
     *height = (unsigned int) (height_d + 0.5);
 }
 
+void
+svg_cairo_get_render_stats (svg_cairo_t *svg_cairo, svg_render_stats_t *stats)
+{
+    svg_get_render_stats (svg_cairo->svg, stats);
+    stats->allocations = svg_cairo->allocations;
+}
+
+svg_cairo_status_t
+svg_cairo_set_surface_pool (svg_cairo_t *svg_cairo, svg_cairo_surface_pool_t *pool)
+{
+    svg_cairo_status_t status;
+
+    if (pool == NULL) {
+	if (svg_cairo->owns_pool)
+	    return SVG_CAIRO_STATUS_SUCCESS;
+	status = svg_cairo_surface_pool_create (&pool, SVG_CAIRO_SURFACE_POOL_DEFAULT_MAX_BYTES);
+	if (status)
+	    return status;
+	svg_cairo->pool = pool;
+	svg_cairo->owns_pool = 1;
+	return SVG_CAIRO_STATUS_SUCCESS;
+    }
+
+    if (svg_cairo->owns_pool)
+	svg_cairo_surface_pool_destroy (svg_cairo->pool);
+
+    svg_cairo->pool = pool;
+    svg_cairo->owns_pool = 0;
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+svg_cairo_surface_pool_t *
+svg_cairo_get_surface_pool (svg_cairo_t *svg_cairo)
+{
+    return svg_cairo->pool;
+}
+
+/* The device-space box a group layer has to cover: whatever of the
+   group's extents the clip lets through. */
+static void
+_svg_cairo_group_layer_box (svg_cairo_t		*svg_cairo,
+			    const svg_rect_t	*extents,
+			    svg_bounding_box_t	*box)
+{
+    svg_bounding_box_t group_box;
+    double x1, y1, x2, y2;
+
+    cairo_clip_extents (svg_cairo->cr, &x1, &y1, &x2, &y2);
+    _svg_cairo_user_to_device_bbox (svg_cairo, x1, y1, x2, y2, box);
+
+    if (extents) {
+	_svg_cairo_user_to_device_bbox (svg_cairo,
+					extents->x, extents->y,
+					extents->x + extents->width,
+					extents->y + extents->height,
+					&group_box);
+	if (group_box.left > box->left)
+	    box->left = group_box.left;
+	if (group_box.top > box->top)
+	    box->top = group_box.top;
+	if (group_box.right < box->right)
+	    box->right = group_box.right;
+	if (group_box.bottom < box->bottom)
+	    box->bottom = group_box.bottom;
+    }
+
+    /* cairo won't make an empty surface, and an empty group still
+       needs a layer to draw its (invisible) children into */
+    if (box->right <= box->left)
+	box->right = box->left + 1;
+    if (box->bottom <= box->top)
+	box->bottom = box->top + 1;
+}
+
+/* Layer sizes are rounded up to this so that groups of about the same
+   size share pooled surfaces */
+#define SVG_CAIRO_LAYER_GRANULARITY 64
+
+static int
+_svg_cairo_layer_bucket (int size)
+{
+    return (size + SVG_CAIRO_LAYER_GRANULARITY - 1) & ~(SVG_CAIRO_LAYER_GRANULARITY - 1);
+}
+
 static svg_status_t
-_svg_cairo_begin_group (void *closure, double opacity)
+_svg_cairo_begin_group (void *closure, double opacity, const svg_rect_t *extents)
 {
     svg_cairo_t *svg_cairo = closure;
-    cairo_surface_t *child_surface = NULL;
-
-    cairo_save (svg_cairo->cr);
+    cairo_t *child_cr = NULL;
+    svg_bounding_box_t *box = &svg_cairo->state->child_box;
+    svg_bounding_box_t layer_box;
+    int width, height;
+
+    _svg_cairo_splats_flush (svg_cairo);
+
+    /* A recording keeps the group as drawing commands, to be
+     * rasterized at whatever scale it gets replayed at. The layer
+     * is then implied by the cairo state instead of being in ours. */
+    if (opacity != 1.0 &&
+	cairo_surface_get_type (cairo_get_target (svg_cairo->cr)) == CAIRO_SURFACE_TYPE_RECORDING) {
+	cairo_push_group (svg_cairo->cr);
+	svg_cairo->state->child_cr = NULL;
+    } else if (opacity != 1.0) {
+	_svg_cairo_group_layer_box (svg_cairo, extents, box);
+	width = box->right - box->left;
+	height = box->bottom - box->top;
+	child_cr = _svg_cairo_surface_pool_acquire (svg_cairo->pool,
+						    _svg_cairo_layer_bucket (width),
+						    _svg_cairo_layer_bucket (height),
+						    width, height);
+	if (child_cr == NULL)
+	    return SVG_STATUS_NO_MEMORY;
 
-    if (opacity != 1.0) {
-	child_surface = cairo_surface_create_similar (cairo_get_target (svg_cairo->cr),
-						      CAIRO_FORMAT_ARGB32,
-						      svg_cairo->state->viewport_width,
-						      svg_cairo->state->viewport_height);
-	svg_cairo->state->child_surface = child_surface;
+	/* keep drawing in the parent's device space, and only where
+	   the layer will be composited from */
+	cairo_surface_set_device_offset (cairo_get_target (child_cr),
+					 - (double) box->left, - (double) box->top);
+	cairo_rectangle (child_cr, box->left, box->top, width, height);
+	cairo_clip (child_cr);
+	svg_cairo->state->child_cr = child_cr;
+	/* box is in the parent's state, not to be held across a push */
+	layer_box = *box;
     }
 
-    _svg_cairo_push_state (svg_cairo, child_surface);
+    _svg_cairo_push_state (svg_cairo, child_cr);
+
+    if (child_cr) {
+	svg_cairo->state->clip_boxed = 1;
+	svg_cairo->state->clip_box = layer_box;
+    }
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
-/* XXX: begin_element could be made more efficient in that no extra
-   group is needed if there is only one element in a group */
 static svg_status_t
-_svg_cairo_begin_element (void *closure)
+_svg_cairo_begin_element (void *closure, void *path_cache)
 {
     svg_cairo_t *svg_cairo = closure;
 
-    cairo_save (svg_cairo->cr);
-
+    _svg_cairo_splats_flush (svg_cairo);
     _svg_cairo_push_state (svg_cairo, NULL);
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
@@ -414,8 +957,6 @@ _svg_cairo_end_element (void *closure)
 
     _svg_cairo_pop_state (svg_cairo);
 
-    cairo_restore (svg_cairo->cr);
-
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
@@ -424,18 +965,27 @@ _svg_cairo_end_group (void *closure, double opacity)
 {
     svg_cairo_t *svg_cairo = closure;
 
+    _svg_cairo_splats_flush (svg_cairo);
     _svg_cairo_pop_state (svg_cairo);
 
-    cairo_restore (svg_cairo->cr);
+    if (opacity != 1.0 && svg_cairo->state->child_cr == NULL) {
+	/* cairo_push_group saved the style we had applied before it */
+	cairo_pop_group_to_source (svg_cairo->cr);
+	cairo_paint_with_alpha (svg_cairo->cr, opacity);
+	_svg_cairo_invalidate_gstate (svg_cairo);
+    } else if (opacity != 1.0) {
+	svg_bounding_box_t *box = &svg_cairo->state->child_box;
 
-    if (opacity != 1.0) {
 	cairo_save (svg_cairo->cr);
 	cairo_identity_matrix (svg_cairo->cr);
-	cairo_set_source_surface (svg_cairo->cr, svg_cairo->state->child_surface, 0, 0);
+	cairo_rectangle (svg_cairo->cr, box->left, box->top,
+			 box->right - box->left, box->bottom - box->top);
+	cairo_clip (svg_cairo->cr);
+	cairo_set_source_surface (svg_cairo->cr, cairo_get_target (svg_cairo->state->child_cr), 0, 0);
 	cairo_paint_with_alpha (svg_cairo->cr, opacity);
 	cairo_restore (svg_cairo->cr);
-	cairo_surface_destroy (svg_cairo->state->child_surface);
-	svg_cairo->state->child_surface = NULL;
+	svg_cairo_surface_pool_release (svg_cairo->pool, svg_cairo->state->child_cr);
+	svg_cairo->state->child_cr = NULL;
     }
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
@@ -505,6 +1055,17 @@ _svg_cairo_close_path (void *closure)
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
+static svg_status_t
+_svg_cairo_free_path_cache (void *closure, void **path_cache)
+{
+    if (*path_cache) {
+	cairo_path_destroy (*path_cache);
+	*path_cache = NULL;
+    }
+
+    return SVG_STATUS_SUCCESS;
+}
+
 static svg_status_t
 _svg_cairo_set_color (void *closure, const svg_color_t *color)
 {
@@ -532,15 +1093,146 @@ _svg_cairo_set_color_and_alpha (svg_cairo_t *svg_cairo,
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
+/* Gradient patterns are kept per document, at most this many */
+#define SVG_CAIRO_GRADIENT_PATTERNS_MAX 64
+
+/* Drops the cached gradients and pattern tiles once the document has
+   changed since they were made. */
+static void
+_svg_cairo_paint_cache_validate (svg_cairo_t *svg_cairo)
+{
+    unsigned int serial = svg_get_serial (svg_cairo->svg);
+
+    if (svg_cairo->paint_cache_serial != serial) {
+	_svg_cairo_pattern_tiles_clear (svg_cairo);
+	_svg_cairo_gradient_patterns_clear (svg_cairo);
+	svg_cairo->paint_cache_serial = serial;
+    }
+}
+
+static void
+_svg_cairo_gradient_patterns_clear (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_gradient_pattern_t *entry, *next;
+
+    for (entry = svg_cairo->gradient_patterns; entry; entry = next) {
+	next = entry->next;
+	cairo_pattern_destroy (entry->pattern);
+	free (entry);
+    }
+    svg_cairo->gradient_patterns = NULL;
+    svg_cairo->num_gradient_patterns = 0;
+}
+
+/* Creates the cairo pattern for gradient, stops included, running
+   from (x1, y1) to (x2, y2). The radii are ignored for linear
+   gradients. */
+static cairo_pattern_t *
+_svg_cairo_gradient_pattern_create (svg_gradient_t *gradient,
+				    double x1, double y1, double r1,
+				    double x2, double y2, double r2)
+{
+    svg_gradient_stop_t *stop;
+    cairo_pattern_t *pattern;
+    int i;
+
+    if (gradient->type == SVG_GRADIENT_RADIAL)
+	pattern = cairo_pattern_create_radial (x1, y1, r1, x2, y2, r2);
+    else
+	pattern = cairo_pattern_create_linear (x1, y1, x2, y2);
+
+    for (i = 0; i < gradient->num_stops; i++) {
+	stop = &gradient->stops[i];
+	cairo_pattern_add_color_stop_rgba (pattern, stop->offset,
+					   svg_color_get_red (&stop->color) / 255.0,
+					   svg_color_get_green (&stop->color) / 255.0,
+					   svg_color_get_blue (&stop->color) / 255.0,
+					   stop->opacity);
+    }
+	    
+    switch (gradient->spread) {
+    case SVG_GRADIENT_SPREAD_REPEAT:
+	cairo_pattern_set_extend (pattern, CAIRO_EXTEND_REPEAT);
+	break;
+    case SVG_GRADIENT_SPREAD_REFLECT:
+	cairo_pattern_set_extend (pattern, CAIRO_EXTEND_REFLECT);
+	break;
+    default:
+	cairo_pattern_set_extend (pattern, CAIRO_EXTEND_NONE);
+	break;
+    }
+    
+    cairo_pattern_set_filter (pattern, CAIRO_FILTER_BILINEAR);
+
+    return pattern;
+}
+
+/* Returns the unit geometry pattern of gradient, creating it on first
+   use, and moves it to the front so that the least recently used
+   gradients are at the end of the list. A linear gradient runs from
+   (0, 0) to (1, 0), a radial one is centered on (0, 0) with radius 1
+   and its focus at (focus_x, focus_y). The pattern belongs to the
+   cache. */
+static cairo_pattern_t *
+_svg_cairo_gradient_patterns_lookup (svg_cairo_t    *svg_cairo,
+				     svg_gradient_t *gradient,
+				     double	     focus_x,
+				     double	     focus_y)
+{
+    svg_cairo_gradient_pattern_t **prev, *entry;
+
+    _svg_cairo_paint_cache_validate (svg_cairo);
+
+    for (prev = &svg_cairo->gradient_patterns; *prev; prev = &(*prev)->next) {
+	entry = *prev;
+	if (entry->gradient == gradient &&
+	    entry->focus_x == focus_x && entry->focus_y == focus_y) {
+	    *prev = entry->next;
+	    entry->next = svg_cairo->gradient_patterns;
+	    svg_cairo->gradient_patterns = entry;
+	    return entry->pattern;
+	}
+    }
+
+    if (svg_cairo->num_gradient_patterns >= SVG_CAIRO_GRADIENT_PATTERNS_MAX) {
+	for (prev = &svg_cairo->gradient_patterns; (*prev)->next; prev = &(*prev)->next)
+	    ;
+	cairo_pattern_destroy ((*prev)->pattern);
+	free (*prev);
+	*prev = NULL;
+	svg_cairo->num_gradient_patterns--;
+    }
+
+    entry = _svg_cairo_alloc (svg_cairo, sizeof (svg_cairo_gradient_pattern_t));
+    if (entry == NULL)
+	return NULL;
+
+    if (gradient->type == SVG_GRADIENT_RADIAL)
+	entry->pattern = _svg_cairo_gradient_pattern_create (gradient,
+							     focus_x, focus_y, 0.0,
+							     0.0, 0.0, 1.0);
+    else
+	entry->pattern = _svg_cairo_gradient_pattern_create (gradient,
+							     0.0, 0.0, 0.0,
+							     1.0, 0.0, 0.0);
+    entry->gradient = gradient;
+    entry->focus_x = focus_x;
+    entry->focus_y = focus_y;
+    entry->next = svg_cairo->gradient_patterns;
+    svg_cairo->gradient_patterns = entry;
+    svg_cairo->num_gradient_patterns++;
+
+    return entry->pattern;
+}
+
 static svg_status_t
 _svg_cairo_set_gradient (svg_cairo_t *svg_cairo,
 			 svg_gradient_t *gradient,
 			 svg_cairo_render_type_t type)
 {
-    svg_gradient_stop_t *stop;
     cairo_pattern_t *pattern = NULL;
-    cairo_matrix_t matrix, gradient_matrix;
-    int i;
+    cairo_matrix_t matrix, gradient_matrix, geometry_matrix;
+    double x1, y1, x2, y2;
 
     cairo_matrix_init_identity (&matrix);
 
@@ -548,31 +1240,49 @@ _svg_cairo_set_gradient (svg_cairo_t *svg_cairo,
     case SVG_GRADIENT_UNITS_USER:
 	break;
     case SVG_GRADIENT_UNITS_BBOX:
-    {
-	double x1, y1, x2, y2;
-	
-	if (type == SVG_CAIRO_RENDER_TYPE_FILL)
-	    cairo_fill_extents (svg_cairo->cr, &x1, &y1, &x2, &y2);
-	else
-	    cairo_stroke_extents (svg_cairo->cr, &x1, &y1, &x2, &y2);
+	/* The bounding box is that of the geometry alone, as the path
+	 * being painted has it, so strokes don't widen it. */
+	if (svg_cairo->path_extents_valid) {
+	    x1 = svg_cairo->path_x1;
+	    y1 = svg_cairo->path_y1;
+	    x2 = svg_cairo->path_x2;
+	    y2 = svg_cairo->path_y2;
+	} else {
+	    cairo_path_extents (svg_cairo->cr, &x1, &y1, &x2, &y2);
+	}
 
 	cairo_matrix_translate (&matrix, x1, y1);
 	cairo_matrix_scale (&matrix, x2 - x1, y2 - y1);
 	svg_cairo->state->bbox = 1;
-    } break;
+	_svg_cairo_update_percent (svg_cairo->state);
+	break;
     }
     
+    /* Only the geometry depends on the lengths, so it goes into the
+     * matrix of a pattern cached per gradient. Degenerate geometry
+     * can't be expressed that way and gets a pattern of its own. */
     switch (gradient->type) {
     case SVG_GRADIENT_LINEAR:
     {
-	double x1, y1, x2, y2;
+	double dx, dy;
       
 	_svg_cairo_length_to_pixel (svg_cairo, &gradient->u.linear.x1, &x1);
 	_svg_cairo_length_to_pixel (svg_cairo, &gradient->u.linear.y1, &y1);
 	_svg_cairo_length_to_pixel (svg_cairo, &gradient->u.linear.x2, &x2);
 	_svg_cairo_length_to_pixel (svg_cairo, &gradient->u.linear.y2, &y2);
 
-	pattern = cairo_pattern_create_linear (x1, y1, x2, y2);
+	dx = x2 - x1;
+	dy = y2 - y1;
+	if (dx != 0.0 || dy != 0.0) {
+	    pattern = _svg_cairo_gradient_patterns_lookup (svg_cairo, gradient, 0.0, 0.0);
+	    if (pattern)
+		cairo_pattern_reference (pattern);
+	    cairo_matrix_init (&geometry_matrix, dx, dy, -dy, dx, x1, y1);
+	}
+	if (pattern == NULL) {
+	    pattern = _svg_cairo_gradient_pattern_create (gradient, x1, y1, 0.0, x2, y2, 0.0);
+	    cairo_matrix_init_identity (&geometry_matrix);
+	}
     }
     break;
     case SVG_GRADIENT_RADIAL:
@@ -585,106 +1295,256 @@ _svg_cairo_set_gradient (svg_cairo_t *svg_cairo,
 	_svg_cairo_length_to_pixel (svg_cairo, &gradient->u.radial.fx, &fx);
 	_svg_cairo_length_to_pixel (svg_cairo, &gradient->u.radial.fy, &fy);
 
-	pattern = cairo_pattern_create_radial (fx, fy, 0.0, cx, cy, r);
+	if (r > 0.0) {
+	    pattern = _svg_cairo_gradient_patterns_lookup (svg_cairo, gradient,
+							   (fx - cx) / r, (fy - cy) / r);
+	    if (pattern)
+		cairo_pattern_reference (pattern);
+	    cairo_matrix_init (&geometry_matrix, r, 0.0, 0.0, r, cx, cy);
+	}
+	if (pattern == NULL) {
+	    pattern = _svg_cairo_gradient_pattern_create (gradient, fx, fy, 0.0, cx, cy, r);
+	    cairo_matrix_init_identity (&geometry_matrix);
+	}
     } break;
     }
-    
-    for (i = 0; i < gradient->num_stops; i++) {
-	stop = &gradient->stops[i];
-	cairo_pattern_add_color_stop_rgba (pattern, stop->offset,
-					   svg_color_get_red (&stop->color) / 255.0,
-					   svg_color_get_green (&stop->color) / 255.0,
-					   svg_color_get_blue (&stop->color) / 255.0,
-					   stop->opacity);
-    }
-	    
-    switch (gradient->spread) {
-    case SVG_GRADIENT_SPREAD_REPEAT:
-	cairo_pattern_set_extend (pattern, CAIRO_EXTEND_REPEAT);
-	break;
-    case SVG_GRADIENT_SPREAD_REFLECT:
-	cairo_pattern_set_extend (pattern, CAIRO_EXTEND_REFLECT);
-	break;
-    default:
-	cairo_pattern_set_extend (pattern, CAIRO_EXTEND_NONE);
-	break;
-    }
-    
-    cairo_pattern_set_filter (pattern, CAIRO_FILTER_BILINEAR);
+
+    /* cached patterns may have been set up for another quality */
+    cairo_pattern_set_filter (pattern, svg_cairo->filter);
 
     cairo_matrix_init (&gradient_matrix,
 		       gradient->transform[0], gradient->transform[1],
 		       gradient->transform[2], gradient->transform[3],
 		       gradient->transform[4], gradient->transform[5]);
     cairo_matrix_multiply (&matrix, &matrix, &gradient_matrix);
+    cairo_matrix_multiply (&matrix, &geometry_matrix, &matrix);
     
     cairo_matrix_invert (&matrix);
     cairo_pattern_set_matrix (pattern, &matrix);
     
     cairo_set_source (svg_cairo->cr, pattern);
     cairo_pattern_destroy (pattern);
-    svg_cairo->state->bbox = 0;
+    if (svg_cairo->state->bbox) {
+	svg_cairo->state->bbox = 0;
+	_svg_cairo_update_percent (svg_cairo->state);
+    }
     
     return SVG_STATUS_SUCCESS;
 }
 
+/* Rendered pattern tiles are kept per document, at most this many */
+#define SVG_CAIRO_PATTERN_TILES_MAX 32
+
+/* and no bigger than this many pixels a side, whatever the scale */
+#define SVG_CAIRO_PATTERN_TILE_SIZE_MAX 2048
+
+/* Pattern content can inherit a paint with the pattern itself. Tiles
+   nested deeper than this are left empty. */
+#define SVG_CAIRO_PATTERN_DEPTH_MAX 8
+
+static int
+_svg_cairo_pattern_tile_size (double size, double scale)
+{
+    double pixels = ceil (size * scale);
+
+    if (pixels < 1)
+	return 1;
+    if (pixels > SVG_CAIRO_PATTERN_TILE_SIZE_MAX)
+	return SVG_CAIRO_PATTERN_TILE_SIZE_MAX;
+    return (int) pixels;
+}
+
+static void
+_svg_cairo_pattern_tiles_clear (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_pattern_tile_t *tile, *next;
+
+    for (tile = svg_cairo->pattern_tiles; tile; tile = next) {
+	next = tile->next;
+	cairo_pattern_destroy (tile->pattern);
+	free (tile);
+    }
+    svg_cairo->pattern_tiles = NULL;
+    svg_cairo->num_pattern_tiles = 0;
+}
+
+/* Looks up the tile of pattern_element rendered at width x height
+   pixels with opacity, and moves it to the front so that the least
+   recently used tiles are at the end of the list. */
+static svg_cairo_pattern_tile_t *
+_svg_cairo_pattern_tiles_lookup (svg_cairo_t	*svg_cairo,
+				 svg_element_t	*pattern_element,
+				 int		 width,
+				 int		 height,
+				 double		 opacity)
+{
+    svg_cairo_pattern_tile_t **prev, *tile;
+
+    _svg_cairo_paint_cache_validate (svg_cairo);
+
+    for (prev = &svg_cairo->pattern_tiles; *prev; prev = &(*prev)->next) {
+	tile = *prev;
+	if (tile->pattern_element == pattern_element &&
+	    tile->width == width && tile->height == height &&
+	    tile->opacity == opacity) {
+	    *prev = tile->next;
+	    tile->next = svg_cairo->pattern_tiles;
+	    svg_cairo->pattern_tiles = tile;
+	    return tile;
+	}
+    }
+
+    return NULL;
+}
+
+static svg_status_t
+_svg_cairo_pattern_tiles_add (svg_cairo_t	*svg_cairo,
+			      svg_element_t	*pattern_element,
+			      int		 width,
+			      int		 height,
+			      double		 opacity,
+			      cairo_pattern_t	*pattern)
+{
+    svg_cairo_pattern_tile_t **prev, *tile;
+
+    if (svg_cairo->num_pattern_tiles >= SVG_CAIRO_PATTERN_TILES_MAX) {
+	for (prev = &svg_cairo->pattern_tiles; (*prev)->next; prev = &(*prev)->next)
+	    ;
+	cairo_pattern_destroy ((*prev)->pattern);
+	free (*prev);
+	*prev = NULL;
+	svg_cairo->num_pattern_tiles--;
+    }
+
+    tile = _svg_cairo_alloc (svg_cairo, sizeof (svg_cairo_pattern_tile_t));
+    if (tile == NULL)
+	return SVG_STATUS_NO_MEMORY;
+
+    tile->pattern_element = pattern_element;
+    tile->width = width;
+    tile->height = height;
+    tile->opacity = opacity;
+    tile->pattern = cairo_pattern_reference (pattern);
+    tile->next = svg_cairo->pattern_tiles;
+    svg_cairo->pattern_tiles = tile;
+    svg_cairo->num_pattern_tiles++;
+
+    return SVG_STATUS_SUCCESS;
+}
+
 static svg_status_t
 _svg_cairo_set_pattern (svg_cairo_t *svg_cairo,
 			svg_element_t *pattern_element,
+			double opacity,
 			svg_cairo_render_type_t type)
 {
     svg_pattern_t *pattern = svg_element_pattern (pattern_element);
-    cairo_surface_t *pattern_surface;
+    svg_cairo_pattern_tile_t *tile;
+    svg_bounding_box_t last_bbox;
+    double path_x1, path_y1, path_x2, path_y2;
+    int path_extents_valid;
+    cairo_t *pattern_cr;
     cairo_pattern_t *surface_pattern;
+    cairo_matrix_t ctm, matrix;
+    int width, height;
     double x_px, y_px, width_px, height_px;
-    cairo_path_t *path;
+    double scale_x, scale_y, raster_scale;
 
     _svg_cairo_length_to_pixel (svg_cairo, &pattern->x, &x_px);
     _svg_cairo_length_to_pixel (svg_cairo, &pattern->y, &y_px);
     _svg_cairo_length_to_pixel (svg_cairo, &pattern->width, &width_px);
     _svg_cairo_length_to_pixel (svg_cairo, &pattern->height, &height_px);
 
-    /* OK. We've got the final path to be filled/stroked inside the
-     * cairo context right now. But we're also going to re-use that
-     * same context to draw the pattern. And since the path is no
-     * longer in the graphics state, cairo_save/restore will not help
-     * us here.
-     *
-     * Currently we deal with this by manually saving/restoring the
-     * path.
-     *
-     * It might be simpler to just use a new cairo_t for drawing the
-     * pattern.
-     */
-    path = cairo_copy_path (svg_cairo->cr);
-    cairo_new_path (svg_cairo->cr);
-    cairo_save (svg_cairo->cr);
+    /* an empty tile disables painting, as do patterns that end up
+       painting their own content */
+    if (width_px <= 0 || height_px <= 0 || opacity <= 0 ||
+	svg_cairo->pattern_depth >= SVG_CAIRO_PATTERN_DEPTH_MAX) {
+	cairo_set_source_rgba (svg_cairo->cr, 0, 0, 0, 0);
+	return SVG_STATUS_SUCCESS;
+    }
 
-    pattern_surface = cairo_surface_create_similar (cairo_get_target (svg_cairo->cr),
-						    CAIRO_FORMAT_ARGB32,
-						    (int) (width_px + 0.5),
-						    (int) (height_px + 0.5));
+    /* Render the tile at the resolution it will be painted at. Only
+     * the scale of the current transformation matters for that, so
+     * every use at about the same scale shares one tile. */
+    cairo_get_matrix (svg_cairo->cr, &ctm);
+    scale_x = sqrt (ctm.xx * ctm.xx + ctm.yx * ctm.yx) * svg_cairo->raster_scale;
+    scale_y = sqrt (ctm.xy * ctm.xy + ctm.yy * ctm.yy) * svg_cairo->raster_scale;
+    width = _svg_cairo_pattern_tile_size (width_px, scale_x);
+    height = _svg_cairo_pattern_tile_size (height_px, scale_y);
+
+    tile = _svg_cairo_pattern_tiles_lookup (svg_cairo, pattern_element, width, height, opacity);
+    if (tile) {
+	cairo_set_source (svg_cairo->cr, tile->pattern);
+	return SVG_STATUS_SUCCESS;
+    }
+
+    pattern_cr = _svg_cairo_surface_pool_acquire (svg_cairo->pool, width, height, width, height);
+    if (pattern_cr == NULL)
+	return SVG_STATUS_NO_MEMORY;
 
-    _svg_cairo_push_state (svg_cairo, pattern_surface);
+    /* The tile gets drawn on a context of its own, which leaves the
+     * path about to be filled or stroked alone. Drawing it would also
+     * overwrite the bounding box and extents of that path. */
+    last_bbox = svg_cairo->last_bbox;
+    path_x1 = svg_cairo->path_x1;
+    path_y1 = svg_cairo->path_y1;
+    path_x2 = svg_cairo->path_x2;
+    path_y2 = svg_cairo->path_y2;
+    path_extents_valid = svg_cairo->path_extents_valid;
+
+    /* the tile is pixels already, whatever it contains is drawn at
+       its resolution */
+    raster_scale = svg_cairo->raster_scale;
+    svg_cairo->raster_scale = 1.0;
+
+    _svg_cairo_push_state (svg_cairo, pattern_cr);
+    svg_cairo->state->clip_boxed = 1;
+    svg_cairo->state->clip_box.left = 0;
+    svg_cairo->state->clip_box.top = 0;
+    svg_cairo->state->clip_box.right = width;
+    svg_cairo->state->clip_box.bottom = height;
     cairo_identity_matrix (svg_cairo->cr);
+    cairo_scale (svg_cairo->cr, width / width_px, height / height_px);
     
-    svg_cairo->state->fill_paint.type = SVG_PAINT_TYPE_NONE;
-    svg_cairo->state->stroke_paint.type = SVG_PAINT_TYPE_NONE;
-    
-    svg_element_render (pattern->group_element, &SVG_CAIRO_RENDER_ENGINE, svg_cairo);
+    /* what is painted with the pattern has no say in how its content
+       looks, libsvg sets the style the content inherits instead */
+    svg_cairo->state->opacity = 1.0;
+
+    svg_cairo->pattern_depth++;
+    svg_pattern_render (pattern_element, &SVG_CAIRO_RENDER_ENGINE, svg_cairo);
+    svg_cairo->pattern_depth--;
     _svg_cairo_pop_state (svg_cairo);
 
-    cairo_restore (svg_cairo->cr);
-    cairo_new_path (svg_cairo->cr);
-    cairo_append_path (svg_cairo->cr, path);
-    cairo_path_destroy (path);
+    /* the fill or stroke opacity applies to the tile as a whole */
+    if (opacity < 1.0) {
+	cairo_save (pattern_cr);
+	cairo_set_operator (pattern_cr, CAIRO_OPERATOR_DEST_IN);
+	cairo_set_source_rgba (pattern_cr, 0, 0, 0, opacity);
+	cairo_paint (pattern_cr);
+	cairo_restore (pattern_cr);
+    }
 
-    surface_pattern = cairo_pattern_create_for_surface (pattern_surface);
-    cairo_surface_destroy (pattern_surface);
+    svg_cairo->last_bbox = last_bbox;
+    svg_cairo->path_x1 = path_x1;
+    svg_cairo->path_y1 = path_y1;
+    svg_cairo->path_x2 = path_x2;
+    svg_cairo->path_y2 = path_y2;
+    svg_cairo->path_extents_valid = path_extents_valid;
+    svg_cairo->raster_scale = raster_scale;
+
+    /* the pattern keeps the surface from being recycled for as long
+       as the tile is cached or is the source */
+    surface_pattern = cairo_pattern_create_for_surface (cairo_get_target (pattern_cr));
+    svg_cairo_surface_pool_release (svg_cairo->pool, pattern_cr);
     
     cairo_pattern_set_extend (surface_pattern, CAIRO_EXTEND_REPEAT);
+    cairo_matrix_init_scale (&matrix, width / width_px, height / height_px);
+    cairo_pattern_set_matrix (surface_pattern, &matrix);
     
     cairo_set_source (svg_cairo->cr, surface_pattern);
+
+    _svg_cairo_pattern_tiles_add (svg_cairo, pattern_element, width, height, opacity,
+				  surface_pattern);
     
     cairo_pattern_destroy (surface_pattern);
 
@@ -714,7 +1574,7 @@ _svg_cairo_set_paint_and_opacity (svg_cairo_t *svg_cairo, svg_paint_t *paint, do
 	    return status;
 	break;
     case SVG_PAINT_TYPE_PATTERN:
-	status = _svg_cairo_set_pattern (svg_cairo, paint->p.pattern_element, type);
+	status = _svg_cairo_set_pattern (svg_cairo, paint->p.pattern_element, opacity, type);
 	if (status)
 	    return status;
 	break;
@@ -748,64 +1608,288 @@ _svg_cairo_set_fill_rule (void *closure, svg_fill_rule_t fill_rule)
 {
     svg_cairo_t *svg_cairo = closure;
 
-    switch (fill_rule) {
-    case SVG_FILL_RULE_NONZERO:
-	cairo_set_fill_rule (svg_cairo->cr, CAIRO_FILL_RULE_WINDING);
-	break;
-    case SVG_FILL_RULE_EVEN_ODD:
-	cairo_set_fill_rule (svg_cairo->cr, CAIRO_FILL_RULE_EVEN_ODD);
-	break;
+    switch (fill_rule) {
+    case SVG_FILL_RULE_NONZERO:
+	svg_cairo->state->gstate.fill_rule = CAIRO_FILL_RULE_WINDING;
+	break;
+    case SVG_FILL_RULE_EVEN_ODD:
+	svg_cairo->state->gstate.fill_rule = CAIRO_FILL_RULE_EVEN_ODD;
+	break;
+    }
+
+    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));    
+}
+
+static svg_status_t
+_svg_cairo_select_font (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_gstate_t *want = &svg_cairo->state->gstate;
+    svg_cairo_gstate_t *have = &svg_cairo->gstate;
+    const char *family = want->font_family;
+    unsigned int font_weight = want->font_weight;
+    cairo_font_weight_t weight;
+    svg_font_style_t font_style = want->font_style;
+    cairo_font_slant_t slant;
+
+    if (have->font_family == want->font_family &&
+	have->font_size == want->font_size &&
+	have->font_style == want->font_style &&
+	have->font_weight == want->font_weight)
+	return SVG_STATUS_SUCCESS;
+
+    if (font_weight >= 700)
+	weight = CAIRO_FONT_WEIGHT_BOLD;
+    else
+	weight = CAIRO_FONT_WEIGHT_NORMAL;
+
+    switch (font_style) {
+    case SVG_FONT_STYLE_ITALIC:
+	slant = CAIRO_FONT_SLANT_ITALIC;
+	break;
+    case SVG_FONT_STYLE_OBLIQUE:
+	slant = CAIRO_FONT_SLANT_OBLIQUE;
+	break;
+    default:
+	slant = CAIRO_FONT_SLANT_NORMAL;
+	break;
+    }
+
+    cairo_select_font_face (svg_cairo->cr, family, slant, weight);
+    cairo_set_font_size (svg_cairo->cr, want->font_size);
+
+    have->font_family = want->font_family;
+    have->font_size = want->font_size;
+    have->font_style = want->font_style;
+    have->font_weight = want->font_weight;
+
+    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+}
+
+/* Scaled fonts are kept for the most recent fonts and transforms text
+   was drawn with, glyph runs for up to this many strings in them */
+#define SVG_CAIRO_SCALED_FONTS_MAX 32
+#define SVG_CAIRO_GLYPH_RUN_BUCKETS 1024
+#define SVG_CAIRO_GLYPH_RUNS_MAX 8192
+
+static void
+_svg_cairo_glyph_runs_clear (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_glyph_run_t *run, *next;
+    int i;
+
+    if (svg_cairo->glyph_runs == NULL)
+	return;
+
+    for (i = 0; i < SVG_CAIRO_GLYPH_RUN_BUCKETS; i++) {
+	for (run = svg_cairo->glyph_runs[i]; run; run = next) {
+	    next = run->next;
+	    cairo_glyph_free (run->glyphs);
+	    cairo_scaled_font_destroy (run->scaled_font);
+	    free (run);
+	}
+	svg_cairo->glyph_runs[i] = NULL;
+    }
+    svg_cairo->num_glyph_runs = 0;
+}
+
+static void
+_svg_cairo_text_cache_clear (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_scaled_font_t *entry, *next;
+
+    for (entry = svg_cairo->scaled_fonts; entry; entry = next) {
+	next = entry->next;
+	cairo_scaled_font_destroy (entry->scaled_font);
+	free (entry);
+    }
+    svg_cairo->scaled_fonts = NULL;
+    svg_cairo->num_scaled_fonts = 0;
+
+    _svg_cairo_glyph_runs_clear (svg_cairo);
+    free (svg_cairo->glyph_runs);
+    svg_cairo->glyph_runs = NULL;
+
+    free (svg_cairo->glyphs);
+    svg_cairo->glyphs = NULL;
+    svg_cairo->glyphs_size = 0;
+}
+
+/* Sets the font of the current state on cr, for its current
+   transform, and returns it. The scaled font belongs to the cache. */
+static cairo_scaled_font_t *
+_svg_cairo_scaled_fonts_lookup (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_gstate_t *want = &svg_cairo->state->gstate;
+    svg_cairo_gstate_t *have = &svg_cairo->gstate;
+    svg_cairo_scaled_font_t **prev, *entry;
+    cairo_scaled_font_t *scaled_font;
+    cairo_matrix_t ctm;
+
+    cairo_get_matrix (svg_cairo->cr, &ctm);
+
+    for (prev = &svg_cairo->scaled_fonts; *prev; prev = &(*prev)->next) {
+	entry = *prev;
+	if (entry->font_family == want->font_family &&
+	    entry->font_size == want->font_size &&
+	    entry->font_style == want->font_style &&
+	    entry->font_weight == want->font_weight &&
+	    entry->xx == ctm.xx && entry->yx == ctm.yx &&
+	    entry->xy == ctm.xy && entry->yy == ctm.yy) {
+	    *prev = entry->next;
+	    entry->next = svg_cairo->scaled_fonts;
+	    svg_cairo->scaled_fonts = entry;
+
+	    cairo_set_scaled_font (svg_cairo->cr, entry->scaled_font);
+	    have->font_family = want->font_family;
+	    have->font_size = want->font_size;
+	    have->font_style = want->font_style;
+	    have->font_weight = want->font_weight;
+	    return entry->scaled_font;
+	}
+    }
+
+    if (_svg_cairo_select_font (svg_cairo))
+	return NULL;
+    scaled_font = cairo_get_scaled_font (svg_cairo->cr);
+    if (cairo_scaled_font_status (scaled_font))
+	return NULL;
+
+    if (svg_cairo->num_scaled_fonts >= SVG_CAIRO_SCALED_FONTS_MAX) {
+	for (prev = &svg_cairo->scaled_fonts; (*prev)->next; prev = &(*prev)->next)
+	    ;
+	cairo_scaled_font_destroy ((*prev)->scaled_font);
+	free (*prev);
+	*prev = NULL;
+	svg_cairo->num_scaled_fonts--;
     }
 
-    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));    
+    entry = _svg_cairo_alloc (svg_cairo, sizeof (svg_cairo_scaled_font_t));
+    if (entry == NULL)
+	return scaled_font;
+
+    entry->font_family = want->font_family;
+    entry->font_size = want->font_size;
+    entry->font_style = want->font_style;
+    entry->font_weight = want->font_weight;
+    entry->xx = ctm.xx;
+    entry->yx = ctm.yx;
+    entry->xy = ctm.xy;
+    entry->yy = ctm.yy;
+    entry->scaled_font = cairo_scaled_font_reference (scaled_font);
+    entry->next = svg_cairo->scaled_fonts;
+    svg_cairo->scaled_fonts = entry;
+    svg_cairo->num_scaled_fonts++;
+
+    return scaled_font;
 }
 
-static svg_status_t
-_svg_cairo_select_font (svg_cairo_t *svg_cairo)
+/* Returns utf8 as glyphs in the font of the current state, which it
+   sets on cr, converting it on first use. The run belongs to the
+   cache. */
+static svg_cairo_glyph_run_t *
+_svg_cairo_glyph_runs_lookup (svg_cairo_t *svg_cairo, const char *utf8)
 {
-    char *family = svg_cairo->state->font_family;
-    unsigned int font_weight = svg_cairo->state->font_weight;
-    cairo_font_weight_t weight;
-    svg_font_style_t font_style = svg_cairo->state->font_style;
-    cairo_font_slant_t slant;
+    cairo_scaled_font_t *scaled_font;
+    cairo_text_extents_t extents;
+    svg_cairo_glyph_run_t **bucket, *run;
+    unsigned long hash;
+    const unsigned char *c;
+    size_t length;
+
+    scaled_font = _svg_cairo_scaled_fonts_lookup (svg_cairo);
+    if (scaled_font == NULL)
+	return NULL;
+
+    hash = (unsigned long) scaled_font;
+    for (c = (const unsigned char *) utf8; *c; c++)
+	hash = hash * 31 + *c;
+    length = c - (const unsigned char *) utf8;
+
+    if (svg_cairo->glyph_runs == NULL) {
+	svg_cairo->glyph_runs = calloc (SVG_CAIRO_GLYPH_RUN_BUCKETS,
+					sizeof (svg_cairo_glyph_run_t *));
+	if (svg_cairo->glyph_runs == NULL)
+	    return NULL;
+    }
 
-    if (! svg_cairo->state->font_dirty)
-	return SVG_STATUS_SUCCESS;
+    bucket = &svg_cairo->glyph_runs[hash % SVG_CAIRO_GLYPH_RUN_BUCKETS];
+    for (run = *bucket; run; run = run->next)
+	if (run->hash == hash && run->scaled_font == scaled_font &&
+	    strcmp (run->utf8, utf8) == 0)
+	    return run;
+
+    /* a document with more strings than this starts over */
+    if (svg_cairo->num_glyph_runs >= SVG_CAIRO_GLYPH_RUNS_MAX)
+	_svg_cairo_glyph_runs_clear (svg_cairo);
+
+    run = _svg_cairo_alloc (svg_cairo, offsetof (svg_cairo_glyph_run_t, utf8) + length + 1);
+    if (run == NULL)
+	return NULL;
+
+    run->glyphs = NULL;
+    run->num_glyphs = 0;
+    if (cairo_scaled_font_text_to_glyphs (scaled_font, 0.0, 0.0, utf8, length,
+					  &run->glyphs, &run->num_glyphs,
+					  NULL, NULL, NULL)) {
+	free (run);
+	return NULL;
+    }
+    cairo_scaled_font_glyph_extents (scaled_font, run->glyphs, run->num_glyphs, &extents);
+
+    run->scaled_font = cairo_scaled_font_reference (scaled_font);
+    run->hash = hash;
+    run->x_advance = extents.x_advance;
+    run->y_advance = extents.y_advance;
+    memcpy (run->utf8, utf8, length + 1);
+    run->next = *bucket;
+    *bucket = run;
+    svg_cairo->num_glyph_runs++;
+
+    return run;
+}
 
-    if (font_weight >= 700)
-	weight = CAIRO_FONT_WEIGHT_BOLD;
-    else
-	weight = CAIRO_FONT_WEIGHT_NORMAL;
+/* The glyphs of run as drawn from (x, y) */
+static cairo_glyph_t *
+_svg_cairo_glyph_run_place (svg_cairo_t		  *svg_cairo,
+			    svg_cairo_glyph_run_t *run,
+			    double		  x,
+			    double		  y)
+{
+    cairo_glyph_t *glyphs;
+    int i;
 
-    switch (font_style) {
-    case SVG_FONT_STYLE_ITALIC:
-	slant = CAIRO_FONT_SLANT_ITALIC;
-	break;
-    case SVG_FONT_STYLE_OBLIQUE:
-	slant = CAIRO_FONT_SLANT_OBLIQUE;
-	break;
-    default:
-	slant = CAIRO_FONT_SLANT_NORMAL;
-	break;
+    if (run->num_glyphs > svg_cairo->glyphs_size) {
+	glyphs = realloc (svg_cairo->glyphs, run->num_glyphs * sizeof (cairo_glyph_t));
+	if (glyphs == NULL)
+	    return NULL;
+	svg_cairo->allocations++;
+	svg_cairo->glyphs = glyphs;
+	svg_cairo->glyphs_size = run->num_glyphs;
     }
 
-    cairo_select_font_face (svg_cairo->cr, family, slant, weight);
-    cairo_set_font_size (svg_cairo->cr, svg_cairo->state->font_size);
-    svg_cairo->state->font_dirty = 0;
+    for (i = 0; i < run->num_glyphs; i++) {
+	svg_cairo->glyphs[i].index = run->glyphs[i].index;
+	svg_cairo->glyphs[i].x = run->glyphs[i].x + x;
+	svg_cairo->glyphs[i].y = run->glyphs[i].y + y;
+    }
 
-    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+    return svg_cairo->glyphs;
 }
 
 static svg_status_t
 _svg_cairo_set_font_family (void *closure, const char *family)
 {
     svg_cairo_t *svg_cairo = closure;
+    const char *interned;
+
+    if (strcmp (svg_cairo->state->gstate.font_family, family) == 0)
+	return SVG_STATUS_SUCCESS;
 
-    if (svg_cairo->state->font_family)
-	free (svg_cairo->state->font_family);
+    interned = _svg_cairo_intern_string (svg_cairo, family);
+    if (interned == NULL)
+	return SVG_STATUS_NO_MEMORY;
 
-    svg_cairo->state->font_family = strdup (family);
-    svg_cairo->state->font_dirty = 1;
+    svg_cairo->state->gstate.font_family = interned;
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
@@ -815,8 +1899,7 @@ _svg_cairo_set_font_size (void *closure, double size)
 {
     svg_cairo_t *svg_cairo = closure;
 
-    svg_cairo->state->font_size = size;
-    svg_cairo->state->font_dirty = 1;
+    svg_cairo->state->gstate.font_size = size;
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
@@ -826,8 +1909,7 @@ _svg_cairo_set_font_style (void *closure, svg_font_style_t font_style)
 {
     svg_cairo_t *svg_cairo = closure;
 
-    svg_cairo->state->font_style = font_style;
-    svg_cairo->state->font_dirty = 1;
+    svg_cairo->state->gstate.font_style = font_style;
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
@@ -837,8 +1919,7 @@ _svg_cairo_set_font_weight (void *closure, unsigned int font_weight)
 {
     svg_cairo_t *svg_cairo = closure;
 
-    svg_cairo->state->font_weight = font_weight;
-    svg_cairo->state->font_dirty = 1;
+    svg_cairo->state->gstate.font_weight = font_weight;
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
@@ -857,22 +1938,17 @@ static svg_status_t
 _svg_cairo_set_stroke_dash_array (void *closure, double *dash, int num_dashes)
 {
     svg_cairo_t *svg_cairo = closure;
+    const double *interned = NULL;
 
-    free (svg_cairo->state->dash);
-    svg_cairo->state->dash = NULL;
-
-    svg_cairo->state->num_dashes = num_dashes;
-
-    if (svg_cairo->state->num_dashes) {
-	svg_cairo->state->dash = malloc(svg_cairo->state->num_dashes * sizeof(double));
-	if (svg_cairo->state->dash == NULL)
+    if (num_dashes) {
+	interned = _svg_cairo_intern_dash (svg_cairo, dash, num_dashes);
+	if (interned == NULL)
 	    return SVG_STATUS_NO_MEMORY;
-
-	memcpy(svg_cairo->state->dash, dash, svg_cairo->state->num_dashes * sizeof(double));
-
-	cairo_set_dash (svg_cairo->cr, svg_cairo->state->dash, svg_cairo->state->num_dashes, svg_cairo->state->dash_offset);
     }
 
+    svg_cairo->state->gstate.dash = interned;
+    svg_cairo->state->gstate.num_dashes = num_dashes;
+
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
@@ -884,10 +1960,8 @@ _svg_cairo_set_stroke_dash_offset (void *closure, svg_length_t *offset_len)
 
     _svg_cairo_length_to_pixel (svg_cairo, offset_len, &offset);
 
-    svg_cairo->state->dash_offset = offset;
+    svg_cairo->state->gstate.dash_offset = offset;
 
-    if (svg_cairo->state->num_dashes)
-	cairo_set_dash (svg_cairo->cr, svg_cairo->state->dash, svg_cairo->state->num_dashes, svg_cairo->state->dash_offset); 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
@@ -898,13 +1972,13 @@ _svg_cairo_set_stroke_line_cap (void *closure, svg_stroke_line_cap_t line_cap)
 
     switch (line_cap) {
     case SVG_STROKE_LINE_CAP_BUTT:
-	cairo_set_line_cap (svg_cairo->cr, CAIRO_LINE_CAP_BUTT);
+	svg_cairo->state->gstate.line_cap = CAIRO_LINE_CAP_BUTT;
 	break;
     case SVG_STROKE_LINE_CAP_ROUND:
-	cairo_set_line_cap (svg_cairo->cr, CAIRO_LINE_CAP_ROUND);
+	svg_cairo->state->gstate.line_cap = CAIRO_LINE_CAP_ROUND;
 	break;
     case SVG_STROKE_LINE_CAP_SQUARE:
-	cairo_set_line_cap (svg_cairo->cr, CAIRO_LINE_CAP_SQUARE);
+	svg_cairo->state->gstate.line_cap = CAIRO_LINE_CAP_SQUARE;
 	break;
     }
 
@@ -918,13 +1992,13 @@ _svg_cairo_set_stroke_line_join (void *closure, svg_stroke_line_join_t line_join
 
     switch (line_join) {
     case SVG_STROKE_LINE_JOIN_MITER:
-	cairo_set_line_join (svg_cairo->cr, CAIRO_LINE_JOIN_MITER);
+	svg_cairo->state->gstate.line_join = CAIRO_LINE_JOIN_MITER;
 	break;
     case SVG_STROKE_LINE_JOIN_ROUND:
-	cairo_set_line_join (svg_cairo->cr, CAIRO_LINE_JOIN_ROUND);
+	svg_cairo->state->gstate.line_join = CAIRO_LINE_JOIN_ROUND;
 	break;
     case SVG_STROKE_LINE_JOIN_BEVEL:
-	cairo_set_line_join (svg_cairo->cr, CAIRO_LINE_JOIN_BEVEL);
+	svg_cairo->state->gstate.line_join = CAIRO_LINE_JOIN_BEVEL;
 	break;
     }
 
@@ -936,7 +2010,7 @@ _svg_cairo_set_stroke_miter_limit (void *closure, double limit)
 {
     svg_cairo_t *svg_cairo = closure;
 
-    cairo_set_miter_limit (svg_cairo->cr, limit);
+    svg_cairo->state->gstate.miter_limit = limit;
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));    
 }
@@ -969,7 +2043,7 @@ _svg_cairo_set_stroke_width (void *closure, svg_length_t *width_len)
 
     _svg_cairo_length_to_pixel (svg_cairo, width_len, &width);
 
-    cairo_set_line_width (svg_cairo->cr, width);
+    svg_cairo->state->gstate.line_width = width;
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));    
 }
@@ -984,6 +2058,29 @@ _svg_cairo_set_text_anchor (void *closure, svg_text_anchor_t text_anchor)
     return SVG_STATUS_SUCCESS;
 }
 
+static svg_status_t
+_svg_cairo_apply_clip_box (void *closure,
+			   svg_length_t *x_len,
+			   svg_length_t *y_len,
+			   svg_length_t *width_len,
+			   svg_length_t *height_len)
+{
+    svg_cairo_t *svg_cairo = closure;
+    double x, y, width, height;
+
+    _svg_cairo_length_to_pixel (svg_cairo, x_len, &x);
+    _svg_cairo_length_to_pixel (svg_cairo, y_len, &y);
+    _svg_cairo_length_to_pixel (svg_cairo, width_len, &width);
+    _svg_cairo_length_to_pixel (svg_cairo, height_len, &height);
+
+    _svg_cairo_save_gstate (svg_cairo);
+    cairo_rectangle (svg_cairo->cr, x, y, width, height);
+    cairo_clip (svg_cairo->cr);
+    _svg_cairo_clip_intersect (svg_cairo, x, y, x + width, y + height);
+
+    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+}
+
 static svg_status_t
 _svg_cairo_transform (void *closure,
 		  double a, double b,
@@ -993,6 +2090,11 @@ _svg_cairo_transform (void *closure,
     svg_cairo_t *svg_cairo = closure;
     cairo_matrix_t matrix;
 
+    /* most elements aren't transformed at all */
+    if (a == 1.0 && b == 0.0 && c == 0.0 && d == 1.0 && e == 0.0 && f == 0.0)
+	return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+
+    _svg_cairo_save_gstate (svg_cairo);
     cairo_matrix_init (&matrix, a, b, c, d, e, f);
     cairo_transform (svg_cairo->cr, &matrix);
 
@@ -1021,7 +2123,7 @@ _svg_cairo_render_line (void *closure,
     if (status)
 	return status;
 
-    status = _svg_cairo_render_path (svg_cairo);
+    status = _svg_cairo_render_path (svg_cairo, NULL);
     if (status)
 	return status;
 
@@ -1030,25 +2132,52 @@ _svg_cairo_render_line (void *closure,
 }
 
 static svg_status_t
-_svg_cairo_render_path (void *closure)
+_svg_cairo_render_path (void *closure, void **path_cache)
 {
     svg_cairo_t *svg_cairo = closure;
     svg_paint_t *fill_paint, *stroke_paint;
+    double x1, y1, x2, y2;
+    int stroke;
 
     fill_paint = &svg_cairo->state->fill_paint;
     stroke_paint = &svg_cairo->state->stroke_paint;
 
+    /* libsvg skips replaying the path when it has a cache for us */
+    if (path_cache) {
+	if (*path_cache)
+	    cairo_append_path (svg_cairo->cr, *path_cache);
+	else
+	    *path_cache = cairo_copy_path (svg_cairo->cr);
+    }
+
+    cairo_path_extents (svg_cairo->cr, &x1, &y1, &x2, &y2);
+    svg_cairo->path_x1 = x1;
+    svg_cairo->path_y1 = y1;
+    svg_cairo->path_x2 = x2;
+    svg_cairo->path_y2 = y2;
+    svg_cairo->path_extents_valid = 1;
+    if (stroke_paint->type) {
+	double pad = svg_cairo->state->gstate.line_width / 2.0;
+	x1 -= pad; y1 -= pad;
+	x2 += pad; y2 += pad;
+    }
+    _svg_cairo_user_to_device_bbox (svg_cairo, x1, y1, x2, y2, &svg_cairo->last_bbox);
+
+    stroke = stroke_paint->type && _svg_cairo_stroke_is_visible (svg_cairo);
+
+    _svg_cairo_apply_gstate (svg_cairo);
+
     if (fill_paint->type) {
 	_svg_cairo_set_paint_and_opacity (svg_cairo, fill_paint,
 					  svg_cairo->state->fill_opacity,
 					  SVG_CAIRO_RENDER_TYPE_FILL);
-	if (stroke_paint->type)
+	if (stroke)
 	    cairo_fill_preserve (svg_cairo->cr);
 	else
 	    cairo_fill (svg_cairo->cr);
     }
 
-    if (stroke_paint->type) {
+    if (stroke) {
 	_svg_cairo_set_paint_and_opacity (svg_cairo, stroke_paint,
 					  svg_cairo->state->stroke_opacity,
 					  SVG_CAIRO_RENDER_TYPE_STROKE);
@@ -1060,6 +2189,7 @@ _svg_cairo_render_path (void *closure)
      * easier, and doesn't hurt much to just do it here
      * unconditionally. */
     cairo_new_path (svg_cairo->cr);
+    svg_cairo->path_extents_valid = 0;
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
@@ -1091,11 +2221,97 @@ _svg_cairo_render_ellipse (void *closure,
 
     cairo_set_matrix (svg_cairo->cr, &matrix);
 
-     _svg_cairo_render_path (svg_cairo);
+     _svg_cairo_render_path (svg_cairo, NULL);
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
+/* A rectangle covering whole device pixels, filled with an opaque
+   color and not stroked, is written straight into the pixels of an
+   image target, where cairo would get to the same pixman fill only
+   after its path, clip and compositor. Returns 0 when the rectangle
+   needs cairo after all. */
+static int
+_svg_cairo_fill_box (svg_cairo_t *svg_cairo,
+		     double x, double y,
+		     double width, double height)
+{
+    svg_cairo_state_t *state = svg_cairo->state;
+    cairo_t *cr = svg_cairo->cr;
+    cairo_surface_t *target;
+    cairo_format_t format;
+    cairo_operator_t op;
+    const svg_color_t *color;
+    double offset_x, offset_y;
+    int left, top, right, bottom, dx, dy;
+
+    if (state->fill_paint.type != SVG_PAINT_TYPE_COLOR ||
+	state->fill_opacity * state->opacity < 1.0 ||
+	! state->clip_boxed)
+	return 0;
+    if (state->stroke_paint.type && _svg_cairo_stroke_is_visible (svg_cairo))
+	return 0;
+
+    op = cairo_get_operator (cr);
+    if (op != CAIRO_OPERATOR_OVER && op != CAIRO_OPERATOR_SOURCE)
+	return 0;
+
+    target = cairo_get_group_target (cr);
+    if (cairo_surface_get_type (target) != CAIRO_SURFACE_TYPE_IMAGE)
+	return 0;
+    format = cairo_image_surface_get_format (target);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+	return 0;
+
+    if (! _svg_cairo_pixel_box (cr, x, y, x + width, y + height,
+				&left, &top, &right, &bottom))
+	return 0;
+
+    _svg_cairo_user_to_device_bbox (svg_cairo, x, y, x + width, y + height,
+				    &svg_cairo->last_bbox);
+
+    if (left < (int) state->clip_box.left)
+	left = state->clip_box.left;
+    if (top < (int) state->clip_box.top)
+	top = state->clip_box.top;
+    if (right > (int) state->clip_box.right)
+	right = state->clip_box.right;
+    if (bottom > (int) state->clip_box.bottom)
+	bottom = state->clip_box.bottom;
+
+    /* from device space to the pixels of the target */
+    cairo_surface_get_device_offset (target, &offset_x, &offset_y);
+    dx = (int) offset_x;
+    dy = (int) offset_y;
+    left = left + dx > 0 ? left + dx : 0;
+    top = top + dy > 0 ? top + dy : 0;
+    right += dx;
+    bottom += dy;
+    if (right > cairo_image_surface_get_width (target))
+	right = cairo_image_surface_get_width (target);
+    if (bottom > cairo_image_surface_get_height (target))
+	bottom = cairo_image_surface_get_height (target);
+    if (left >= right || top >= bottom)
+	return 1;
+
+    color = &state->fill_paint.p.color;
+    if (color->is_current_color)
+	color = &state->color;
+
+    cairo_surface_flush (target);
+    pixman_fill ((uint32_t *) cairo_image_surface_get_data (target),
+		 cairo_image_surface_get_stride (target) / sizeof (uint32_t), 32,
+		 left, top, right - left, bottom - top,
+		 0xff000000 |
+		 svg_color_get_red (color) << 16 |
+		 svg_color_get_green (color) << 8 |
+		 svg_color_get_blue (color));
+    cairo_surface_mark_dirty_rectangle (target, left - dx, top - dy,
+					right - left, bottom - top);
+
+    return 1;
+}
+
 static svg_status_t
 _svg_cairo_render_rect (void *closure,
 		   svg_length_t *x_len,
@@ -1121,6 +2337,9 @@ _svg_cairo_render_rect (void *closure,
     if (ry > height / 2.0)
 	ry = height / 2.0;
 
+    if (rx <= 0 && ry <= 0 && _svg_cairo_fill_box (svg_cairo, x, y, width, height))
+	return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+
     if (rx > 0 || ry > 0)
     {
 	_svg_cairo_move_to (svg_cairo, x + rx, y);
@@ -1142,7 +2361,7 @@ _svg_cairo_render_rect (void *closure,
     }
     _svg_cairo_close_path (svg_cairo);
 
-    _svg_cairo_render_path (svg_cairo);
+    _svg_cairo_render_path (svg_cairo, NULL);
 
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
@@ -1155,47 +2374,52 @@ _svg_cairo_render_text (void *closure,
 {
     svg_cairo_t *svg_cairo = closure;
     double x, y;
-    svg_status_t status;
     svg_paint_t *fill_paint, *stroke_paint;
+    svg_cairo_glyph_run_t *run;
+    cairo_glyph_t *glyphs;
 
     fill_paint = &svg_cairo->state->fill_paint;
     stroke_paint = &svg_cairo->state->stroke_paint;
 
-    _svg_cairo_select_font (svg_cairo);
+    run = _svg_cairo_glyph_runs_lookup (svg_cairo, utf8);
+    if (run == NULL) {
+	if (cairo_status (svg_cairo->cr))
+	    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+	return SVG_STATUS_NO_MEMORY;
+    }
 
     _svg_cairo_length_to_pixel (svg_cairo, x_len, &x);
     _svg_cairo_length_to_pixel (svg_cairo, y_len, &y);
 
-    status = _svg_cairo_move_to (svg_cairo, x, y);
-    if (status)
-	return status;
-
-    if (svg_cairo->state->text_anchor != SVG_TEXT_ANCHOR_START) {
-	cairo_text_extents_t extents;
-	cairo_text_extents (svg_cairo->cr, utf8, &extents);
-
-	if (svg_cairo->state->text_anchor == SVG_TEXT_ANCHOR_END)
-	    cairo_rel_move_to (svg_cairo->cr, -extents.x_advance, -extents.y_advance);
-	else if (svg_cairo->state->text_anchor == SVG_TEXT_ANCHOR_MIDDLE)
-	    cairo_rel_move_to (svg_cairo->cr, -extents.x_advance / 2.0, -extents.y_advance / 2.0);
+    if (svg_cairo->state->text_anchor == SVG_TEXT_ANCHOR_END) {
+	x -= run->x_advance;
+	y -= run->y_advance;
+    } else if (svg_cairo->state->text_anchor == SVG_TEXT_ANCHOR_MIDDLE) {
+	x -= run->x_advance / 2.0;
+	y -= run->y_advance / 2.0;
     }
 
+    glyphs = _svg_cairo_glyph_run_place (svg_cairo, run, x, y);
+    if (glyphs == NULL && run->num_glyphs)
+	return SVG_STATUS_NO_MEMORY;
+
     if (fill_paint->type) {
 	if (stroke_paint->type)
 	    cairo_save (svg_cairo->cr);
 	_svg_cairo_set_paint_and_opacity (svg_cairo, fill_paint,
 					  svg_cairo->state->fill_opacity,
 					  SVG_CAIRO_RENDER_TYPE_FILL);
-	cairo_show_text (svg_cairo->cr, utf8);
+	cairo_show_glyphs (svg_cairo->cr, glyphs, run->num_glyphs);
 	if (stroke_paint->type)
 	    cairo_restore (svg_cairo->cr);
     }
 
-    if (stroke_paint->type) {
+    if (stroke_paint->type && _svg_cairo_stroke_is_visible (svg_cairo)) {
+	_svg_cairo_apply_gstate (svg_cairo);
 	_svg_cairo_set_paint_and_opacity (svg_cairo, stroke_paint,
 					  svg_cairo->state->stroke_opacity,
 					  SVG_CAIRO_RENDER_TYPE_STROKE);
-	cairo_text_path (svg_cairo->cr, utf8);
+	cairo_glyph_path (svg_cairo->cr, glyphs, run->num_glyphs);
 	cairo_stroke (svg_cairo->cr);
     }
 
@@ -1225,10 +2449,13 @@ _svg_cairo_render_image (void		*closure,
 
     surface = cairo_image_surface_create_for_data ((unsigned char *)data, CAIRO_FORMAT_ARGB32,
 						   data_width, data_height, data_width *4);
+    _svg_cairo_user_to_device_bbox (svg_cairo, x, y, x + width, y + height, &svg_cairo->last_bbox);
+
     cairo_translate (svg_cairo->cr, x, y);
     cairo_scale (svg_cairo->cr, width / data_width, height / data_height);
 
     cairo_set_source_surface (svg_cairo->cr, surface, 0, 0);
+    cairo_pattern_set_filter (cairo_get_source (svg_cairo->cr), svg_cairo->filter);
     cairo_paint_with_alpha (svg_cairo->cr, svg_cairo->state->opacity);
     
     cairo_surface_destroy (surface);
@@ -1238,6 +2465,142 @@ _svg_cairo_render_image (void		*closure,
     return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
 }
 
+static int
+_svg_cairo_get_last_bounding_box (void *closure, svg_bounding_box_t *bbox)
+{
+    svg_cairo_t *svg_cairo = closure;
+
+    *bbox = svg_cairo->last_bbox;
+
+    return bbox->right > bbox->left && bbox->bottom > bbox->top;
+}
+
+static int
+_svg_cairo_get_rect_bounding_box (void *closure, const svg_rect_t *rect, svg_bounding_box_t *bbox)
+{
+    svg_cairo_t *svg_cairo = closure;
+    double x1, y1, x2, y2;
+
+    /* the clip extents are a user-space box around the clip, so this
+       test errs on the side of drawing */
+    cairo_clip_extents (svg_cairo->cr, &x1, &y1, &x2, &y2);
+    if (rect->x > x2 || rect->y > y2 ||
+	rect->x + rect->width < x1 || rect->y + rect->height < y1)
+	return 0;
+
+    _svg_cairo_user_to_device_bbox (svg_cairo,
+				    rect->x, rect->y,
+				    rect->x + rect->width, rect->y + rect->height,
+				    bbox);
+
+    return 1;
+}
+
+static svg_status_t
+_svg_cairo_render_splat (void		    *closure,
+			 const svg_rect_t   *rect,
+			 const svg_color_t  *color,
+			 double		    opacity)
+{
+    svg_cairo_t *svg_cairo = closure;
+    svg_status_t status;
+
+    status = _svg_cairo_splat (svg_cairo, rect, color, opacity);
+    if (status)
+	return status;
+
+    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+}
+
+/* Only rectangles that stay rectangles on the device cover whole
+   pixels. A recording is replayed at scales its pixels don't line up
+   with, so nothing is said to be covered there. */
+static int
+_svg_cairo_get_rect_covered_box (void *closure, const svg_rect_t *rect, svg_bounding_box_t *bbox)
+{
+    svg_cairo_t *svg_cairo = closure;
+    cairo_matrix_t ctm;
+    double x1 = rect->x, y1 = rect->y;
+    double x2 = rect->x + rect->width, y2 = rect->y + rect->height, t;
+
+    if (cairo_surface_get_type (cairo_get_target (svg_cairo->cr)) == CAIRO_SURFACE_TYPE_RECORDING)
+	return 0;
+
+    cairo_get_matrix (svg_cairo->cr, &ctm);
+    if (ctm.xy != 0.0 || ctm.yx != 0.0)
+	return 0;
+
+    cairo_user_to_device (svg_cairo->cr, &x1, &y1);
+    cairo_user_to_device (svg_cairo->cr, &x2, &y2);
+    if (x1 > x2) {
+	t = x1; x1 = x2; x2 = t;
+    }
+    if (y1 > y2) {
+	t = y1; y1 = y2; y2 = t;
+    }
+
+    /* svg_bounding_box_t is unsigned */
+    x1 = ceil (x1 > 0 ? x1 : 0);
+    y1 = ceil (y1 > 0 ? y1 : 0);
+    x2 = floor (x2);
+    y2 = floor (y2);
+    if (x2 <= x1 || y2 <= y1 || x2 > UINT_MAX || y2 > UINT_MAX)
+	return 0;
+
+    bbox->left = (unsigned int) x1;
+    bbox->top = (unsigned int) y1;
+    bbox->right = (unsigned int) x2;
+    bbox->bottom = (unsigned int) y2;
+
+    return 1;
+}
+
+/* The box is cleared on the target even when a layer is being drawn,
+   which only ever adds to it */
+static svg_status_t
+_svg_cairo_clip_damage (void *closure, const svg_bounding_box_t *box)
+{
+    svg_cairo_t *svg_cairo = closure;
+    svg_cairo_state_t *state = svg_cairo->state;
+    cairo_t *target_cr = svg_cairo->target_cr;
+    cairo_matrix_t ctm;
+
+    cairo_save (target_cr);
+    cairo_identity_matrix (target_cr);
+    if (box) {
+	cairo_rectangle (target_cr, box->left, box->top,
+			 box->right - box->left, box->bottom - box->top);
+	cairo_clip (target_cr);
+    }
+    cairo_set_operator (target_cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint (target_cr);
+    cairo_restore (target_cr);
+
+    if (box == NULL)
+	return _cairo_status_to_svg_status (cairo_status (target_cr));
+
+    _svg_cairo_save_gstate (svg_cairo);
+    cairo_get_matrix (svg_cairo->cr, &ctm);
+    cairo_identity_matrix (svg_cairo->cr);
+    cairo_rectangle (svg_cairo->cr, box->left, box->top,
+		     box->right - box->left, box->bottom - box->top);
+    cairo_clip (svg_cairo->cr);
+    cairo_set_matrix (svg_cairo->cr, &ctm);
+
+    if (state->clip_boxed) {
+	if (box->left > state->clip_box.left)
+	    state->clip_box.left = box->left;
+	if (box->top > state->clip_box.top)
+	    state->clip_box.top = box->top;
+	if (box->right < state->clip_box.right)
+	    state->clip_box.right = box->right;
+	if (box->bottom < state->clip_box.bottom)
+	    state->clip_box.bottom = box->bottom;
+    }
+
+    return _cairo_status_to_svg_status (cairo_status (svg_cairo->cr));
+}
+
 static svg_status_t
 _cairo_status_to_svg_status (cairo_status_t xr_status)
 {
@@ -1261,115 +2624,398 @@ _svg_cairo_copy_cairo_state (svg_cairo_t *svg_cairo,
     cairo_set_matrix (new_cr, &ctm);
 
     /* For simplicity copy all the state, some of these aren't needed,
-     * since we don't change them.
+     * since we don't change them. The style gets applied to the new
+     * context as it is drawn on.
      */
     cairo_set_operator (new_cr, cairo_get_operator (old_cr));
     cairo_set_source (new_cr, cairo_get_source (old_cr));
     cairo_set_tolerance (new_cr, cairo_get_tolerance (old_cr));
-    cairo_set_fill_rule (new_cr, cairo_get_fill_rule (old_cr));
-    cairo_set_line_width (new_cr, cairo_get_line_width (old_cr));
-    cairo_set_line_cap (new_cr, cairo_get_line_cap (old_cr));
-    cairo_set_line_join (new_cr, cairo_get_line_join (old_cr));
-    cairo_set_miter_limit (new_cr, cairo_get_miter_limit (old_cr));
+    cairo_set_antialias (new_cr, cairo_get_antialias (old_cr));
+}
+
+/* Saves the cairo state before the current state transforms or clips,
+   so that popping the state can undo it. */
+static void
+_svg_cairo_save_gstate (svg_cairo_t *svg_cairo)
+{
+    if (svg_cairo->state->gstate_saved)
+	return;
+
+    cairo_save (svg_cairo->cr);
+    svg_cairo->state->gstate_saved = 1;
+    svg_cairo->state->saved_gstate = svg_cairo->gstate;
+}
+
+/* Brings the stroke and fill style of cr up to date with the current
+   state, touching only what changed since it was last applied. */
+static void
+_svg_cairo_apply_gstate (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_gstate_t *want = &svg_cairo->state->gstate;
+    svg_cairo_gstate_t *have = &svg_cairo->gstate;
+    cairo_t *cr = svg_cairo->cr;
+
+    if (have->line_width != want->line_width) {
+	cairo_set_line_width (cr, want->line_width);
+	have->line_width = want->line_width;
+    }
+    if (have->line_cap != want->line_cap) {
+	cairo_set_line_cap (cr, want->line_cap);
+	have->line_cap = want->line_cap;
+    }
+    if (have->line_join != want->line_join) {
+	cairo_set_line_join (cr, want->line_join);
+	have->line_join = want->line_join;
+    }
+    if (have->miter_limit != want->miter_limit) {
+	cairo_set_miter_limit (cr, want->miter_limit);
+	have->miter_limit = want->miter_limit;
+    }
+    if (have->fill_rule != want->fill_rule) {
+	cairo_set_fill_rule (cr, want->fill_rule);
+	have->fill_rule = want->fill_rule;
+    }
+    if (have->dash != want->dash ||
+	have->num_dashes != want->num_dashes ||
+	have->dash_offset != want->dash_offset) {
+	cairo_set_dash (cr, want->dash, want->num_dashes, want->dash_offset);
+	have->dash = want->dash;
+	have->num_dashes = want->num_dashes;
+	have->dash_offset = want->dash_offset;
+    }
+}
+
+/* Forgets what was applied to cr, when we haven't kept track of it,
+   so that everything gets applied again. */
+static void
+_svg_cairo_invalidate_gstate (svg_cairo_t *svg_cairo)
+{
+    svg_cairo->gstate.line_width = -1;
+    svg_cairo->gstate.line_cap = (cairo_line_cap_t) -1;
+    svg_cairo->gstate.line_join = (cairo_line_join_t) -1;
+    svg_cairo->gstate.miter_limit = -1;
+    svg_cairo->gstate.fill_rule = (cairo_fill_rule_t) -1;
+    svg_cairo->gstate.num_dashes = -1;
+    svg_cairo->gstate.font_family = NULL;
+}
+
+#define SVG_CAIRO_THUMBNAIL_SIZE 128
+
+/* Sets up cr for the quality asked for. DEFAULT leaves the caller's
+   tolerance and antialiasing alone. */
+static void
+_svg_cairo_apply_quality (svg_cairo_t *svg_cairo, cairo_t *cr)
+{
+    cairo_matrix_t ctm;
+    unsigned int width, height;
+    double size;
+
+    switch (svg_cairo->quality) {
+    case SVG_CAIRO_QUALITY_FAST:
+	/* the smaller the output, the less a coarsely flattened curve
+	   shows */
+	cairo_get_matrix (cr, &ctm);
+	svg_cairo_get_size (svg_cairo, &width, &height);
+	size = (width > height ? width : height) *
+	    sqrt (fabs (ctm.xx * ctm.yy - ctm.xy * ctm.yx));
+	cairo_set_tolerance (cr, size <= SVG_CAIRO_THUMBNAIL_SIZE ? 0.5 : 0.25);
+	cairo_set_antialias (cr, CAIRO_ANTIALIAS_FAST);
+	break;
+    case SVG_CAIRO_QUALITY_BEST:
+	cairo_set_tolerance (cr, 0.05);
+	cairo_set_antialias (cr, CAIRO_ANTIALIAS_BEST);
+	break;
+    case SVG_CAIRO_QUALITY_DEFAULT:
+    default:
+	break;
+    }
+}
+
+/* Whether the current stroke is wide enough on the device to be worth
+   drawing */
+static int
+_svg_cairo_stroke_is_visible (svg_cairo_t *svg_cairo)
+{
+    cairo_matrix_t ctm;
+    double width;
+
+    if (svg_cairo->min_stroke_width <= 0.0)
+	return 1;
 
-    /* There is no cairo_get_dash, but we already have a copy ourselves */
-    cairo_set_dash (new_cr,
-		    svg_cairo->state->dash, svg_cairo->state->num_dashes, svg_cairo->state->dash_offset);
+    cairo_get_matrix (svg_cairo->cr, &ctm);
+    width = svg_cairo->state->gstate.line_width *
+	sqrt (fabs (ctm.xx * ctm.yy - ctm.xy * ctm.yx));
+
+    return width >= svg_cairo->min_stroke_width;
 }
 
 static svg_status_t
-_svg_cairo_push_state (svg_cairo_t     *svg_cairo,
-		       cairo_surface_t *child_surface)
+_svg_cairo_push_state (svg_cairo_t *svg_cairo,
+		       cairo_t     *child_cr)
 {
     if (!svg_cairo->state)
     {
-	svg_cairo->state = _svg_cairo_state_push (svg_cairo->state);
+	if (_svg_cairo_state_push (svg_cairo) == NULL)
+	    return SVG_STATUS_NO_MEMORY;
 	svg_cairo->state->viewport_width = svg_cairo->viewport_width;
 	svg_cairo->state->viewport_height = svg_cairo->viewport_height;
+	_svg_cairo_update_percent (svg_cairo->state);
     }
     else
     {
-	if (child_surface)
+	if (child_cr)
 	{
-	    cairo_t *new_cr = cairo_create (child_surface);
-	    if (!new_cr)
-		return SVG_STATUS_NO_MEMORY;
-	    
 	    svg_cairo->state->saved_cr = svg_cairo->cr;
-	    svg_cairo->cr = new_cr;
+	    svg_cairo->cr = child_cr;
 	    
 	    _svg_cairo_copy_cairo_state (svg_cairo, svg_cairo->state->saved_cr, svg_cairo->cr);
+	    _svg_cairo_invalidate_gstate (svg_cairo);
 	}
-	svg_cairo->state = _svg_cairo_state_push (svg_cairo->state);
+	if (_svg_cairo_state_push (svg_cairo) == NULL)
+	    return SVG_STATUS_NO_MEMORY;
     }
 
-    
-    if (svg_cairo->state == NULL)
-	return SVG_STATUS_NO_MEMORY;
-
     return SVG_STATUS_SUCCESS;
 }
 
 static svg_status_t
 _svg_cairo_pop_state (svg_cairo_t *svg_cairo)
 {
-    svg_cairo->state = _svg_cairo_state_pop (svg_cairo->state);
+    if (svg_cairo->state->gstate_saved) {
+	cairo_restore (svg_cairo->cr);
+	svg_cairo->gstate = svg_cairo->state->saved_gstate;
+    }
+
+    _svg_cairo_state_pop (svg_cairo);
 
+    /* the child context belongs to whoever pushed it */
     if (svg_cairo->state && svg_cairo->state->saved_cr) {
-	cairo_destroy (svg_cairo->cr);
 	svg_cairo->cr = svg_cairo->state->saved_cr;
 	svg_cairo->state->saved_cr = NULL;
+	_svg_cairo_invalidate_gstate (svg_cairo);
     }
 
     return SVG_STATUS_SUCCESS;
 }
 
-#define	DPI	100.0 // This is NOT what we want. How to reach global DPI? (Rob)
+static void
+_svg_cairo_user_to_device_bbox (svg_cairo_t *svg_cairo,
+				double x1, double y1,
+				double x2, double y2,
+				svg_bounding_box_t *bbox)
+{
+    double x[4] = { x1, x2, x1, x2 };
+    double y[4] = { y1, y1, y2, y2 };
+    double min_x, min_y, max_x, max_y;
+    int i;
 
-static svg_status_t
-_svg_cairo_length_to_pixel (svg_cairo_t * svg_cairo, svg_length_t *length, double *pixel)
+    for (i = 0; i < 4; i++)
+	cairo_user_to_device (svg_cairo->cr, &x[i], &y[i]);
+
+    min_x = max_x = x[0];
+    min_y = max_y = y[0];
+    for (i = 1; i < 4; i++) {
+	if (x[i] < min_x) min_x = x[i];
+	if (x[i] > max_x) max_x = x[i];
+	if (y[i] < min_y) min_y = y[i];
+	if (y[i] > max_y) max_y = y[i];
+    }
+
+    /* svg_bounding_box_t is unsigned */
+    bbox->left = min_x > 0 ? (unsigned int) floor (min_x) : 0;
+    bbox->top = min_y > 0 ? (unsigned int) floor (min_y) : 0;
+    bbox->right = max_x > 0 ? (unsigned int) ceil (max_x) : 0;
+    bbox->bottom = max_y > 0 ? (unsigned int) ceil (max_y) : 0;
+}
+
+/* Where a device coordinate falls on a pixel edge, as far as cairo's
+   fixed point can tell */
+static int
+_svg_cairo_pixel_edge (double value, int *edge)
+{
+    double rounded = floor (value + 0.5);
+
+    if (fabs (value - rounded) >= 1.0 / 512.0 ||
+	rounded < INT32_MIN || rounded > INT32_MAX)
+	return 0;
+
+    *edge = (int) rounded;
+    return 1;
+}
+
+/* The device box of a user space rectangle, when it is one made of
+   whole pixels. Returns 0 otherwise. */
+static int
+_svg_cairo_pixel_box (cairo_t *cr,
+		      double x1, double y1,
+		      double x2, double y2,
+		      int *left, int *top, int *right, int *bottom)
+{
+    cairo_matrix_t ctm;
+    int t;
+
+    cairo_get_matrix (cr, &ctm);
+    if (ctm.xy != 0.0 || ctm.yx != 0.0)
+	return 0;
+
+    cairo_user_to_device (cr, &x1, &y1);
+    cairo_user_to_device (cr, &x2, &y2);
+    if (! _svg_cairo_pixel_edge (x1, left) || ! _svg_cairo_pixel_edge (y1, top) ||
+	! _svg_cairo_pixel_edge (x2, right) || ! _svg_cairo_pixel_edge (y2, bottom))
+	return 0;
+
+    if (*left > *right) {
+	t = *left; *left = *right; *right = t;
+    }
+    if (*top > *bottom) {
+	t = *top; *top = *bottom; *bottom = t;
+    }
+
+    return 1;
+}
+
+/* Finds out whether what the caller clipped cr to, within its target,
+   is a box of whole pixels. A clip that is not a region can't be told
+   from no clip at all, but clipping to the target first makes the two
+   differ. */
+static void
+_svg_cairo_clip_init (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_state_t *state = svg_cairo->state;
+    cairo_t *cr = svg_cairo->cr;
+    cairo_surface_t *target = cairo_get_group_target (cr);
+    cairo_rectangle_list_t *list;
+    cairo_matrix_t ctm;
+    double offset_x, offset_y;
+    int left, top, right, bottom;
+
+    state->clip_boxed = 0;
+    if (cairo_surface_get_type (target) != CAIRO_SURFACE_TYPE_IMAGE)
+	return;
+
+    cairo_save (cr);
+    cairo_get_matrix (cr, &ctm);
+    cairo_identity_matrix (cr);
+    cairo_surface_get_device_offset (target, &offset_x, &offset_y);
+    cairo_rectangle (cr, - offset_x, - offset_y,
+		     cairo_image_surface_get_width (target),
+		     cairo_image_surface_get_height (target));
+    cairo_clip (cr);
+    cairo_set_matrix (cr, &ctm);
+    list = cairo_copy_clip_rectangle_list (cr);
+    cairo_restore (cr);
+
+    if (list->status == CAIRO_STATUS_SUCCESS && list->num_rectangles == 0) {
+	state->clip_boxed = 1;
+	memset (&state->clip_box, 0, sizeof (svg_bounding_box_t));
+    } else if (list->status == CAIRO_STATUS_SUCCESS && list->num_rectangles == 1 &&
+	       _svg_cairo_pixel_box (cr,
+				     list->rectangles[0].x,
+				     list->rectangles[0].y,
+				     list->rectangles[0].x + list->rectangles[0].width,
+				     list->rectangles[0].y + list->rectangles[0].height,
+				     &left, &top, &right, &bottom)) {
+	state->clip_boxed = 1;
+	state->clip_box.left = left > 0 ? left : 0;
+	state->clip_box.top = top > 0 ? top : 0;
+	state->clip_box.right = right > 0 ? right : 0;
+	state->clip_box.bottom = bottom > 0 ? bottom : 0;
+    }
+
+    cairo_rectangle_list_destroy (list);
+}
+
+/* Follows a clip to a user space rectangle, which keeps the clip a box
+   for as long as it lands on whole pixels */
+static void
+_svg_cairo_clip_intersect (svg_cairo_t *svg_cairo,
+			   double x1, double y1,
+			   double x2, double y2)
+{
+    svg_bounding_box_t *box = &svg_cairo->state->clip_box;
+    int left, top, right, bottom;
+
+    if (! svg_cairo->state->clip_boxed)
+	return;
+
+    if (! _svg_cairo_pixel_box (svg_cairo->cr, x1, y1, x2, y2,
+				&left, &top, &right, &bottom)) {
+	svg_cairo->state->clip_boxed = 0;
+	return;
+    }
+
+    if (left > (int) box->left)
+	box->left = left;
+    if (top > (int) box->top)
+	box->top = top;
+    if (right < (int) box->right)
+	box->right = right > 0 ? right : 0;
+    if (bottom < (int) box->bottom)
+	box->bottom = bottom > 0 ? bottom : 0;
+}
+
+/* Absolute units only change with the document's DPI and percentages
+   with the viewport, so what one of them comes to is worked out when
+   those change, leaving a multiplication per length. */
+static void
+_svg_cairo_update_dpi (svg_cairo_t *svg_cairo)
+{
+    double dpi = svg_get_dpi (svg_cairo->svg);
+
+    if (dpi == svg_cairo->dpi)
+	return;
+
+    memset (svg_cairo->unit_pixels, 0, sizeof (svg_cairo->unit_pixels));
+    svg_cairo->unit_pixels[SVG_LENGTH_UNIT_PX] = 1.0;
+    svg_cairo->unit_pixels[SVG_LENGTH_UNIT_CM] = dpi / 2.54;
+    svg_cairo->unit_pixels[SVG_LENGTH_UNIT_MM] = dpi / 25.4;
+    svg_cairo->unit_pixels[SVG_LENGTH_UNIT_IN] = dpi;
+    svg_cairo->unit_pixels[SVG_LENGTH_UNIT_PT] = dpi / 72.0;
+    svg_cairo->unit_pixels[SVG_LENGTH_UNIT_PC] = dpi / 6.0;
+    svg_cairo->dpi = dpi;
+}
+
+static void
+_svg_cairo_update_percent (svg_cairo_state_t *state)
 {
     double width, height;
 
+    if (state->bbox) {
+	width = 1.0;
+	height = 1.0;
+    } else {
+	width = state->viewport_width;
+	height = state->viewport_height;
+    }
+
+    state->percent[SVG_LENGTH_ORIENTATION_HORIZONTAL] = width / 100.0;
+    state->percent[SVG_LENGTH_ORIENTATION_VERTICAL] = height / 100.0;
+    state->percent[SVG_LENGTH_ORIENTATION_OTHER] =
+	sqrt (width * width + height * height) * sqrt (2) / 100.0;
+}
+
+static svg_status_t
+_svg_cairo_length_to_pixel (svg_cairo_t * svg_cairo, svg_length_t *length, double *pixel)
+{
     switch (length->unit) {
     case SVG_LENGTH_UNIT_PX:
 	*pixel = length->value;
 	break;
-    case SVG_LENGTH_UNIT_CM:
-	*pixel = (length->value / 2.54) * DPI;
-	break;
-    case SVG_LENGTH_UNIT_MM:
-	*pixel = (length->value / 25.4) * DPI;
-	break;
-    case SVG_LENGTH_UNIT_IN:
-	*pixel = length->value * DPI;
-	break;
-    case SVG_LENGTH_UNIT_PT:
-	*pixel = (length->value / 72.0) * DPI;
-	break;
-    case SVG_LENGTH_UNIT_PC:
-	*pixel = (length->value / 6.0) * DPI;
-	break;
     case SVG_LENGTH_UNIT_EM:
-	*pixel = length->value * svg_cairo->state->font_size;
+	*pixel = length->value * svg_cairo->state->gstate.font_size;
 	break;
     case SVG_LENGTH_UNIT_EX:
-	*pixel = length->value * svg_cairo->state->font_size / 2.0;
+	*pixel = length->value * svg_cairo->state->gstate.font_size / 2.0;
 	break;
     case SVG_LENGTH_UNIT_PCT:
-	if (svg_cairo->state->bbox) {
-	    width = 1.0;
-	    height = 1.0;
-	} else {
-	    width = svg_cairo->state->viewport_width;
-	    height = svg_cairo->state->viewport_height;
-	}
-	if (length->orientation == SVG_LENGTH_ORIENTATION_HORIZONTAL)
-	    *pixel = (length->value / 100.0) * width;
-	else if (length->orientation == SVG_LENGTH_ORIENTATION_VERTICAL)
-	    *pixel = (length->value / 100.0) * height;
-	else
-	    *pixel = (length->value / 100.0) * sqrt(pow(width, 2) + pow(height, 2)) * sqrt(2);
+	*pixel = length->value * svg_cairo->state->percent[length->orientation];
+	break;
+    case SVG_LENGTH_UNIT_CM:
+    case SVG_LENGTH_UNIT_IN:
+    case SVG_LENGTH_UNIT_MM:
+    case SVG_LENGTH_UNIT_PC:
+    case SVG_LENGTH_UNIT_PT:
+	*pixel = length->value * svg_cairo->unit_pixels[length->unit];
 	break;
     default:
 	*pixel = length->value;
@@ -1399,6 +3045,8 @@ _svg_cairo_apply_view_box (void *closure,
     logic_width = view_box.box.width;
     logic_height = view_box.box.height;
 
+    _svg_cairo_save_gstate (svg_cairo);
+
     if (view_box.aspect_ratio == SVG_PRESERVE_ASPECT_RATIO_NONE)
     {
 	cairo_scale (svg_cairo->cr,
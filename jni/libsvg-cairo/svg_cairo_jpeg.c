@@ -0,0 +1,228 @@
+/* libsvg-cairo - Render SVG documents using the cairo library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "svg-cairo-internal.h"
+
+/* JPEG output through the libjpeg libsvg already reads <image>s with.
+ *
+ * JPEG has no alpha, so each row is flattened over the background as
+ * it is handed to the encoder, one row buffer for the whole image.
+ * cairo's colors are premultiplied already, so that is only adding
+ * what shows of the background, which depends on alpha alone and is
+ * looked up. The encoder's output goes to write_func a buffer at a
+ * time. */
+
+#define SVG_CAIRO_JPEG_BUFFER_SIZE 4096
+
+typedef struct svg_cairo_jpeg_error {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buf;
+    svg_cairo_status_t status;
+} svg_cairo_jpeg_error_t;
+
+typedef struct svg_cairo_jpeg_destination {
+    struct jpeg_destination_mgr pub;
+    cairo_write_func_t write_func;
+    void *closure;
+    JOCTET buffer[SVG_CAIRO_JPEG_BUFFER_SIZE];
+} svg_cairo_jpeg_destination_t;
+
+void
+svg_cairo_jpeg_options_init (svg_cairo_jpeg_options_t *options)
+{
+    options->quality = 90;
+    options->background = 0xffffff;
+}
+
+static void
+_svg_cairo_jpeg_error_exit (j_common_ptr cinfo)
+{
+    svg_cairo_jpeg_error_t *err = (svg_cairo_jpeg_error_t *) cinfo->err;
+
+    if (err->status == SVG_CAIRO_STATUS_SUCCESS)
+	err->status = err->pub.msg_code == JERR_OUT_OF_MEMORY ?
+	    SVG_CAIRO_STATUS_NO_MEMORY : SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    longjmp (err->setjmp_buf, 1);
+}
+
+static void
+_svg_cairo_jpeg_output_message (j_common_ptr cinfo)
+{
+}
+
+static void
+_svg_cairo_jpeg_init_destination (j_compress_ptr cinfo)
+{
+    svg_cairo_jpeg_destination_t *dest = (svg_cairo_jpeg_destination_t *) cinfo->dest;
+
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = SVG_CAIRO_JPEG_BUFFER_SIZE;
+}
+
+static void
+_svg_cairo_jpeg_write (j_compress_ptr cinfo, size_t length)
+{
+    svg_cairo_jpeg_destination_t *dest = (svg_cairo_jpeg_destination_t *) cinfo->dest;
+    svg_cairo_jpeg_error_t *err = (svg_cairo_jpeg_error_t *) cinfo->err;
+
+    if (dest->write_func (dest->closure, dest->buffer, length)) {
+	err->status = SVG_CAIRO_STATUS_IO_ERROR;
+	ERREXIT (cinfo, JERR_FILE_WRITE);
+    }
+}
+
+static boolean
+_svg_cairo_jpeg_empty_output_buffer (j_compress_ptr cinfo)
+{
+    _svg_cairo_jpeg_write (cinfo, SVG_CAIRO_JPEG_BUFFER_SIZE);
+    _svg_cairo_jpeg_init_destination (cinfo);
+
+    return TRUE;
+}
+
+static void
+_svg_cairo_jpeg_term_destination (j_compress_ptr cinfo)
+{
+    size_t length = SVG_CAIRO_JPEG_BUFFER_SIZE - cinfo->dest->free_in_buffer;
+
+    if (length)
+	_svg_cairo_jpeg_write (cinfo, length);
+}
+
+/* What shows of each channel of background under a premultiplied
+ * color of each alpha, rounded as cairo composites */
+static void
+_svg_cairo_jpeg_background (unsigned int background, unsigned char under[3][256])
+{
+    unsigned int alpha, channel, t;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+	channel = (background >> (16 - 8 * i)) & 0xff;
+	for (alpha = 0; alpha < 256; alpha++) {
+	    t = channel * (0xff - alpha) + 0x80;
+	    under[i][alpha] = (t + (t >> 8)) >> 8;
+	}
+    }
+}
+
+/* An ARGB32 or RGB24 row to R, G, B bytes over the background */
+static void
+_svg_cairo_jpeg_flatten_row (const uint32_t	*src,
+			     int		width,
+			     int		opaque,
+			     unsigned char	under[3][256],
+			     JSAMPROW		dst)
+{
+    uint32_t pixel, alpha;
+    int x;
+
+    for (x = 0; x < width; x++, dst += 3) {
+	pixel = src[x];
+	alpha = opaque ? 0xff : pixel >> 24;
+	dst[0] = ((pixel >> 16) & 0xff) + under[0][alpha];
+	dst[1] = ((pixel >> 8) & 0xff) + under[1][alpha];
+	dst[2] = (pixel & 0xff) + under[2][alpha];
+    }
+}
+
+svg_cairo_status_t
+svg_cairo_write_jpeg (cairo_surface_t			*surface,
+		      const svg_cairo_jpeg_options_t	*options,
+		      cairo_write_func_t		write_func,
+		      void				*closure)
+{
+    svg_cairo_jpeg_options_t default_options;
+    struct jpeg_compress_struct cinfo;
+    svg_cairo_jpeg_error_t err;
+    svg_cairo_jpeg_destination_t dest;
+    unsigned char under[3][256];
+    unsigned char *data;
+    cairo_format_t format;
+    JSAMPARRAY row;
+    int width, height, stride;
+
+    if (cairo_surface_get_type (surface) != CAIRO_SURFACE_TYPE_IMAGE)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    format = cairo_image_surface_get_format (surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    if (options == NULL) {
+	svg_cairo_jpeg_options_init (&default_options);
+	options = &default_options;
+    }
+
+    cairo_surface_flush (surface);
+    data = cairo_image_surface_get_data (surface);
+    width = cairo_image_surface_get_width (surface);
+    height = cairo_image_surface_get_height (surface);
+    stride = cairo_image_surface_get_stride (surface);
+    if (width <= 0 || height <= 0)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    _svg_cairo_jpeg_background (options->background, under);
+
+    cinfo.err = jpeg_std_error (&err.pub);
+    err.pub.error_exit = _svg_cairo_jpeg_error_exit;
+    err.pub.output_message = _svg_cairo_jpeg_output_message;
+    err.status = SVG_CAIRO_STATUS_SUCCESS;
+
+    if (setjmp (err.setjmp_buf)) {
+	jpeg_destroy_compress (&cinfo);
+	return err.status;
+    }
+
+    jpeg_create_compress (&cinfo);
+
+    dest.pub.init_destination = _svg_cairo_jpeg_init_destination;
+    dest.pub.empty_output_buffer = _svg_cairo_jpeg_empty_output_buffer;
+    dest.pub.term_destination = _svg_cairo_jpeg_term_destination;
+    dest.write_func = write_func;
+    dest.closure = closure;
+    cinfo.dest = &dest.pub;
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults (&cinfo);
+    jpeg_set_quality (&cinfo, options->quality, TRUE);
+
+    jpeg_start_compress (&cinfo, TRUE);
+
+    row = (*cinfo.mem->alloc_sarray) ((j_common_ptr) &cinfo, JPOOL_IMAGE, width * 3, 1);
+    while (cinfo.next_scanline < cinfo.image_height) {
+	_svg_cairo_jpeg_flatten_row ((uint32_t *) (data + cinfo.next_scanline * stride), width,
+				     format == CAIRO_FORMAT_RGB24, under, row[0]);
+	jpeg_write_scanlines (&cinfo, row, 1);
+    }
+
+    jpeg_finish_compress (&cinfo);
+    jpeg_destroy_compress (&cinfo);
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
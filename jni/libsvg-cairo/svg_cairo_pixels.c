@@ -0,0 +1,144 @@
+/* libsvg-cairo - Render SVG documents using the cairo library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#include "svg-cairo-internal.h"
+
+/* Renders straight into the caller's pixels wherever cairo draws in
+ * that format itself: ARGB32, RGB16_565 and A8. RGBA8888 is drawn as
+ * ARGB32 in the same memory, four bytes a pixel either way, and
+ * reordered and unpremultiplied there afterwards. Only rows cairo
+ * can't address, with a stride that isn't a multiple of four, go
+ * through a surface of its own and are copied out. */
+
+static cairo_format_t
+_svg_cairo_pixel_format_to_cairo (svg_cairo_pixel_format_t format)
+{
+    switch (format) {
+    case SVG_CAIRO_PIXEL_FORMAT_ARGB32:
+    case SVG_CAIRO_PIXEL_FORMAT_RGBA8888:
+	return CAIRO_FORMAT_ARGB32;
+    case SVG_CAIRO_PIXEL_FORMAT_RGB565:
+	return CAIRO_FORMAT_RGB16_565;
+    case SVG_CAIRO_PIXEL_FORMAT_A8:
+	return CAIRO_FORMAT_A8;
+    }
+
+    return CAIRO_FORMAT_INVALID;
+}
+
+int
+svg_cairo_pixel_format_bytes_per_pixel (svg_cairo_pixel_format_t format)
+{
+    switch (format) {
+    case SVG_CAIRO_PIXEL_FORMAT_ARGB32:
+    case SVG_CAIRO_PIXEL_FORMAT_RGBA8888:
+	return 4;
+    case SVG_CAIRO_PIXEL_FORMAT_RGB565:
+	return 2;
+    case SVG_CAIRO_PIXEL_FORMAT_A8:
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Premultiplied native-endian ARGB32 to straight R, G, B, A bytes, in
+ * place */
+void
+_svg_cairo_argb32_to_rgba8888 (unsigned char *data, int width, int height, int stride)
+{
+    int y;
+
+    for (y = 0; y < height; y++)
+	_svg_pixels_argb32_to_rgba8888 (data + y * stride, width);
+}
+
+static svg_cairo_status_t
+_svg_cairo_render_surface (svg_cairo_t		*svg_cairo,
+			   const cairo_matrix_t	*matrix,
+			   cairo_surface_t	*surface)
+{
+    svg_cairo_status_t status;
+    cairo_t *cr;
+
+    cr = cairo_create (surface);
+    if (cairo_status (cr)) {
+	cairo_destroy (cr);
+	return SVG_CAIRO_STATUS_NO_MEMORY;
+    }
+
+    cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+    if (matrix)
+	cairo_set_matrix (cr, matrix);
+
+    status = svg_cairo_render (svg_cairo, cr);
+    cairo_destroy (cr);
+
+    cairo_surface_flush (surface);
+
+    return status;
+}
+
+svg_cairo_status_t
+svg_cairo_render_pixels (svg_cairo_t			*svg_cairo,
+			 const cairo_matrix_t		*matrix,
+			 svg_cairo_pixel_format_t	format,
+			 unsigned char			*data,
+			 int				width,
+			 int				height,
+			 int				stride)
+{
+    cairo_format_t cairo_format = _svg_cairo_pixel_format_to_cairo (format);
+    int row_bytes = width * svg_cairo_pixel_format_bytes_per_pixel (format);
+    cairo_surface_t *surface;
+    svg_cairo_status_t status;
+    unsigned char *pixels;
+    int pixels_stride, y;
+
+    if (cairo_format == CAIRO_FORMAT_INVALID || data == NULL ||
+	width <= 0 || height <= 0 || stride < row_bytes)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    if (stride % 4 == 0)
+	surface = cairo_image_surface_create_for_data (data, cairo_format, width, height, stride);
+    else
+	surface = cairo_image_surface_create (cairo_format, width, height);
+    if (cairo_surface_status (surface)) {
+	cairo_surface_destroy (surface);
+	return SVG_CAIRO_STATUS_NO_MEMORY;
+    }
+
+    status = _svg_cairo_render_surface (svg_cairo, matrix, surface);
+
+    pixels = cairo_image_surface_get_data (surface);
+    pixels_stride = cairo_image_surface_get_stride (surface);
+    if (format == SVG_CAIRO_PIXEL_FORMAT_RGBA8888)
+	_svg_cairo_argb32_to_rgba8888 (pixels, width, height, pixels_stride);
+
+    if (pixels != data)
+	for (y = 0; y < height; y++)
+	    memcpy (data + y * stride, pixels + y * pixels_stride, row_bytes);
+
+    cairo_surface_destroy (surface);
+
+    return status;
+}
@@ -0,0 +1,981 @@
+/* libsvg-cairo - Render SVG documents using the cairo library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "svg-cairo-internal.h"
+
+/* A PNG writer of our own instead of cairo_surface_write_to_png_stream,
+ * which always writes 8-bit RGBA or RGB at libpng's defaults.
+ *
+ * The pixels are looked over once before anything is written, to find
+ * the smallest color type that holds them exactly: a palette of up to
+ * 256 colors, packed down to 1, 2 or 4 bits where there are few
+ * enough, gray with or without alpha, RGB when everything is opaque,
+ * and RGBA only when none of those will do. The colors are told apart
+ * as cairo stores them, premultiplied, which unpremultiply to the same
+ * color only if they are the same to begin with, as far as grayness
+ * and opacity go.
+ *
+ * With more than one thread and enough pixels, the image data is cut
+ * into bands of rows that are filtered and deflated each on a thread
+ * of its own, the way pigz does it. Every band but the last ends on a
+ * sync flush, which leaves the deflate stream byte-aligned with no
+ * block left open, so the bands can be laid end to end as one stream.
+ * Each is primed with the last 32K of filtered bytes of the band
+ * before it as a dictionary, so that matches reach back across the cut
+ * as they would without it. The Adler-32 of the whole is put together
+ * from those of the bands. */
+
+/* twice and more the largest palette, so that lookups stay short */
+#define SVG_CAIRO_PNG_HASH_SIZE 1024
+#define SVG_CAIRO_PNG_MAX_COLORS 256
+
+/* less than this much filtered data per thread isn't worth one */
+#define SVG_CAIRO_PNG_MIN_BYTES_PER_THREAD (256 * 1024)
+#define SVG_CAIRO_PNG_WINDOW_SIZE 32768
+
+typedef struct svg_cairo_png_palette {
+    uint32_t key[SVG_CAIRO_PNG_HASH_SIZE];
+    short index[SVG_CAIRO_PNG_HASH_SIZE];
+    uint32_t color[SVG_CAIRO_PNG_MAX_COLORS];
+    int num_colors;
+} svg_cairo_png_palette_t;
+
+typedef struct svg_cairo_png_analysis {
+    int opaque;
+    int gray;
+    /* the palette holds every color */
+    int fits_palette;
+} svg_cairo_png_analysis_t;
+
+typedef struct svg_cairo_png_writer {
+    cairo_write_func_t write_func;
+    void *closure;
+    svg_cairo_status_t status;
+} svg_cairo_png_writer_t;
+
+/* What every band is encoded with */
+typedef struct svg_cairo_png_job {
+    const unsigned char *data;
+    int width;
+    int stride;
+    int color_type;
+    int bit_depth;
+    /* only looked up in, every color is in it already */
+    svg_cairo_png_palette_t *palette;
+    int opaque;
+    /* bytes in a row, and in a pixel rounded up, once packed */
+    int row_bytes;
+    int bpp;
+    /* PNG_FILTER_ mask */
+    int filters;
+    int level;
+    int strategy;
+} svg_cairo_png_job_t;
+
+typedef struct svg_cairo_png_band {
+    const svg_cairo_png_job_t *job;
+    int y0, y1;
+    int last;
+    /* the deflated band, with room for the zlib header before the
+       first */
+    unsigned char *out;
+    size_t out_len;
+    size_t out_size;
+    uLong adler;
+    size_t in_len;
+    svg_cairo_status_t status;
+    pthread_t thread;
+    int threaded;
+} svg_cairo_png_band_t;
+
+void
+svg_cairo_png_options_init (svg_cairo_png_options_t *options)
+{
+    options->compression_level = -1;
+    options->strategy = SVG_CAIRO_PNG_STRATEGY_DEFAULT;
+    options->filter = SVG_CAIRO_PNG_FILTER_ADAPTIVE;
+    options->reduce_color_type = 1;
+    options->threads = 1;
+}
+
+static unsigned int
+_svg_cairo_png_hash (uint32_t pixel)
+{
+    return (pixel * 2654435761u) >> 22;
+}
+
+/* The index of pixel in palette, added if it isn't there yet, or -1
+ * once the palette is full */
+static int
+_svg_cairo_png_palette_lookup (svg_cairo_png_palette_t *palette, uint32_t pixel)
+{
+    unsigned int i = _svg_cairo_png_hash (pixel);
+
+    while (palette->index[i] >= 0) {
+	if (palette->key[i] == pixel)
+	    return palette->index[i];
+	i = (i + 1) & (SVG_CAIRO_PNG_HASH_SIZE - 1);
+    }
+
+    if (palette->num_colors == SVG_CAIRO_PNG_MAX_COLORS)
+	return -1;
+
+    palette->key[i] = pixel;
+    palette->index[i] = palette->num_colors;
+    palette->color[palette->num_colors] = pixel;
+
+    return palette->num_colors++;
+}
+
+static void
+_svg_cairo_png_analyze (const unsigned char		*data,
+			int				width,
+			int				height,
+			int				stride,
+			cairo_format_t			format,
+			svg_cairo_png_palette_t		*palette,
+			svg_cairo_png_analysis_t	*analysis)
+{
+    const uint32_t *row;
+    uint32_t pixel, last = 0;
+    int x, y;
+
+    analysis->opaque = 1;
+    analysis->gray = 1;
+    analysis->fits_palette = palette != NULL;
+
+    /* alpha first, as it takes the least to tell */
+    if (format == CAIRO_FORMAT_ARGB32) {
+	for (y = 0; y < height && analysis->opaque; y++) {
+	    uint32_t alpha = 0xff000000;
+
+	    row = (const uint32_t *) (data + y * stride);
+	    for (x = 0; x < width; x++)
+		alpha &= row[x];
+	    analysis->opaque = alpha == 0xff000000;
+	}
+    }
+
+    for (y = 0; y < height; y++) {
+	row = (const uint32_t *) (data + y * stride);
+	for (x = 0; x < width; x++) {
+	    pixel = row[x];
+	    if (analysis->opaque)
+		pixel |= 0xff000000;
+
+	    if (analysis->gray &&
+		(((pixel >> 16) & 0xff) != (pixel & 0xff) ||
+		 ((pixel >> 8) & 0xff) != (pixel & 0xff)))
+		analysis->gray = 0;
+
+	    /* runs of one color are common, and take no lookup */
+	    if (analysis->fits_palette && (pixel != last || (x == 0 && y == 0)) &&
+		_svg_cairo_png_palette_lookup (palette, pixel) < 0)
+		analysis->fits_palette = 0;
+	    last = pixel;
+
+	    if (! analysis->gray && ! analysis->fits_palette)
+		return;
+	}
+    }
+}
+
+/* Puts the colors with any transparency first, so that the tRNS chunk
+ * stops short of the opaque ones */
+static int
+_svg_cairo_png_palette_sort (svg_cairo_png_palette_t *palette)
+{
+    unsigned char remap[SVG_CAIRO_PNG_MAX_COLORS];
+    uint32_t color[SVG_CAIRO_PNG_MAX_COLORS];
+    int i, n = 0, num_trans;
+
+    for (i = 0; i < palette->num_colors; i++)
+	if ((palette->color[i] >> 24) != 0xff) {
+	    remap[i] = n;
+	    color[n++] = palette->color[i];
+	}
+    num_trans = n;
+    for (i = 0; i < palette->num_colors; i++)
+	if ((palette->color[i] >> 24) == 0xff) {
+	    remap[i] = n;
+	    color[n++] = palette->color[i];
+	}
+
+    memcpy (palette->color, color, palette->num_colors * sizeof (uint32_t));
+    for (i = 0; i < SVG_CAIRO_PNG_HASH_SIZE; i++)
+	if (palette->index[i] >= 0)
+	    palette->index[i] = remap[palette->index[i]];
+
+    return num_trans;
+}
+
+static void
+_svg_cairo_png_error (png_structp png, png_const_charp message)
+{
+    svg_cairo_png_writer_t *writer = png_get_error_ptr (png);
+
+    if (writer->status == SVG_CAIRO_STATUS_SUCCESS)
+	writer->status = SVG_CAIRO_STATUS_NO_MEMORY;
+
+    longjmp (png_jmpbuf (png), 1);
+}
+
+static void
+_svg_cairo_png_warning (png_structp png, png_const_charp message)
+{
+}
+
+static void
+_svg_cairo_png_write (png_structp png, png_bytep data, png_size_t length)
+{
+    svg_cairo_png_writer_t *writer = png_get_io_ptr (png);
+
+    if (writer->write_func (writer->closure, data, length)) {
+	writer->status = SVG_CAIRO_STATUS_IO_ERROR;
+	png_error (png, "write failed");
+    }
+}
+
+static void
+_svg_cairo_png_flush (png_structp png)
+{
+}
+
+static int
+_svg_cairo_png_filters (svg_cairo_png_filter_t filter, int color_type)
+{
+    switch (filter) {
+    case SVG_CAIRO_PNG_FILTER_NONE:
+	return PNG_FILTER_NONE;
+    case SVG_CAIRO_PNG_FILTER_SUB:
+	return PNG_FILTER_SUB;
+    case SVG_CAIRO_PNG_FILTER_UP:
+	return PNG_FILTER_UP;
+    case SVG_CAIRO_PNG_FILTER_AVG:
+	return PNG_FILTER_AVG;
+    case SVG_CAIRO_PNG_FILTER_PAETH:
+	return PNG_FILTER_PAETH;
+    case SVG_CAIRO_PNG_FILTER_ADAPTIVE:
+	break;
+    }
+
+    /* filtering palette indices seldom pays, libpng doesn't by default */
+    return color_type == PNG_COLOR_TYPE_PALETTE ? PNG_FILTER_NONE : PNG_ALL_FILTERS;
+}
+
+static int
+_svg_cairo_png_strategy (svg_cairo_png_strategy_t strategy)
+{
+    switch (strategy) {
+    case SVG_CAIRO_PNG_STRATEGY_FILTERED:
+	return Z_FILTERED;
+    case SVG_CAIRO_PNG_STRATEGY_HUFFMAN_ONLY:
+	return Z_HUFFMAN_ONLY;
+    case SVG_CAIRO_PNG_STRATEGY_RLE:
+	return Z_RLE;
+    case SVG_CAIRO_PNG_STRATEGY_DEFAULT:
+	break;
+    }
+
+    return -1;
+}
+
+/* One row of the surface in the layout color_type has */
+static void
+_svg_cairo_png_convert_row (const unsigned char		*src,
+			    unsigned char		*dst,
+			    int				width,
+			    int				color_type,
+			    svg_cairo_png_palette_t	*palette,
+			    int				opaque)
+{
+    const uint32_t *pixels = (const uint32_t *) src;
+    uint32_t pixel, last = 0;
+    int x, index = 0;
+
+    switch (color_type) {
+    case PNG_COLOR_TYPE_PALETTE:
+	for (x = 0; x < width; x++) {
+	    pixel = opaque ? pixels[x] | 0xff000000 : pixels[x];
+	    if (x == 0 || pixel != last)
+		index = _svg_cairo_png_palette_lookup (palette, pixel);
+	    dst[x] = index;
+	    last = pixel;
+	}
+	break;
+    case PNG_COLOR_TYPE_GRAY:
+	for (x = 0; x < width; x++)
+	    dst[x] = pixels[x];
+	break;
+    case PNG_COLOR_TYPE_RGB:
+	for (x = 0; x < width; x++, dst += 3) {
+	    pixel = pixels[x];
+	    dst[0] = pixel >> 16;
+	    dst[1] = pixel >> 8;
+	    dst[2] = pixel;
+	}
+	break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+	memcpy (dst, src, width * 4);
+	_svg_cairo_argb32_to_rgba8888 (dst, width, 1, width * 4);
+	for (x = 0; x < width; x++) {
+	    dst[2 * x] = dst[4 * x];
+	    dst[2 * x + 1] = dst[4 * x + 3];
+	}
+	break;
+    default:
+	memcpy (dst, src, width * 4);
+	_svg_cairo_argb32_to_rgba8888 (dst, width, 1, width * 4);
+	break;
+    }
+}
+
+/* Packs the one-byte palette indices of row down to bit_depth, in
+ * place, leftmost pixel in the high bits */
+static void
+_svg_cairo_png_pack_row (unsigned char *row, int width, int bit_depth)
+{
+    int per_byte = 8 / bit_depth;
+    int i, k, x, value;
+
+    for (i = 0, x = 0; x < width; i++) {
+	value = 0;
+	for (k = 0; k < per_byte; k++, x++) {
+	    value <<= bit_depth;
+	    if (x < width)
+		value |= row[x];
+	}
+	row[i] = value;
+    }
+}
+
+static void
+_svg_cairo_png_prepare_row (const svg_cairo_png_job_t *job, int y, unsigned char *row)
+{
+    _svg_cairo_png_convert_row (job->data + y * job->stride, row, job->width,
+				job->color_type, job->palette, job->opaque);
+    if (job->bit_depth < 8)
+	_svg_cairo_png_pack_row (row, job->width, job->bit_depth);
+}
+
+static int
+_svg_cairo_png_paeth (int a, int b, int c)
+{
+    int p = b - c, q = a - c;
+    int pa = abs (p), pb = abs (q), pc = abs (p + q);
+
+    if (pa <= pb && pa <= pc)
+	return a;
+    return pb <= pc ? b : c;
+}
+
+/* Filters row by type into out, after the filter type byte, and sums
+ * the bytes as signed magnitudes the way libpng weighs its choice,
+ * giving up once past limit */
+static unsigned long
+_svg_cairo_png_filter_row_by (int			type,
+			      const unsigned char	*row,
+			      const unsigned char	*prior,
+			      int			row_bytes,
+			      int			bpp,
+			      unsigned char		*out,
+			      unsigned long		limit)
+{
+    unsigned long sum = 0;
+    unsigned char v;
+    int i, n;
+
+    out[0] = type;
+    out++;
+
+    /* the first pixel has nothing to its left */
+    n = bpp < row_bytes ? bpp : row_bytes;
+    for (i = 0; i < n; i++) {
+	switch (type) {
+	case 2:
+	case 4:
+	    out[i] = row[i] - prior[i];
+	    break;
+	case 3:
+	    out[i] = row[i] - (prior[i] >> 1);
+	    break;
+	default:
+	    out[i] = row[i];
+	    break;
+	}
+	sum += out[i] < 128 ? out[i] : 256 - out[i];
+    }
+
+    switch (type) {
+    case 1:
+	for (; i < row_bytes && sum <= limit; i++) {
+	    out[i] = v = row[i] - row[i - bpp];
+	    sum += v < 128 ? v : 256 - v;
+	}
+	break;
+    case 2:
+	for (; i < row_bytes && sum <= limit; i++) {
+	    out[i] = v = row[i] - prior[i];
+	    sum += v < 128 ? v : 256 - v;
+	}
+	break;
+    case 3:
+	for (; i < row_bytes && sum <= limit; i++) {
+	    out[i] = v = row[i] - ((row[i - bpp] + prior[i]) >> 1);
+	    sum += v < 128 ? v : 256 - v;
+	}
+	break;
+    case 4:
+	for (; i < row_bytes && sum <= limit; i++) {
+	    out[i] = v = row[i] - _svg_cairo_png_paeth (row[i - bpp], prior[i], prior[i - bpp]);
+	    sum += v < 128 ? v : 256 - v;
+	}
+	break;
+    default:
+	for (; i < row_bytes && sum <= limit; i++) {
+	    out[i] = v = row[i];
+	    sum += v < 128 ? v : 256 - v;
+	}
+	break;
+    }
+
+    return sum;
+}
+
+/* One filtered row, in filtered or scratch, whichever is returned */
+static const unsigned char *
+_svg_cairo_png_filter_row (const svg_cairo_png_job_t	*job,
+			   const unsigned char		*row,
+			   const unsigned char		*prior,
+			   unsigned char		*filtered,
+			   unsigned char		*scratch)
+{
+    static const int masks[5] = {
+	PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH
+    };
+    unsigned char *best = NULL, *try = filtered, *swap;
+    unsigned long best_sum = (unsigned long) -1, sum;
+    int type;
+
+    for (type = 0; type < 5; type++) {
+	if (! (job->filters & masks[type]))
+	    continue;
+	sum = _svg_cairo_png_filter_row_by (type, row, prior, job->row_bytes, job->bpp,
+					    try, best_sum);
+	if (best == NULL || sum < best_sum) {
+	    best_sum = sum;
+	    swap = best ? best : scratch;
+	    best = try;
+	    try = swap;
+	}
+    }
+
+    return best;
+}
+
+/* Makes room for at least some more output */
+static svg_cairo_status_t
+_svg_cairo_png_band_reserve (svg_cairo_png_band_t *band, size_t length)
+{
+    unsigned char *new_out;
+    size_t new_size;
+
+    if (band->out_size - band->out_len >= length)
+	return SVG_CAIRO_STATUS_SUCCESS;
+
+    new_size = band->out_size * 2;
+    if (new_size < band->out_len + length)
+	new_size = band->out_len + length;
+
+    new_out = realloc (band->out, new_size);
+    if (new_out == NULL)
+	return SVG_CAIRO_STATUS_NO_MEMORY;
+
+    band->out = new_out;
+    band->out_size = new_size;
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+static svg_cairo_status_t
+_svg_cairo_png_band_deflate (svg_cairo_png_band_t	*band,
+			     z_stream			*zs,
+			     int			flush)
+{
+    svg_cairo_status_t status;
+    int ret;
+
+    do {
+	status = _svg_cairo_png_band_reserve (band, 1024);
+	if (status)
+	    return status;
+
+	zs->next_out = band->out + band->out_len;
+	zs->avail_out = band->out_size - band->out_len;
+	ret = deflate (zs, flush);
+	band->out_len = band->out_size - zs->avail_out;
+	if (ret == Z_STREAM_ERROR)
+	    return SVG_CAIRO_STATUS_NO_MEMORY;
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END : zs->avail_out == 0);
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+/* Filters the rows that come before band back to a window's worth and
+ * hands them to zs as its dictionary, leaving the last one in prior */
+static svg_cairo_status_t
+_svg_cairo_png_band_prime (svg_cairo_png_band_t	*band,
+			   z_stream		*zs,
+			   unsigned char	**row,
+			   unsigned char	**prior,
+			   unsigned char	*filtered,
+			   unsigned char	*scratch)
+{
+    const svg_cairo_png_job_t *job = band->job;
+    size_t line = job->row_bytes + 1;
+    unsigned char *dictionary, *swap;
+    const unsigned char *out;
+    size_t length = 0;
+    int y, y0;
+
+    y0 = band->y0 - (SVG_CAIRO_PNG_WINDOW_SIZE + line - 1) / line;
+    if (y0 < 0)
+	y0 = 0;
+
+    dictionary = malloc ((band->y0 - y0) * line);
+    if (dictionary == NULL)
+	return SVG_CAIRO_STATUS_NO_MEMORY;
+
+    if (y0 > 0)
+	_svg_cairo_png_prepare_row (job, y0 - 1, *prior);
+    for (y = y0; y < band->y0; y++) {
+	_svg_cairo_png_prepare_row (job, y, *row);
+	out = _svg_cairo_png_filter_row (job, *row, *prior, filtered, scratch);
+	memcpy (dictionary + length, out, line);
+	length += line;
+	swap = *prior;
+	*prior = *row;
+	*row = swap;
+    }
+
+    if (length > SVG_CAIRO_PNG_WINDOW_SIZE)
+	deflateSetDictionary (zs, dictionary + length - SVG_CAIRO_PNG_WINDOW_SIZE,
+			      SVG_CAIRO_PNG_WINDOW_SIZE);
+    else
+	deflateSetDictionary (zs, dictionary, length);
+    free (dictionary);
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+static void *
+_svg_cairo_png_band_encode (void *closure)
+{
+    svg_cairo_png_band_t *band = closure;
+    const svg_cairo_png_job_t *job = band->job;
+    size_t line = job->row_bytes + 1;
+    /* rows are converted at four bytes a pixel before they're packed */
+    size_t row_size = job->width * 4 > job->row_bytes ? job->width * 4 : job->row_bytes;
+    unsigned char *buffer, *row, *prior, *filtered, *scratch, *swap;
+    const unsigned char *out;
+    z_stream zs;
+    int y;
+
+    buffer = malloc (2 * row_size + 2 * line);
+    if (buffer == NULL) {
+	band->status = SVG_CAIRO_STATUS_NO_MEMORY;
+	return NULL;
+    }
+    row = buffer;
+    prior = row + row_size;
+    filtered = prior + row_size;
+    scratch = filtered + line;
+    memset (prior, 0, row_size);
+
+    memset (&zs, 0, sizeof (z_stream));
+    if (deflateInit2 (&zs, job->level, Z_DEFLATED, -15, 8, job->strategy) != Z_OK) {
+	free (buffer);
+	band->status = SVG_CAIRO_STATUS_NO_MEMORY;
+	return NULL;
+    }
+
+    band->adler = adler32 (0, NULL, 0);
+    band->in_len = 0;
+
+    /* enough as a rule, so the band isn't copied as it grows */
+    band->status = _svg_cairo_png_band_reserve (band, deflateBound (&zs, (band->y1 - band->y0) * line));
+
+    if (band->y0 > 0 && band->status == SVG_CAIRO_STATUS_SUCCESS)
+	band->status = _svg_cairo_png_band_prime (band, &zs, &row, &prior, filtered, scratch);
+
+    for (y = band->y0; y < band->y1 && band->status == SVG_CAIRO_STATUS_SUCCESS; y++) {
+	_svg_cairo_png_prepare_row (job, y, row);
+	out = _svg_cairo_png_filter_row (job, row, prior, filtered, scratch);
+	band->adler = adler32 (band->adler, out, line);
+	band->in_len += line;
+
+	zs.next_in = (Bytef *) out;
+	zs.avail_in = line;
+	band->status = _svg_cairo_png_band_deflate (band, &zs, Z_NO_FLUSH);
+
+	swap = prior;
+	prior = row;
+	row = swap;
+    }
+
+    if (band->status == SVG_CAIRO_STATUS_SUCCESS)
+	band->status = _svg_cairo_png_band_deflate (band, &zs,
+						    band->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+    deflateEnd (&zs);
+    free (buffer);
+
+    return NULL;
+}
+
+/* How many bands the image data is cut into, 1 for none */
+static int
+_svg_cairo_png_num_bands (const svg_cairo_png_options_t *options, int row_bytes, int height)
+{
+    double size = (double) (row_bytes + 1) * height;
+    unsigned int threads = options->threads;
+    long cpus;
+
+    if (threads == 0) {
+	cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	threads = cpus > 0 ? cpus : 1;
+    }
+
+    if (threads > size / SVG_CAIRO_PNG_MIN_BYTES_PER_THREAD)
+	threads = size / SVG_CAIRO_PNG_MIN_BYTES_PER_THREAD;
+    if (threads > (unsigned int) height)
+	threads = height;
+
+    return threads > 1 ? threads : 1;
+}
+
+static void
+_svg_cairo_png_bands_destroy (svg_cairo_png_band_t *bands, int num_bands)
+{
+    int i;
+
+    for (i = 0; i < num_bands; i++)
+	free (bands[i].out);
+    free (bands);
+}
+
+/* Deflates the image data as one zlib stream in num_bands bands, the
+ * first on this thread */
+static svg_cairo_status_t
+_svg_cairo_png_bands_encode (const svg_cairo_png_job_t	*job,
+			     int			height,
+			     int			num_bands,
+			     svg_cairo_png_band_t	**bands_return)
+{
+    svg_cairo_png_band_t *bands;
+    svg_cairo_status_t status = SVG_CAIRO_STATUS_SUCCESS;
+    svg_cairo_png_band_t *last;
+    uLong adler;
+    int cmf = 0x78, flg, level = job->level < 0 ? 6 : job->level;
+    int i;
+
+    bands = calloc (num_bands, sizeof (svg_cairo_png_band_t));
+    if (bands == NULL)
+	return SVG_CAIRO_STATUS_NO_MEMORY;
+
+    for (i = 0; i < num_bands; i++) {
+	bands[i].job = job;
+	bands[i].y0 = (long long) height * i / num_bands;
+	bands[i].y1 = (long long) height * (i + 1) / num_bands;
+	bands[i].last = i == num_bands - 1;
+    }
+
+    /* room for the zlib header */
+    status = _svg_cairo_png_band_reserve (&bands[0], 2);
+    if (status) {
+	free (bands);
+	return status;
+    }
+    bands[0].out_len = 2;
+
+    for (i = 1; i < num_bands; i++)
+	bands[i].threaded = pthread_create (&bands[i].thread, NULL,
+					    _svg_cairo_png_band_encode, &bands[i]) == 0;
+    _svg_cairo_png_band_encode (&bands[0]);
+    for (i = 1; i < num_bands; i++) {
+	if (bands[i].threaded)
+	    pthread_join (bands[i].thread, NULL);
+	else
+	    _svg_cairo_png_band_encode (&bands[i]);
+    }
+
+    for (i = 0; i < num_bands && status == SVG_CAIRO_STATUS_SUCCESS; i++)
+	status = bands[i].status;
+    last = &bands[num_bands - 1];
+    if (status == SVG_CAIRO_STATUS_SUCCESS)
+	status = _svg_cairo_png_band_reserve (last, 4);
+    if (status) {
+	_svg_cairo_png_bands_destroy (bands, num_bands);
+	return status;
+    }
+
+    /* the header zlib would have written, compression level and all */
+    if (job->strategy == Z_HUFFMAN_ONLY || job->strategy == Z_RLE || level < 2)
+	flg = 0 << 6;
+    else if (level < 6)
+	flg = 1 << 6;
+    else if (level == 6)
+	flg = 2 << 6;
+    else
+	flg = 3 << 6;
+    flg += 31 - (cmf * 256 + flg) % 31;
+    bands[0].out[0] = cmf;
+    bands[0].out[1] = flg;
+
+    adler = bands[0].adler;
+    for (i = 1; i < num_bands; i++)
+	adler = adler32_combine (adler, bands[i].adler, bands[i].in_len);
+    last->out[last->out_len++] = adler >> 24;
+    last->out[last->out_len++] = adler >> 16;
+    last->out[last->out_len++] = adler >> 8;
+    last->out[last->out_len++] = adler;
+
+    *bands_return = bands;
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+svg_cairo_status_t
+svg_cairo_write_png (cairo_surface_t			*surface,
+		     const svg_cairo_png_options_t	*options,
+		     cairo_write_func_t			write_func,
+		     void				*closure)
+{
+    svg_cairo_png_options_t default_options;
+    svg_cairo_png_analysis_t analysis;
+    svg_cairo_png_palette_t *palette = NULL;
+    svg_cairo_png_writer_t writer;
+    png_color plte[SVG_CAIRO_PNG_MAX_COLORS];
+    png_byte trns[SVG_CAIRO_PNG_MAX_COLORS];
+    svg_cairo_png_job_t job;
+    svg_cairo_png_band_t *bands = NULL;
+    svg_cairo_status_t status;
+    png_structp png;
+    png_infop info;
+    unsigned char *data, *row = NULL;
+    cairo_format_t format;
+    int width, height, stride;
+    int color_type, bit_depth = 8, num_trans = 0, channels;
+    int i, y, num_bands;
+    size_t offset, length;
+
+    if (cairo_surface_get_type (surface) != CAIRO_SURFACE_TYPE_IMAGE)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    format = cairo_image_surface_get_format (surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    if (options == NULL) {
+	svg_cairo_png_options_init (&default_options);
+	options = &default_options;
+    }
+
+    cairo_surface_flush (surface);
+    data = cairo_image_surface_get_data (surface);
+    width = cairo_image_surface_get_width (surface);
+    height = cairo_image_surface_get_height (surface);
+    stride = cairo_image_surface_get_stride (surface);
+    if (width <= 0 || height <= 0)
+	return SVG_CAIRO_STATUS_INVALID_VALUE;
+
+    if (options->reduce_color_type) {
+	palette = malloc (sizeof (svg_cairo_png_palette_t));
+	if (palette == NULL)
+	    return SVG_CAIRO_STATUS_NO_MEMORY;
+	memset (palette->index, 0xff, sizeof (palette->index));
+	palette->num_colors = 0;
+
+	_svg_cairo_png_analyze (data, width, height, stride, format, palette, &analysis);
+
+	/* 8-bit gray beats a palette of more than 16 levels: no PLTE */
+	if (analysis.fits_palette &&
+	    (palette->num_colors <= 16 || ! analysis.gray || ! analysis.opaque))
+	    color_type = PNG_COLOR_TYPE_PALETTE;
+	else if (analysis.gray)
+	    color_type = analysis.opaque ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_GRAY_ALPHA;
+	else
+	    color_type = analysis.opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+    } else {
+	analysis.opaque = format == CAIRO_FORMAT_RGB24;
+	color_type = analysis.opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+    }
+    if (format == CAIRO_FORMAT_RGB24)
+	analysis.opaque = 1;
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+	num_trans = _svg_cairo_png_palette_sort (palette);
+	for (i = 0; i < palette->num_colors; i++) {
+	    uint32_t rgba = palette->color[i];
+
+	    _svg_cairo_argb32_to_rgba8888 ((unsigned char *) &rgba, 1, 1, 4);
+	    plte[i].red = ((unsigned char *) &rgba)[0];
+	    plte[i].green = ((unsigned char *) &rgba)[1];
+	    plte[i].blue = ((unsigned char *) &rgba)[2];
+	    trns[i] = ((unsigned char *) &rgba)[3];
+	}
+	if (palette->num_colors <= 2)
+	    bit_depth = 1;
+	else if (palette->num_colors <= 4)
+	    bit_depth = 2;
+	else if (palette->num_colors <= 16)
+	    bit_depth = 4;
+    }
+
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+	channels = 2;
+	break;
+    case PNG_COLOR_TYPE_RGB:
+	channels = 3;
+	break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+	channels = 4;
+	break;
+    default:
+	channels = 1;
+	break;
+    }
+
+    job.data = data;
+    job.width = width;
+    job.stride = stride;
+    job.color_type = color_type;
+    job.bit_depth = bit_depth;
+    job.palette = palette;
+    job.opaque = analysis.opaque;
+    job.row_bytes = ((long long) width * bit_depth * channels + 7) / 8;
+    job.bpp = (bit_depth * channels + 7) / 8;
+    job.filters = _svg_cairo_png_filters (options->filter, color_type);
+    job.level = options->compression_level >= 0 ? options->compression_level : Z_DEFAULT_COMPRESSION;
+    /* as libpng picks it */
+    job.strategy = _svg_cairo_png_strategy (options->strategy);
+    if (job.strategy < 0)
+	job.strategy = job.filters != PNG_FILTER_NONE ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+
+    num_bands = _svg_cairo_png_num_bands (options, job.row_bytes, height);
+    if (num_bands > 1) {
+	status = _svg_cairo_png_bands_encode (&job, height, num_bands, &bands);
+	if (status) {
+	    free (palette);
+	    return status;
+	}
+    }
+
+    row = malloc (width * 4);
+    if (row == NULL) {
+	writer.status = SVG_CAIRO_STATUS_NO_MEMORY;
+	goto BAIL_BANDS;
+    }
+
+    writer.write_func = write_func;
+    writer.closure = closure;
+    writer.status = SVG_CAIRO_STATUS_SUCCESS;
+
+    png = png_create_write_struct (PNG_LIBPNG_VER_STRING, &writer,
+				   _svg_cairo_png_error,
+				   _svg_cairo_png_warning);
+    if (png == NULL) {
+	writer.status = SVG_CAIRO_STATUS_NO_MEMORY;
+	goto BAIL_BANDS;
+    }
+
+    info = png_create_info_struct (png);
+    if (info == NULL) {
+	writer.status = SVG_CAIRO_STATUS_NO_MEMORY;
+	goto BAIL;
+    }
+
+    if (setjmp (png_jmpbuf (png)))
+	goto BAIL;
+
+    png_set_write_fn (png, &writer, _svg_cairo_png_write, _svg_cairo_png_flush);
+
+    if (options->compression_level >= 0)
+	png_set_compression_level (png, options->compression_level);
+    /* left to libpng, it filters with Z_FILTERED and else uses zlib's */
+    if (_svg_cairo_png_strategy (options->strategy) >= 0)
+	png_set_compression_strategy (png, _svg_cairo_png_strategy (options->strategy));
+    png_set_filter (png, PNG_FILTER_TYPE_BASE, _svg_cairo_png_filters (options->filter, color_type));
+
+    png_set_IHDR (png, info, width, height, bit_depth, color_type,
+		  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		  PNG_FILTER_TYPE_DEFAULT);
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+	png_set_PLTE (png, info, plte, palette->num_colors);
+	if (num_trans)
+	    png_set_tRNS (png, info, trns, num_trans, NULL);
+    }
+
+    png_write_info (png, info);
+
+    if (bands) {
+	/* an IDAT a band, unless it's past what a chunk can hold, and
+	   nothing else to end with */
+	for (i = 0; i < num_bands; i++) {
+	    for (offset = 0; offset < bands[i].out_len; offset += length) {
+		length = bands[i].out_len - offset;
+		if (length > PNG_UINT_31_MAX)
+		    length = PNG_UINT_31_MAX;
+		png_write_chunk (png, (png_bytep) "IDAT", bands[i].out + offset, length);
+	    }
+	}
+	png_write_chunk (png, (png_bytep) "IEND", NULL, 0);
+	goto BAIL;
+    }
+
+    if (bit_depth < 8)
+	png_set_packing (png);
+
+    for (y = 0; y < height; y++) {
+	_svg_cairo_png_convert_row (data + y * stride, row, width, color_type,
+				    palette, analysis.opaque);
+	png_write_row (png, row);
+    }
+
+    png_write_end (png, info);
+
+BAIL:
+    png_destroy_write_struct (&png, &info);
+BAIL_BANDS:
+    if (bands)
+	_svg_cairo_png_bands_destroy (bands, num_bands);
+    free (row);
+    free (palette);
+
+    return writer.status;
+}
@@ -0,0 +1,234 @@
+/* libsvg-cairo - Render SVG documents using the cairo library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+#include "svg-cairo-internal.h"
+
+/* Elements too small to make out are drawn as boxes of their average
+ * color. Going through cairo, each of those would cost as much as
+ * the element itself, so they are blended straight into the pixels
+ * of a pooled surface instead, which goes onto the context as one
+ * paint before anything else is drawn there.
+ *
+ * The surface covers the device extents of the clip at the first
+ * splat, as what falls outside of it can't be seen anyway.
+ */
+
+/* beyond this the splats are filled through cairo one by one */
+#define SVG_CAIRO_SPLAT_MAX_PIXELS (1024 * 1024)
+
+static int
+_svg_cairo_splats_begin (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_splats_t *splats = &svg_cairo->splats;
+    cairo_t *cr = svg_cairo->cr;
+    double x[4], y[4];
+    double min_x, min_y, max_x, max_y;
+    int i, width, height;
+
+    if (splats->buffer && splats->cr == cr)
+	return 1;
+    _svg_cairo_splats_flush (svg_cairo);
+
+    if (cairo_surface_get_type (cairo_get_target (cr)) != CAIRO_SURFACE_TYPE_IMAGE)
+	return 0;
+
+    cairo_clip_extents (cr, &x[0], &y[0], &x[3], &y[3]);
+    x[1] = x[3]; y[1] = y[0];
+    x[2] = x[0]; y[2] = y[3];
+    for (i = 0; i < 4; i++)
+	cairo_user_to_device (cr, &x[i], &y[i]);
+
+    min_x = max_x = x[0];
+    min_y = max_y = y[0];
+    for (i = 1; i < 4; i++) {
+	if (x[i] < min_x) min_x = x[i];
+	if (x[i] > max_x) max_x = x[i];
+	if (y[i] < min_y) min_y = y[i];
+	if (y[i] > max_y) max_y = y[i];
+    }
+
+    min_x = floor (min_x);
+    min_y = floor (min_y);
+    if (max_x - min_x > SVG_CAIRO_SPLAT_MAX_PIXELS ||
+	max_y - min_y > SVG_CAIRO_SPLAT_MAX_PIXELS)
+	return 0;
+    width = (int) ceil (max_x - min_x);
+    height = (int) ceil (max_y - min_y);
+    if (width <= 0 || height <= 0 ||
+	(double) width * height > SVG_CAIRO_SPLAT_MAX_PIXELS)
+	return 0;
+
+    splats->buffer = _svg_cairo_surface_pool_acquire (svg_cairo->pool,
+						      width, height,
+						      width, height);
+    if (splats->buffer == NULL)
+	return 0;
+    cairo_surface_flush (cairo_get_target (splats->buffer));
+
+    splats->cr = cr;
+    splats->x = (int) min_x;
+    splats->y = (int) min_y;
+    splats->width = width;
+    splats->height = height;
+    splats->dirty.left = width;
+    splats->dirty.top = height;
+    splats->dirty.right = 0;
+    splats->dirty.bottom = 0;
+
+    return 1;
+}
+
+static double
+_svg_cairo_splat_overlap (int pixel, double from, double to)
+{
+    if (from < pixel)
+	from = pixel;
+    if (to > pixel + 1)
+	to = pixel + 1;
+
+    return to > from ? to - from : 0.0;
+}
+
+svg_status_t
+_svg_cairo_splat (svg_cairo_t		*svg_cairo,
+		  const svg_rect_t	*rect,
+		  const svg_color_t	*color,
+		  double		opacity)
+{
+    svg_cairo_splats_t *splats = &svg_cairo->splats;
+    cairo_matrix_t matrix;
+    cairo_surface_t *surface;
+    unsigned char *data;
+    uint32_t *row, pixel;
+    double x[4] = { rect->x, rect->x + rect->width, rect->x, rect->x + rect->width };
+    double y[4] = { rect->y, rect->y, rect->y + rect->height, rect->y + rect->height };
+    double min_x, min_y, max_x, max_y, area;
+    unsigned int red, green, blue, alpha, keep;
+    int i, px, py, x1, y1, x2, y2, stride;
+
+    if (! _svg_cairo_splats_begin (svg_cairo)) {
+	cairo_rectangle (svg_cairo->cr, rect->x, rect->y, rect->width, rect->height);
+	cairo_set_source_rgba (svg_cairo->cr,
+			       svg_color_get_red   (color) / 255.0,
+			       svg_color_get_green (color) / 255.0,
+			       svg_color_get_blue  (color) / 255.0,
+			       opacity);
+	cairo_fill (svg_cairo->cr);
+
+	return SVG_STATUS_SUCCESS;
+    }
+
+    for (i = 0; i < 4; i++) {
+	cairo_user_to_device (svg_cairo->cr, &x[i], &y[i]);
+	x[i] -= splats->x;
+	y[i] -= splats->y;
+    }
+
+    min_x = max_x = x[0];
+    min_y = max_y = y[0];
+    for (i = 1; i < 4; i++) {
+	if (x[i] < min_x) min_x = x[i];
+	if (x[i] > max_x) max_x = x[i];
+	if (y[i] < min_y) min_y = y[i];
+	if (y[i] > max_y) max_y = y[i];
+    }
+
+    /* a rotated box is spread over its bounds, with as much ink */
+    cairo_get_matrix (svg_cairo->cr, &matrix);
+    area = (max_x - min_x) * (max_y - min_y);
+    if (area > 0.0)
+	opacity *= fabs (matrix.xx * matrix.yy - matrix.xy * matrix.yx) *
+	    rect->width * rect->height / area;
+    if (opacity > 1.0)
+	opacity = 1.0;
+
+    x1 = min_x > 0 ? (int) min_x : 0;
+    y1 = min_y > 0 ? (int) min_y : 0;
+    x2 = max_x < splats->width ? (int) ceil (max_x) : splats->width;
+    y2 = max_y < splats->height ? (int) ceil (max_y) : splats->height;
+    if (x1 >= x2 || y1 >= y2)
+	return SVG_STATUS_SUCCESS;
+
+    surface = cairo_get_target (splats->buffer);
+    data = cairo_image_surface_get_data (surface);
+    stride = cairo_image_surface_get_stride (surface);
+
+    /* premultiplied OVER, weighted by how much of each pixel the box
+       covers */
+    for (py = y1; py < y2; py++) {
+	double cover_y = opacity * _svg_cairo_splat_overlap (py, min_y, max_y);
+
+	row = (uint32_t *) (data + py * stride);
+	for (px = x1; px < x2; px++) {
+	    alpha = (unsigned int) (cover_y * _svg_cairo_splat_overlap (px, min_x, max_x) * 255.0 + 0.5);
+	    if (alpha == 0)
+		continue;
+
+	    red = (svg_color_get_red (color) * alpha + 127) / 255;
+	    green = (svg_color_get_green (color) * alpha + 127) / 255;
+	    blue = (svg_color_get_blue (color) * alpha + 127) / 255;
+	    keep = 255 - alpha;
+
+	    pixel = row[px];
+	    row[px] =
+		((alpha + ((pixel >> 24) * keep + 127) / 255) << 24) |
+		((red + (((pixel >> 16) & 0xff) * keep + 127) / 255) << 16) |
+		((green + (((pixel >> 8) & 0xff) * keep + 127) / 255) << 8) |
+		(blue + ((pixel & 0xff) * keep + 127) / 255);
+	}
+    }
+
+    if ((unsigned int) x1 < splats->dirty.left) splats->dirty.left = x1;
+    if ((unsigned int) y1 < splats->dirty.top) splats->dirty.top = y1;
+    if ((unsigned int) x2 > splats->dirty.right) splats->dirty.right = x2;
+    if ((unsigned int) y2 > splats->dirty.bottom) splats->dirty.bottom = y2;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+void
+_svg_cairo_splats_flush (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_splats_t *splats = &svg_cairo->splats;
+    cairo_surface_t *surface;
+
+    if (splats->buffer == NULL)
+	return;
+
+    surface = cairo_get_target (splats->buffer);
+    cairo_surface_mark_dirty (surface);
+
+    if (splats->dirty.left < splats->dirty.right) {
+	cairo_save (splats->cr);
+	cairo_identity_matrix (splats->cr);
+	cairo_rectangle (splats->cr,
+			 splats->x + (int) splats->dirty.left,
+			 splats->y + (int) splats->dirty.top,
+			 splats->dirty.right - splats->dirty.left,
+			 splats->dirty.bottom - splats->dirty.top);
+	cairo_set_source_surface (splats->cr, surface, splats->x, splats->y);
+	cairo_fill (splats->cr);
+	cairo_restore (splats->cr);
+    }
+
+    svg_cairo_surface_pool_release (svg_cairo->pool, splats->buffer);
+    splats->buffer = NULL;
+    splats->cr = NULL;
+}
@@ -19,21 +19,40 @@
  * Author: Carl D. Worth <cworth@isi.edu>
  */
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "svg-cairo-internal.h"
 
-svg_cairo_status_t
-_svg_cairo_state_create (svg_cairo_state_t **state)
-{
-    *state = malloc (sizeof (svg_cairo_state_t));
-    if (*state == NULL)
-	return SVG_CAIRO_STATUS_NO_MEMORY;
+/* The state stack is kept across renders in chunks of a fixed size,
+ * added as needed, so pushing a state is a copy of the one below it.
+ * A state never moves once pushed: the render holds pointers into
+ * states below the top while it pushes more. The font
+ * family and dash array are the only parts living on the heap. They
+ * are interned in svg_cairo and never modified, so a pushed state
+ * shares them with its parent until a set_* call replaces them.
+ *
+ * Pushing a state doesn't cairo_save. The style only goes into the
+ * state, and is applied to the cairo context when something is drawn
+ * and it differs from what was applied last. Only transforms and clips
+ * change the context directly, and save it first.
+ */
 
-    _svg_cairo_state_init (*state);
+#define SVG_CAIRO_STATE_CHUNK_SIZE 16
 
-    return SVG_CAIRO_STATUS_SUCCESS;
+#define SVG_CAIRO_STATE(svg_cairo, i) \
+    (&(svg_cairo)->state_chunks[(i) / SVG_CAIRO_STATE_CHUNK_SIZE][(i) % SVG_CAIRO_STATE_CHUNK_SIZE])
+
+/* Interned values are dropped between renders once there are this many */
+#define SVG_CAIRO_INTERNED_MAX 256
+
+void *
+_svg_cairo_alloc (svg_cairo_t *svg_cairo, size_t size)
+{
+    svg_cairo->allocations++;
+
+    return malloc (size);
 }
 
 svg_cairo_status_t
@@ -45,21 +64,25 @@ _svg_cairo_state_init (svg_cairo_state_t *state)
     state->fill_opacity;
     state->stroke_opacity;
     */
-    state->child_surface = NULL;
+    state->child_cr = NULL;
     state->saved_cr = NULL;
+    state->gstate_saved = 0;
 
-    state->font_family = strdup (SVG_CAIRO_FONT_FAMILY_DEFAULT);
-    if (state->font_family == NULL)
-	return SVG_CAIRO_STATUS_NO_MEMORY;
+    /* cairo's own defaults */
+    state->gstate.line_width = 2.0;
+    state->gstate.line_cap = CAIRO_LINE_CAP_BUTT;
+    state->gstate.line_join = CAIRO_LINE_JOIN_MITER;
+    state->gstate.miter_limit = 10.0;
+    state->gstate.fill_rule = CAIRO_FILL_RULE_WINDING;
 
-    state->font_size = 1.0;
-    state->font_style = SVG_FONT_STYLE_NORMAL;
-    state->font_weight = 400;
-    state->font_dirty = 1;
+    state->gstate.dash = NULL;
+    state->gstate.num_dashes = 0;
+    state->gstate.dash_offset = 0;
 
-    state->dash = NULL;
-    state->num_dashes = 0;
-    state->dash_offset = 0;
+    state->gstate.font_family = SVG_CAIRO_FONT_FAMILY_DEFAULT;
+    state->gstate.font_size = 1.0;
+    state->gstate.font_style = SVG_FONT_STYLE_NORMAL;
+    state->gstate.font_weight = 400;
 
     state->opacity = 1.0;
 
@@ -67,106 +90,155 @@ _svg_cairo_state_init (svg_cairo_state_t *state)
 
     state->text_anchor = SVG_TEXT_ANCHOR_START;
 
-    state->next = NULL;
-
     return SVG_CAIRO_STATUS_SUCCESS;
 }
 
 svg_cairo_status_t
-_svg_cairo_state_init_copy (svg_cairo_state_t *state, const svg_cairo_state_t *other)
+_svg_cairo_state_deinit (svg_cairo_state_t *state)
 {
-    _svg_cairo_state_deinit (state);
+    /* Neither context is ours: the child one belongs to the surface
+       pool and the saved one to whoever was drawing before it. The
+       font family and dashes belong to svg_cairo. */
+    state->child_cr = NULL;
+    state->saved_cr = NULL;
 
-    if (other == NULL)
-	return _svg_cairo_state_init (state);
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
 
-    *state = *other;
+svg_cairo_state_t *
+_svg_cairo_state_push (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_state_t **chunks;
+    svg_cairo_state_t *chunk;
+    unsigned int n = svg_cairo->num_states;
+
+    if (n == svg_cairo->num_state_chunks * SVG_CAIRO_STATE_CHUNK_SIZE) {
+	/* only the chunk pointers move, never the states */
+	chunks = realloc (svg_cairo->state_chunks,
+			  (svg_cairo->num_state_chunks + 1) * sizeof (svg_cairo_state_t *));
+	if (chunks == NULL)
+	    return NULL;
+	svg_cairo->state_chunks = chunks;
+	chunk = malloc (SVG_CAIRO_STATE_CHUNK_SIZE * sizeof (svg_cairo_state_t));
+	if (chunk == NULL)
+	    return NULL;
+	svg_cairo->allocations += 2;
+	chunks[svg_cairo->num_state_chunks++] = chunk;
+    }
 
-    /* We don't need our own child_surface or saved cr at this point. */
-    state->child_surface = NULL;
-    state->saved_cr = NULL;
+    svg_cairo->state = SVG_CAIRO_STATE (svg_cairo, n);
+    if (n == 0) {
+	_svg_cairo_state_init (svg_cairo->state);
+    } else {
+	*svg_cairo->state = *SVG_CAIRO_STATE (svg_cairo, n - 1);
+
+	/* We don't need our own child context or saved cr at this
+	   point, nor have we saved the cairo state. */
+	svg_cairo->state->child_cr = NULL;
+	svg_cairo->state->saved_cr = NULL;
+	svg_cairo->state->gstate_saved = 0;
+    }
+    svg_cairo->num_states++;
+
+    return svg_cairo->state;
+}
 
-    if (other->font_family)
-	state->font_family = strdup ((char *) other->font_family);
+svg_cairo_state_t *
+_svg_cairo_state_pop (svg_cairo_t *svg_cairo)
+{
+    if (svg_cairo->num_states == 0)
+	return NULL;
 
-    state->viewport_width = other->viewport_width;
-    state->viewport_height = other->viewport_height;
+    _svg_cairo_state_deinit (svg_cairo->state);
+    svg_cairo->num_states--;
 
-    if (other->dash) {
-	state->dash = malloc (state->num_dashes * sizeof(double));
-	if (state->dash == NULL)
-	    return SVG_CAIRO_STATUS_NO_MEMORY;
-	memcpy (state->dash, other->dash, state->num_dashes * sizeof(double));
-    }
+    if (svg_cairo->num_states == 0)
+	svg_cairo->state = NULL;
+    else
+	svg_cairo->state = SVG_CAIRO_STATE (svg_cairo, svg_cairo->num_states - 1);
 
-    return SVG_CAIRO_STATUS_SUCCESS;
+    return svg_cairo->state;
 }
 
-svg_cairo_status_t
-_svg_cairo_state_deinit (svg_cairo_state_t *state)
+static const void *
+_svg_cairo_intern (svg_cairo_t *svg_cairo, const void *data, size_t size)
 {
-    if (state->child_surface) {
-	cairo_surface_destroy(state->child_surface);
-	state->child_surface = NULL;
-    }
+    svg_cairo_interned_t *interned;
 
-    if (state->saved_cr) {
-	cairo_destroy(state->saved_cr);
-	state->saved_cr = NULL;
+    for (interned = svg_cairo->interned; interned; interned = interned->next) {
+	if (interned->size == size && memcmp (&interned->u, data, size) == 0)
+	    return &interned->u;
     }
 
-    if (state->font_family) {
-	free (state->font_family);
-	state->font_family = NULL;
-    }
+    interned = _svg_cairo_alloc (svg_cairo, offsetof (svg_cairo_interned_t, u) + size);
+    if (interned == NULL)
+	return NULL;
 
-    if (state->dash) {
-	free (state->dash);
-	state->dash = NULL;
-    }
+    interned->size = size;
+    memcpy (&interned->u, data, size);
+    interned->next = svg_cairo->interned;
+    svg_cairo->interned = interned;
+    svg_cairo->num_interned++;
 
-    state->next = NULL;
+    return &interned->u;
+}
 
-    return SVG_CAIRO_STATUS_SUCCESS;
+const char *
+_svg_cairo_intern_string (svg_cairo_t *svg_cairo, const char *str)
+{
+    return _svg_cairo_intern (svg_cairo, str, strlen (str) + 1);
 }
 
-svg_cairo_status_t
-_svg_cairo_state_destroy (svg_cairo_state_t *state)
+const double *
+_svg_cairo_intern_dash (svg_cairo_t *svg_cairo, const double *dash, int num_dashes)
 {
-    _svg_cairo_state_deinit (state);
+    return _svg_cairo_intern (svg_cairo, dash, num_dashes * sizeof (double));
+}
 
-    free (state);
+static void
+_svg_cairo_interned_clear (svg_cairo_t *svg_cairo)
+{
+    svg_cairo_interned_t *interned, *next;
 
-    return SVG_CAIRO_STATUS_SUCCESS;
+    for (interned = svg_cairo->interned; interned; interned = next) {
+	next = interned->next;
+	free (interned);
+    }
+    svg_cairo->interned = NULL;
+    svg_cairo->num_interned = 0;
 }
 
-svg_cairo_state_t *
-_svg_cairo_state_push (svg_cairo_state_t *state)
+/* Frees the interned values once there are too many of them. That is
+   only safe between renders, with nothing but the initial state left
+   to point at them. Returns whether they were freed, in which case
+   the caller is to drop whatever else it keyed on them. */
+int
+_svg_cairo_interned_trim (svg_cairo_t *svg_cairo)
 {
-    svg_cairo_state_t *new;
+    if (svg_cairo->num_interned < SVG_CAIRO_INTERNED_MAX || svg_cairo->num_states > 1)
+	return 0;
 
-    _svg_cairo_state_create (&new);
-    if (new == NULL)
-	return NULL;
-
-    _svg_cairo_state_init_copy (new, state);
+    if (svg_cairo->state)
+	_svg_cairo_state_init (svg_cairo->state);
 
-    new->next = state;
+    _svg_cairo_interned_clear (svg_cairo);
 
-    return new;
+    return 1;
 }
 
-svg_cairo_state_t *
-_svg_cairo_state_pop (svg_cairo_state_t *state)
+void
+_svg_cairo_state_stack_fini (svg_cairo_t *svg_cairo)
 {
-    svg_cairo_state_t *next;
-
-    if (state == NULL)
-	return NULL;
+    unsigned int i;
 
-    next = state->next;
+    while (svg_cairo->state)
+	_svg_cairo_state_pop (svg_cairo);
 
-    _svg_cairo_state_destroy (state);
+    for (i = 0; i < svg_cairo->num_state_chunks; i++)
+	free (svg_cairo->state_chunks[i]);
+    free (svg_cairo->state_chunks);
+    svg_cairo->state_chunks = NULL;
+    svg_cairo->num_state_chunks = 0;
 
-    return next;
+    _svg_cairo_interned_clear (svg_cairo);
 }
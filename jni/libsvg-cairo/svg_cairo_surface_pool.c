@@ -0,0 +1,252 @@
+/* libsvg-cairo - Render SVG documents using the cairo library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+
+#include "svg-cairo-internal.h"
+
+/* Offscreen image surfaces, each kept together with a cairo_t drawing
+ * on it, so that group layers, pattern tiles and whole renders don't
+ * allocate pixels or contexts once the pool has warmed up.
+ *
+ * A pooled context is handed out with one cairo_save() done on it and
+ * gets the matching cairo_restore() on release, which puts it back in
+ * its pristine state. A surface may outlive its release as the source
+ * of a pattern, so an entry is only reused once nobody but the pool
+ * holds a reference to it.
+ */
+
+typedef struct svg_cairo_pooled_surface {
+    cairo_t *cr;
+    int width;
+    int height;
+    size_t bytes;
+    int in_use;
+    unsigned long stamp;
+
+    /* references held by the pool and its context (cairo takes more
+       than one) while nobody else has the surface */
+    unsigned int idle_refs;
+
+    struct svg_cairo_pooled_surface *next;
+} svg_cairo_pooled_surface_t;
+
+struct svg_cairo_surface_pool {
+    svg_cairo_pooled_surface_t *entries;
+
+    size_t bytes;
+    size_t max_bytes;
+    unsigned long stamp;
+
+    unsigned int hits;
+    unsigned int misses;
+};
+
+static int
+_svg_cairo_pooled_surface_is_idle (svg_cairo_pooled_surface_t *entry)
+{
+    cairo_surface_t *surface = cairo_get_target (entry->cr);
+
+    return ! entry->in_use &&
+	cairo_surface_get_reference_count (surface) == entry->idle_refs;
+}
+
+static void
+_svg_cairo_pooled_surface_destroy (svg_cairo_pooled_surface_t *entry)
+{
+    cairo_surface_t *surface = cairo_get_target (entry->cr);
+
+    cairo_destroy (entry->cr);
+    cairo_surface_destroy (surface);
+    free (entry);
+}
+
+/* Drop idle surfaces, least recently used first, until the pool is
+   within its byte cap again. */
+static void
+_svg_cairo_surface_pool_trim (svg_cairo_surface_pool_t *pool)
+{
+    svg_cairo_pooled_surface_t **prev, **oldest, *entry;
+
+    while (pool->bytes > pool->max_bytes) {
+	oldest = NULL;
+	for (prev = &pool->entries; *prev; prev = &(*prev)->next) {
+	    if (_svg_cairo_pooled_surface_is_idle (*prev) &&
+		(oldest == NULL || (*prev)->stamp < (*oldest)->stamp))
+		oldest = prev;
+	}
+	if (oldest == NULL)
+	    return;
+
+	entry = *oldest;
+	*oldest = entry->next;
+	pool->bytes -= entry->bytes;
+	_svg_cairo_pooled_surface_destroy (entry);
+    }
+}
+
+svg_cairo_status_t
+svg_cairo_surface_pool_create (svg_cairo_surface_pool_t **pool, size_t max_bytes)
+{
+    *pool = malloc (sizeof (svg_cairo_surface_pool_t));
+    if (*pool == NULL)
+	return SVG_CAIRO_STATUS_NO_MEMORY;
+
+    (*pool)->entries = NULL;
+    (*pool)->bytes = 0;
+    (*pool)->max_bytes = max_bytes;
+    (*pool)->stamp = 0;
+    (*pool)->hits = 0;
+    (*pool)->misses = 0;
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+void
+svg_cairo_surface_pool_destroy (svg_cairo_surface_pool_t *pool)
+{
+    svg_cairo_pooled_surface_t *entry, *next;
+
+    if (pool == NULL)
+	return;
+
+    for (entry = pool->entries; entry; entry = next) {
+	next = entry->next;
+	_svg_cairo_pooled_surface_destroy (entry);
+    }
+
+    free (pool);
+}
+
+void
+svg_cairo_surface_pool_set_max_bytes (svg_cairo_surface_pool_t *pool, size_t max_bytes)
+{
+    pool->max_bytes = max_bytes;
+    _svg_cairo_surface_pool_trim (pool);
+}
+
+void
+svg_cairo_surface_pool_get_stats (svg_cairo_surface_pool_t	 *pool,
+				  svg_cairo_surface_pool_stats_t *stats)
+{
+    stats->hits = pool->hits;
+    stats->misses = pool->misses;
+    stats->bytes = pool->bytes;
+    stats->max_bytes = pool->max_bytes;
+}
+
+cairo_t *
+_svg_cairo_surface_pool_acquire (svg_cairo_surface_pool_t *pool,
+				 int width, int height,
+				 int used_width, int used_height)
+{
+    svg_cairo_pooled_surface_t *entry;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+
+    for (entry = pool->entries; entry; entry = entry->next) {
+	if (entry->width == width && entry->height == height &&
+	    _svg_cairo_pooled_surface_is_idle (entry))
+	    break;
+    }
+
+    if (entry) {
+	pool->hits++;
+	cairo_surface_set_device_offset (cairo_get_target (entry->cr), 0, 0);
+
+	/* a new surface comes zeroed, a recycled one is only cleared
+	   where the caller is going to look */
+	if (used_width > 0 && used_height > 0) {
+	    cairo_save (entry->cr);
+	    cairo_set_operator (entry->cr, CAIRO_OPERATOR_CLEAR);
+	    cairo_rectangle (entry->cr, 0, 0, used_width, used_height);
+	    cairo_fill (entry->cr);
+	    cairo_restore (entry->cr);
+	}
+    } else {
+	pool->misses++;
+
+	surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+	cr = cairo_create (surface);
+	if (cairo_status (cr)) {
+	    cairo_destroy (cr);
+	    cairo_surface_destroy (surface);
+	    return NULL;
+	}
+
+	entry = malloc (sizeof (svg_cairo_pooled_surface_t));
+	if (entry == NULL) {
+	    cairo_destroy (cr);
+	    cairo_surface_destroy (surface);
+	    return NULL;
+	}
+
+	entry->cr = cr;
+	entry->idle_refs = cairo_surface_get_reference_count (surface);
+	entry->width = width;
+	entry->height = height;
+	entry->bytes = (size_t) cairo_image_surface_get_stride (surface) * height;
+	entry->next = pool->entries;
+	pool->entries = entry;
+	pool->bytes += entry->bytes;
+
+	/* make room for it among the idle ones */
+	entry->in_use = 1;
+	_svg_cairo_surface_pool_trim (pool);
+    }
+
+    entry->in_use = 1;
+    entry->stamp = ++pool->stamp;
+
+    cairo_save (entry->cr);
+
+    return entry->cr;
+}
+
+cairo_t *
+svg_cairo_surface_pool_acquire (svg_cairo_surface_pool_t *pool, int width, int height)
+{
+    return _svg_cairo_surface_pool_acquire (pool, width, height, 0, 0);
+}
+
+void
+svg_cairo_surface_pool_release (svg_cairo_surface_pool_t *pool, cairo_t *cr)
+{
+    svg_cairo_pooled_surface_t **prev, *entry;
+
+    for (prev = &pool->entries; *prev; prev = &(*prev)->next) {
+	if ((*prev)->cr == cr)
+	    break;
+    }
+    entry = *prev;
+    if (entry == NULL)
+	return;
+
+    cairo_restore (cr);
+    cairo_new_path (cr);
+    entry->in_use = 0;
+
+    /* a context that went into an error state is no use to anybody */
+    if (cairo_status (cr)) {
+	*prev = entry->next;
+	pool->bytes -= entry->bytes;
+	_svg_cairo_pooled_surface_destroy (entry);
+	return;
+    }
+
+    _svg_cairo_surface_pool_trim (pool);
+}
@@ -38,15 +38,23 @@ LIBSVG_SOURCES = \
 	libsvg/svg_ascii.c \
 	libsvg/svg_attribute.c \
 	libsvg/svg_color.c \
+	libsvg/svg_damage.c \
+	libsvg/svg_data_uri.c \
 	libsvg/svg_element.c \
+	libsvg/svg_event.c \
+	libsvg/svg_extents.c \
 	libsvg/svg_gradient.c \
 	libsvg/svg_group.c \
 	libsvg/svg_length.c \
+	libsvg/svg_occlusion.c \
 	libsvg/svg_paint.c \
 	libsvg/svg_parser.c \
 	libsvg/svg_pattern.c \
 	libsvg/svg_image.c \
+	libsvg/svg_image_cache.c \
+	libsvg/svg_image_prefetch.c \
 	libsvg/svg_path.c \
+	libsvg/svg_pixels.c \
 	libsvg/svg_str.c \
 	libsvg/svg_style.c \
 	libsvg/svg_text.c \
@@ -63,4 +71,11 @@ LOCAL_CFLAGS += -DLIBSVG_EXPAT -DCONFIG_DIR=\"/\" -Ijni/libexpat/ -Ijni/libexpat
 LOCAL_SRC_FILES := \
 $(LIBJPEG_SOURCES) $(LIBPNG_SOURCES) $(ZLIB_SOURCES) $(LIBEXPAT_SOURCES) $(LIBSVG_SOURCES)
 
+# pixel conversions with NEON, used if the CPU has it
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_CFLAGS += -DSVG_PIXELS_NEON
+LOCAL_SRC_FILES += libsvg/svg_pixels_neon.c.neon
+endif
+LOCAL_STATIC_LIBRARIES := cpufeatures
+
 include $(BUILD_STATIC_LIBRARY)
\ No newline at end of file
@@ -66,6 +66,26 @@ _svg_init (svg_t *svg)
     svg->element_ids = StrHmapAlloc(100);
 
     svg->do_path_cache = 0;
+
+    svg->extents_serial = 1;
+    memset (&svg->render_stats, 0, sizeof (svg_render_stats_t));
+    svg->fold_opacity = 1.0;
+    svg->use_depth = 0;
+    svg->lod = SVG_LOD_NONE;
+    svg->lod_threshold = 0.0;
+    svg->occlusion_culling = 0;
+    svg->render_serial = 0;
+    svg->event_stack = NULL;
+    _svg_event_index_init (&svg->event_index);
+
+    /* nothing has been drawn yet */
+    svg->damage_serial = 0;
+    _svg_damage_reset (svg);
+    svg->damage_all = 1;
+    svg->rendering_damage = 0;
+    svg->damage_pass = 0;
+    svg->image_scale = 1.0;
+    svg->prefetch = NULL;
     
     return SVG_STATUS_SUCCESS;
 }
@@ -73,6 +93,9 @@ _svg_init (svg_t *svg)
 static svg_status_t
 _svg_deinit (svg_t *svg)
 {
+    _svg_prefetch_destroy (svg->prefetch);
+    svg->prefetch = NULL;
+
     free (svg->dir_name);
     svg->dir_name = NULL;
 
@@ -85,6 +108,8 @@ _svg_deinit (svg_t *svg)
 
     StrHmapFree(svg->element_ids);
 
+    _svg_event_index_fini (&svg->event_index);
+
     return SVG_STATUS_SUCCESS;
 }
 
@@ -198,6 +223,9 @@ svg_parse_buffer_and_inject (svg_t *svg, svg_element_t *parent, const char *buf,
 	if((parent->type == SVG_ELEMENT_TYPE_SVG_GROUP) ||
 	   (parent->type == SVG_ELEMENT_TYPE_GROUP)) {
 	
+		int num_elements = parent->e.group.num_elements;
+		int i;
+
 		status = _svg_parser_begin (&svg->parser);
 		if (status)
 			return status;
@@ -214,6 +242,11 @@ svg_parse_buffer_and_inject (svg_t *svg, svg_element_t *parent, const char *buf,
 			return status;
 		
 		status = _svg_parser_end (&svg->parser);
+
+		for (i = num_elements; i < parent->e.group.num_elements; i++)
+			_svg_damage_added (parent->e.group.element[i]);
+
+		_svg_extents_invalidate (svg);
 	} else {
 		status = SVG_STATUS_INVALID_CALL;
 	}
@@ -221,12 +254,49 @@ svg_parse_buffer_and_inject (svg_t *svg, svg_element_t *parent, const char *buf,
 	return status;
 }
 
+/* Takes element, and what is in it, off the hit list */
+static void
+_svg_event_stack_remove (svg_t *svg, svg_element_t *element)
+{
+	svg_element_t **current = &svg->event_stack;
+	svg_element_t *e;
+
+	while (*current != NULL) {
+		for (e = *current; e && e != SVG_DELETED_ELEMENT_OBJECT && e != element; e = e->parent)
+			;
+		if (e == element) {
+			_svg_event_index_remove (svg, *current);
+			*current = (*current)->next_event;
+		} else
+			current = &(*current)->next_event;
+	}
+}
+
 svg_status_t
 svg_drop_element(svg_t *svg, svg_element_t *element) {
+	svg_element_t *parent;
+
 	if(!element) {
 		return SVG_STATUS_INVALID_CALL;
 	}
 
+	_svg_damage_drawn (element);
+	_svg_event_stack_remove (svg, element);
+	_svg_extents_invalidate (svg);
+
+	/* with nothing else holding on to it, it goes from its parent
+	   right away, rather than being left there freed */
+	parent = element->parent;
+	if (element->ref_count == 0 &&
+	    parent != NULL && parent != SVG_DELETED_ELEMENT_OBJECT &&
+	    (parent->type == SVG_ELEMENT_TYPE_SVG_GROUP ||
+	     parent->type == SVG_ELEMENT_TYPE_GROUP ||
+	     parent->type == SVG_ELEMENT_TYPE_DEFS ||
+	     parent->type == SVG_ELEMENT_TYPE_SYMBOL)) {
+		_svg_group_drop_element (&parent->e.group, element);
+		return SVG_STATUS_SUCCESS;
+	}
+
 	return _svg_element_deinit(element);	
 }
 
@@ -245,43 +315,40 @@ svg_parse_chunk (svg_t *svg, const char *buf, size_t count)
 svg_status_t
 svg_parse_chunk_end (svg_t *svg)
 {
+    _svg_extents_invalidate (svg);
+    svg->damage_all = 1;
+
     return _svg_parser_end (&svg->parser);
 }
 
 void
 svg_element_enable_events(svg_element_t *element) {
+	if (element->do_events)
+		return;
+
+	/* on top until the next svg_render puts it in its place */
 	element->do_events = 1;
+	element->next_event = element->doc->event_stack;
+	element->doc->event_stack = element;
+	_svg_event_index_push (element->doc, element);
 }
 
 svg_element_t *
 svg_event_coords_match(svg_t *svg, int x, int y) {
-	svg_element_t *current = svg->event_stack;
-
-	while(current != NULL) {
-		if(x > current->bounding_box.left &&
-		   x < current->bounding_box.right &&
-		   y > current->bounding_box.top &&
-		   y < current->bounding_box.bottom) {
-			return current;
-		}
-		current = current->next_event;
-	}
-
-	return NULL;
+	return _svg_event_index_find (svg, x, y);
 }
 	
-svg_status_t
-svg_render (svg_t		*svg,
-	    svg_render_engine_t	*engine,
-	    void		*closure)
+static svg_status_t
+_svg_render (svg_t		 *svg,
+	     svg_render_engine_t *engine,
+	     void		 *closure)
 {
     svg_status_t status;
     char orig_dir[MAXPATHLEN];
 
-    if (svg->group_element == NULL)
-	return SVG_STATUS_SUCCESS;
-
-    svg->event_stack = NULL; // reset the event stack
+    svg->fold_opacity = 1.0;
+    svg->use_depth = 0;
+    svg->render_serial++;
     
     /* XXX: Currently, the SVG parser doesn't resolve relative URLs
        properly, so I'll just cheese things in by changing the current
@@ -298,6 +365,120 @@ svg_render (svg_t		*svg,
     return status;
 }
 
+svg_status_t
+svg_render (svg_t		*svg,
+	    svg_render_engine_t	*engine,
+	    void		*closure)
+{
+    svg_status_t status;
+
+    if (svg->group_element == NULL)
+	return SVG_STATUS_SUCCESS;
+
+    svg->event_stack = NULL; // reset the event stack
+    _svg_event_index_invalidate (svg);
+    memset (&svg->render_stats, 0, sizeof (svg_render_stats_t));
+
+    status = _svg_render (svg, engine, closure);
+
+    /* whatever was damaged is drawn now */
+    _svg_damage_reset (svg);
+
+    return status;
+}
+
+svg_status_t
+svg_render_damage (svg_t		*svg,
+		   svg_render_engine_t	*engine,
+		   void			*closure)
+{
+    svg_status_t status, return_status = SVG_STATUS_SUCCESS;
+
+    if (engine->clip_damage == NULL)
+	return SVG_STATUS_INVALID_CALL;
+
+    memset (&svg->render_stats, 0, sizeof (svg_render_stats_t));
+    if (svg->group_element == NULL || ! _svg_damage_is_pending (svg))
+	return SVG_STATUS_SUCCESS;
+
+    /* what isn't drawn again keeps its place on the event stack */
+    svg->rendering_damage = 1;
+    for (svg->damage_pass = 0; ; svg->damage_pass++) {
+	status = _svg_render (svg, engine, closure);
+	if (status && ! return_status)
+	    return_status = status;
+	if (svg->damage_all || svg->damage_pass + 1 >= svg->num_damage)
+	    break;
+    }
+    svg->damage_pass = 0;
+    svg->rendering_damage = 0;
+
+    /* boxes drawn again have moved */
+    _svg_event_index_invalidate (svg);
+
+    _svg_damage_reset (svg);
+
+    return return_status;
+}
+
+void
+svg_set_lod (svg_t *svg, svg_lod_t lod, double threshold)
+{
+    if (lod != svg->lod || threshold != svg->lod_threshold)
+	svg->damage_all = 1;
+
+    svg->lod = lod;
+    svg->lod_threshold = lod == SVG_LOD_NONE ? 0.0 : threshold;
+}
+
+void
+svg_set_occlusion_culling (svg_t *svg, int enabled)
+{
+    svg->occlusion_culling = enabled;
+}
+
+void
+svg_set_image_scale (svg_t *svg, double scale)
+{
+    svg->image_scale = scale;
+}
+
+double
+svg_get_image_scale (svg_t *svg)
+{
+    return svg->image_scale;
+}
+
+void
+svg_set_dpi (svg_t *svg, double dpi)
+{
+    if (dpi <= 0.0 || dpi == svg->dpi)
+	return;
+
+    /* extents in absolute units no longer hold */
+    svg->dpi = dpi;
+    _svg_extents_invalidate (svg);
+    svg->damage_all = 1;
+}
+
+double
+svg_get_dpi (svg_t *svg)
+{
+    return svg->dpi;
+}
+
+void
+svg_get_render_stats (svg_t *svg, svg_render_stats_t *stats)
+{
+    *stats = svg->render_stats;
+}
+
+unsigned int
+svg_get_serial (svg_t *svg)
+{
+    return svg->extents_serial;
+}
+
 svg_status_t
 _svg_store_element_by_id (svg_t *svg, svg_element_t *element)
 {
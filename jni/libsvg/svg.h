@@ -238,7 +238,9 @@ typedef struct svg_paint {
 /* XXX: Here's another piece of the API that needs deep consideration. */
 typedef struct svg_render_engine {
     /* hierarchy */
-    svg_status_t (* begin_group) (void *closure, double opacity);
+    /* extents is a conservative bound of the group's content in the
+       current user space, or NULL when it isn't known. */
+    svg_status_t (* begin_group) (void *closure, double opacity, const svg_rect_t *extents);
 	svg_status_t (* begin_element) (void *closure, void *path_cache);
     svg_status_t (* end_element) (void *closure);
     svg_status_t (* end_group) (void *closure, double opacity);
@@ -333,8 +335,33 @@ typedef struct svg_render_engine {
 	
 	/* get bounding box of last drawing, in pixels - returns 0 if bounding box is outside the visible clip, non-0 if inside the visible clip */
 	int (*get_last_bounding_box)(void *closure, svg_bounding_box_t *bbox);
+	/* get bounding box of a rectangle in current user space, in pixels - returns 0 if it is outside the visible clip, non-0 if inside the visible clip.
+	   Optional: when NULL, no element is culled. */
+	int (*get_rect_bounding_box)(void *closure, const svg_rect_t *rect, svg_bounding_box_t *bbox);
+	/* paint rect, in current user space, with color at opacity: how elements below the level of detail are drawn at SVG_LOD_SPLAT.
+	   Optional: when NULL, such elements are rendered as usual. */
+	svg_status_t (*render_splat)(void *closure, const svg_rect_t *rect, const svg_color_t *color, double opacity);
+	/* get the box of the pixels a rectangle in current user space covers completely - returns 0 if there are none, or if that can't be told.
+	   Optional: when NULL, no element is skipped for being hidden behind others. */
+	int (*get_rect_covered_box)(void *closure, const svg_rect_t *rect, svg_bounding_box_t *bbox);
+	/* clear box, in pixels as get_rect_bounding_box gives them, or everything when box is NULL, and draw only inside it until the render ends. box may be empty.
+	   Optional: when NULL, svg_render_damage fails. */
+	svg_status_t (*clip_damage)(void *closure, const svg_bounding_box_t *box);
 } svg_render_engine_t;
 
+/* Counters collected by the last call to svg_render */
+typedef struct svg_render_stats {
+    unsigned int elements_rendered;
+    unsigned int elements_culled;
+    /* below the level of detail, left out or splatted */
+    unsigned int elements_simplified;
+    /* skipped for being painted over by opaque elements, see
+       svg_set_occlusion_culling */
+    unsigned int elements_occluded;
+    /* heap allocations, counted by render engines that keep track */
+    unsigned int allocations;
+} svg_render_stats_t;
+
 svg_status_t
 svg_create (svg_t **svg);
 
@@ -368,6 +395,8 @@ svg_parse_chunk_end   (svg_t *svg);
 void
 svg_element_enable_events(svg_element_t *element);
 
+/* The topmost element getting events whose device bounding box at the
+   last render holds x, y, or NULL */
 svg_element_t *
 svg_event_coords_match(svg_t *svg, int x, int y);
 	
@@ -376,11 +405,103 @@ svg_render (svg_t		*svg,
 	    svg_render_engine_t	*engine,
 	    void		*closure);
 
+/* Incremental rendering: svg_parse_buffer_and_inject and
+   svg_drop_element note the pixels they change, and svg_render_damage
+   draws only those again, over what the last render left on the
+   target. That has to be the same target under the same transform, or
+   svg_damage_all called before. Elements that start getting
+   events in between can be hit once drawn, but only take their place
+   among the others at the next svg_render. */
+svg_status_t
+svg_render_damage (svg_t		*svg,
+		   svg_render_engine_t	*engine,
+		   void			*closure);
+
+/* Has the next svg_render_damage draw everything, for changes the
+   document can't tell of */
+void
+svg_damage_all (svg_t *svg);
+
+/* Level of detail: what becomes of elements, and whole groups, whose
+   extents on the device span no more than a threshold number of pixels
+   either way. SVG_LOD_SPLAT draws them as a box in the color they
+   average out to, where that can be told from the document alone. */
+typedef enum svg_lod {
+    SVG_LOD_NONE,
+    SVG_LOD_SKIP,
+    SVG_LOD_SPLAT
+} svg_lod_t;
+
+void
+svg_set_lod (svg_t *svg, svg_lod_t lod, double threshold);
+
+/* Occlusion culling: before each render, the document is walked from
+   the top down to find the elements whose device extents are painted
+   over in full by rectangles of opaque color drawn after them, which
+   the render then skips. Off by default. */
+void
+svg_set_occlusion_culling (svg_t *svg, int enabled);
+
+/* Images are decoded at the smallest of their levels (down to 1/8 of
+   their natural size) that still has scale times as many pixels as
+   they take on the device. 0 decodes them at their natural size, as
+   do engines that can't tell device sizes. The default is 1. */
+void
+svg_set_image_scale (svg_t *svg, double scale);
+
+double
+svg_get_image_scale (svg_t *svg);
+
+/* How many pixels (user units) an inch is, for lengths in absolute
+   units such as cm or pt. The default is 100. */
+void
+svg_set_dpi (svg_t *svg, double dpi);
+
+double
+svg_get_dpi (svg_t *svg);
+
+/* Starts decoding every image of the parsed document on up to threads
+   threads (0 for one per processor), each at the size it will take
+   when rendered at scale times its user units. The render waits for
+   whatever isn't done yet. Decode errors are left to the render. */
+svg_status_t
+svg_prefetch_images (svg_t *svg, double scale, unsigned int threads);
+
 void
 svg_get_size (svg_t *svg,
 	      svg_length_t *width,
 	      svg_length_t *height);
 
+void
+svg_get_render_stats (svg_t *svg, svg_render_stats_t *stats);
+
+/* Changes whenever the document tree does, so that a renderer can tell
+   when what it cached from the tree has gone stale. */
+unsigned int
+svg_get_serial (svg_t *svg);
+
+/* svg_image_cache */
+
+/* Images decoded for <image> elements are shared, by everything in the
+ * process, through a cache keyed on the file's path and modification
+ * time. Images nobody holds beyond max_bytes are freed, least
+ * recently used first. The cache is thread-safe. */
+typedef struct svg_image_cache_stats {
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int images;
+    size_t bytes;
+    size_t max_bytes;
+} svg_image_cache_stats_t;
+
+#define SVG_IMAGE_CACHE_DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+
+void
+svg_image_cache_set_max_bytes (size_t max_bytes);
+
+void
+svg_image_cache_get_stats (svg_image_cache_stats_t *stats);
+
 /* svg_color */
 
 unsigned int
@@ -402,6 +523,16 @@ svg_element_render (svg_element_t		*element,
 svg_pattern_t *
 svg_element_pattern (svg_element_t *element);
 
+/* svg_pattern */
+
+/* Renders the content of a <pattern> element, with the style it
+   inherits in the document set first. The engine is to have set up
+   the tile, and a state of its own to set that style in. */
+svg_status_t
+svg_pattern_render (svg_element_t		*element,
+		    svg_render_engine_t	*engine,
+		    void			*closure);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,372 @@
+/* svg_damage.c: What edits leave to be drawn again
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* An edit damages the device pixels its elements covered at the last
+   render, which their bounding boxes still hold, and those they are to
+   cover at the next. The former are noted as the edit is made. The
+   latter can only be told once svg_render_damage has the engine in the
+   user space of the root's children, so the elements are flagged and
+   their extents mapped there then.
+
+   The document is drawn again once per box of damage, which the engine
+   clears and clips to, after which elements outside of it are culled
+   as they would be outside any clip. One box at a time keeps the clip
+   a rectangle: cairo lets strokes through the gaps of a clip made of
+   several. Where the damage can't be told, everything is drawn again:
+   edits to what is drawn through <use> or paints, to what a nested
+   viewport or a viewBox holds, and to elements whose extents aren't
+   known. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "svgint.h"
+
+typedef struct svg_damage_walk {
+    svg_t *svg;
+    svg_render_engine_t *engine;
+    void *closure;
+
+    /* flagged elements come across so far */
+    unsigned int num_found;
+} svg_damage_walk_t;
+
+static int
+_svg_damage_is_flagged (svg_element_t *element)
+{
+    return element->damaged_serial == element->doc->damage_serial;
+}
+
+static int
+_svg_damage_boxes_touch (const svg_bounding_box_t *a, const svg_bounding_box_t *b)
+{
+    return a->left <= b->right && b->left <= a->right &&
+	a->top <= b->bottom && b->top <= a->bottom;
+}
+
+static void
+_svg_damage_box_union (svg_bounding_box_t *box, const svg_bounding_box_t *other)
+{
+    if (other->left < box->left)
+	box->left = other->left;
+    if (other->top < box->top)
+	box->top = other->top;
+    if (other->right > box->right)
+	box->right = other->right;
+    if (other->bottom > box->bottom)
+	box->bottom = other->bottom;
+}
+
+/* Boxes that touch are merged, so the damage stays a few boxes apart
+   from each other, and all of them once there are too many */
+static void
+_svg_damage_add_box (svg_t *svg, const svg_bounding_box_t *box)
+{
+    svg_bounding_box_t merged = *box;
+    int i;
+
+    if (svg->damage_all || box->right <= box->left || box->bottom <= box->top)
+	return;
+
+    i = 0;
+    while (i < svg->num_damage) {
+	if (_svg_damage_boxes_touch (&svg->damage[i], &merged)) {
+	    _svg_damage_box_union (&merged, &svg->damage[i]);
+	    svg->damage[i] = svg->damage[--svg->num_damage];
+	    i = 0;
+	} else {
+	    i++;
+	}
+    }
+
+    if (svg->num_damage == SVG_DAMAGE_MAX_BOXES) {
+	for (i = 0; i < svg->num_damage; i++)
+	    _svg_damage_box_union (&merged, &svg->damage[i]);
+	svg->num_damage = 0;
+    }
+
+    svg->damage[svg->num_damage++] = merged;
+}
+
+/* Whether element is drawn where it is in the tree, and there only,
+   by groups without a layout of their own */
+static int
+_svg_damage_is_plain (svg_element_t *element)
+{
+    svg_element_t *e;
+
+    if (element->ref_count)
+	return 0;
+
+    switch (element->type) {
+    case SVG_ELEMENT_TYPE_GROUP:
+    case SVG_ELEMENT_TYPE_USE:
+    case SVG_ELEMENT_TYPE_PATH:
+    case SVG_ELEMENT_TYPE_CIRCLE:
+    case SVG_ELEMENT_TYPE_ELLIPSE:
+    case SVG_ELEMENT_TYPE_LINE:
+    case SVG_ELEMENT_TYPE_RECT:
+    case SVG_ELEMENT_TYPE_TEXT:
+    case SVG_ELEMENT_TYPE_IMAGE:
+	break;
+    default:
+	return 0;
+    }
+
+    for (e = element->parent; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent)
+	if (e->ref_count ||
+	    (e->type != SVG_ELEMENT_TYPE_GROUP && e->type != SVG_ELEMENT_TYPE_SVG_GROUP))
+	    return 0;
+
+    return 1;
+}
+
+/* A group with a layer composites what is in it as a whole, or even
+   without a layer once down to one child, so whatever changes in it
+   changes all of it */
+static svg_element_t *
+_svg_damage_outermost_layer (svg_element_t *element)
+{
+    svg_element_t *e;
+
+    for (e = element->parent; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent)
+	if (e->type == SVG_ELEMENT_TYPE_GROUP && _svg_style_get_opacity (&e->style) != 1.0)
+	    element = e;
+
+    return element;
+}
+
+/* What element and all in it covered at the last render */
+static void
+_svg_damage_add_drawn (svg_t *svg, svg_element_t *element)
+{
+    svg_rect_t extents;
+    int i;
+
+    if (element->ref_count) {
+	svg->damage_all = 1;
+	return;
+    }
+
+    switch (element->type) {
+    case SVG_ELEMENT_TYPE_GROUP:
+	_svg_damage_add_box (svg, &element->bounding_box);
+	for (i = 0; i < element->e.group.num_elements; i++)
+	    _svg_damage_add_drawn (svg, element->e.group.element[i]);
+	break;
+    case SVG_ELEMENT_TYPE_USE:
+	/* what it draws has its bounding box from wherever it was
+	   drawn last */
+	if (_svg_element_get_extents (element, &extents) == SVG_EXTENTS_UNKNOWN)
+	    svg->damage_all = 1;
+	else
+	    _svg_damage_add_box (svg, &element->bounding_box);
+	break;
+    case SVG_ELEMENT_TYPE_PATH:
+    case SVG_ELEMENT_TYPE_CIRCLE:
+    case SVG_ELEMENT_TYPE_ELLIPSE:
+    case SVG_ELEMENT_TYPE_LINE:
+    case SVG_ELEMENT_TYPE_RECT:
+    case SVG_ELEMENT_TYPE_TEXT:
+    case SVG_ELEMENT_TYPE_IMAGE:
+	_svg_damage_add_box (svg, &element->bounding_box);
+	break;
+    default:
+	svg->damage_all = 1;
+	break;
+    }
+}
+
+void
+_svg_damage_drawn (svg_element_t *element)
+{
+    svg_t *svg = element->doc;
+
+    if (_svg_damage_is_flagged (element)) {
+	element->damaged_serial = 0;
+	svg->num_damaged--;
+    }
+
+    if (svg->damage_all)
+	return;
+
+    if (! _svg_damage_is_plain (element))
+	svg->damage_all = 1;
+    else
+	_svg_damage_add_drawn (svg, _svg_damage_outermost_layer (element));
+}
+
+void
+_svg_damage_added (svg_element_t *element)
+{
+    svg_t *svg = element->doc;
+
+    if (svg->damage_all)
+	return;
+
+    if (! _svg_damage_is_plain (element)) {
+	svg->damage_all = 1;
+	return;
+    }
+
+    element = _svg_damage_outermost_layer (element);
+    if (_svg_damage_is_flagged (element))
+	return;
+
+    element->damaged_serial = svg->damage_serial;
+    svg->num_damaged++;
+}
+
+/* Flagged elements below one whose damage is already known */
+static unsigned int
+_svg_damage_count_flagged (svg_element_t *element)
+{
+    unsigned int count = 0;
+    int i;
+
+    if (element->type != SVG_ELEMENT_TYPE_GROUP)
+	return 0;
+
+    for (i = 0; i < element->e.group.num_elements; i++) {
+	if (_svg_damage_is_flagged (element->e.group.element[i]))
+	    count++;
+	count += _svg_damage_count_flagged (element->e.group.element[i]);
+    }
+
+    return count;
+}
+
+/* ctm maps element's parent's user space to the engine's. damaged is
+   1 inside a flagged element. */
+static void
+_svg_damage_walk (svg_damage_walk_t	*walk,
+		  svg_element_t		*element,
+		  const svg_transform_t	*ctm,
+		  int			damaged)
+{
+    svg_t *svg = walk->svg;
+    svg_extents_state_t extents_state;
+    svg_transform_t transform;
+    svg_rect_t extents, rect;
+    svg_bounding_box_t box;
+    int i;
+
+    if (_svg_damage_is_flagged (element)) {
+	walk->num_found++;
+	damaged = 1;
+    } else if (! damaged && walk->num_found == svg->num_damaged) {
+	return;
+    }
+
+    if (_svg_style_get_display (&element->style)) {
+	walk->num_found += _svg_damage_count_flagged (element);
+	return;
+    }
+
+    if (damaged) {
+	extents_state = _svg_element_get_extents (element, &extents);
+	if (extents_state != SVG_EXTENTS_UNKNOWN) {
+	    if (extents_state == SVG_EXTENTS_VALID) {
+		_svg_transform_bound_rect (ctm, &extents, &rect);
+		if (walk->engine->get_rect_bounding_box (walk->closure, &rect, &box))
+		    _svg_damage_add_box (svg, &box);
+	    }
+	    walk->num_found += _svg_damage_count_flagged (element);
+	    return;
+	}
+    }
+
+    /* flagged elements only get this far in groups, and any group
+       can say what it covers through its children */
+    if (element->type != SVG_ELEMENT_TYPE_GROUP ||
+	element->e.group.view_box.aspect_ratio != SVG_PRESERVE_ASPECT_RATIO_UNKNOWN) {
+	if (damaged)
+	    svg->damage_all = 1;
+	return;
+    }
+
+    transform = *ctm;
+    _svg_transform_multiply_into_right (&element->transform, &transform);
+    for (i = 0; i < element->e.group.num_elements && ! svg->damage_all; i++)
+	_svg_damage_walk (walk, element->e.group.element[i], &transform, damaged);
+}
+
+svg_status_t
+_svg_damage_clip (svg_element_t		*group_element,
+		  svg_render_engine_t	*engine,
+		  void			*closure)
+{
+    svg_t *svg = group_element->doc;
+    svg_group_t *group = &group_element->e.group;
+    svg_damage_walk_t walk;
+    svg_transform_t identity;
+    int i;
+
+    /* the boxes are all known after the first pass */
+    if (svg->damage_pass == 0 && svg->num_damaged && ! svg->damage_all) {
+	walk.svg = svg;
+	walk.engine = engine;
+	walk.closure = closure;
+	walk.num_found = 0;
+
+	/* the engine is in the user space of group's children already */
+	_svg_transform_init (&identity);
+	for (i = 0; i < group->num_elements && ! svg->damage_all; i++)
+	    _svg_damage_walk (&walk, group->element[i], &identity, 0);
+
+	/* the rest are somewhere the walk doesn't go */
+	if (walk.num_found != svg->num_damaged)
+	    svg->damage_all = 1;
+    }
+
+    if (svg->damage_all)
+	return (engine->clip_damage) (closure, NULL);
+
+    if (svg->damage_pass >= svg->num_damage) {
+	svg_bounding_box_t none;
+
+	memset (&none, 0, sizeof (svg_bounding_box_t));
+	return (engine->clip_damage) (closure, &none);
+    }
+
+    return (engine->clip_damage) (closure, &svg->damage[svg->damage_pass]);
+}
+
+int
+_svg_damage_is_pending (svg_t *svg)
+{
+    return svg->damage_all || svg->num_damage || svg->num_damaged;
+}
+
+void
+_svg_damage_reset (svg_t *svg)
+{
+    svg->num_damage = 0;
+    svg->damage_all = 0;
+    svg->num_damaged = 0;
+
+    /* unflags every element at once */
+    if (++svg->damage_serial == 0)
+	svg->damage_serial = 1;
+}
+
+void
+svg_damage_all (svg_t *svg)
+{
+    svg->damage_all = 1;
+}
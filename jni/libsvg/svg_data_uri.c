@@ -0,0 +1,198 @@
+/* svg_data_uri.c: Decoding the bytes carried by data: URIs
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* data:[<media type>][;base64],<data> as in RFC 2397. The media type
+   is not looked at, the image decoders going by the bytes themselves.
+
+   Embedded images run to megabytes of base64, so that is decoded four
+   characters at a time for as long as no whitespace or padding gets
+   in the way, one character at a time around those. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "svgint.h"
+
+#define SVG_BASE64_SPACE 0xfe
+#define SVG_BASE64_INVALID 0xff
+
+/* the value of each base64 digit, either alphabet */
+static const unsigned char _svg_base64_value[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xfe, 0xfe, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0x3e, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* Decodes into out, which has room for 3 bytes per 4 characters.
+   Returns the number of bytes, or -1 when it isn't base64. */
+static long
+_svg_base64_decode (const unsigned char *in, size_t length, unsigned char *out)
+{
+    const unsigned char *end = in + length;
+    unsigned char *o = out;
+    uint32_t bits = 0, value;
+    int digits = 0;
+
+    while (in < end) {
+	/* whole quads, as long as there is nothing to skip in them */
+	if (digits == 0) {
+	    while (end - in >= 4) {
+		uint32_t a = _svg_base64_value[in[0]];
+		uint32_t b = _svg_base64_value[in[1]];
+		uint32_t c = _svg_base64_value[in[2]];
+		uint32_t d = _svg_base64_value[in[3]];
+
+		if ((a | b | c | d) & 0xc0)
+		    break;
+
+		value = a << 18 | b << 12 | c << 6 | d;
+		o[0] = value >> 16;
+		o[1] = value >> 8;
+		o[2] = value;
+		in += 4;
+		o += 3;
+	    }
+	    if (in == end)
+		break;
+	}
+
+	if (*in == '=')
+	    break;
+
+	value = _svg_base64_value[*in++];
+	if (value == SVG_BASE64_SPACE)
+	    continue;
+	if (value == SVG_BASE64_INVALID)
+	    return -1;
+
+	bits = bits << 6 | value;
+	if (++digits == 4) {
+	    o[0] = bits >> 16;
+	    o[1] = bits >> 8;
+	    o[2] = bits;
+	    o += 3;
+	    bits = 0;
+	    digits = 0;
+	}
+    }
+
+    /* what's left before the padding */
+    switch (digits) {
+    case 1:
+	return -1;
+    case 2:
+	*o++ = bits >> 4;
+	break;
+    case 3:
+	*o++ = bits >> 10;
+	*o++ = bits >> 2;
+	break;
+    }
+
+    return o - out;
+}
+
+static int
+_svg_data_uri_hex (unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    return -1;
+}
+
+/* %XX escapes, anything else being taken as it is */
+static long
+_svg_data_uri_unescape (const unsigned char *in, size_t length, unsigned char *out)
+{
+    const unsigned char *end = in + length;
+    unsigned char *o = out;
+    int high, low;
+
+    while (in < end) {
+	if (*in == '%' && end - in >= 3 &&
+	    (high = _svg_data_uri_hex (in[1])) >= 0 &&
+	    (low = _svg_data_uri_hex (in[2])) >= 0) {
+	    *o++ = high << 4 | low;
+	    in += 3;
+	} else {
+	    *o++ = *in++;
+	}
+    }
+
+    return o - out;
+}
+
+int
+_svg_data_uri_is (const char *uri)
+{
+    return strncmp (uri, "data:", 5) == 0;
+}
+
+svg_status_t
+_svg_data_uri_decode (const char	*uri,
+		      unsigned char	**data,
+		      size_t		*length)
+{
+    const char *comma;
+    size_t encoded;
+    long decoded;
+    int base64;
+
+    comma = strchr (uri, ',');
+    if (comma == NULL)
+	return SVG_STATUS_PARSE_ERROR;
+
+    base64 = comma - uri >= 7 && strncmp (comma - 7, ";base64", 7) == 0;
+    encoded = strlen (comma + 1);
+
+    *data = malloc (base64 ? encoded / 4 * 3 + 3 : encoded + 1);
+    if (*data == NULL)
+	return SVG_STATUS_NO_MEMORY;
+
+    if (base64)
+	decoded = _svg_base64_decode ((const unsigned char *) comma + 1, encoded, *data);
+    else
+	decoded = _svg_data_uri_unescape ((const unsigned char *) comma + 1, encoded, *data);
+    if (decoded < 0) {
+	free (*data);
+	*data = NULL;
+	return SVG_STATUS_PARSE_ERROR;
+    }
+
+    *length = decoded;
+
+    return SVG_STATUS_SUCCESS;
+}
@@ -20,6 +20,7 @@
    Author: Carl Worth <cworth@isi.edu>
 */
 
+#include <math.h>
 #include <string.h>
 
 #include "svgint.h"
@@ -58,6 +59,10 @@ _svg_element_init (svg_element_t	*element,
     element->ref_count = 0;
     element->do_events = 0;
     element->next_event = NULL;
+    element->extents_serial = 0;
+    element->splat_serial = 0;
+    element->occluded_serial = 0;
+    element->damaged_serial = 0;
     
     status = _svg_transform_init (&element->transform);
     if (status)
@@ -234,6 +239,114 @@ _svg_element_get_viewport(svg_element_t *element, double *x, double *y, double *
 	}
 }
 
+/* Whether a group's opacity can be handed to its only child instead of
+   compositing a layer: the child must paint once, with a color (the
+   engine ignores element opacity for gradients and patterns), and its
+   paint must come from the tree above it rather than from a <use>. */
+static int
+_svg_element_can_fold_opacity (svg_element_t *group)
+{
+    svg_element_t *child, *e;
+    svg_paint_t *fill = NULL, *stroke = NULL;
+    svg_paint_type_t fill_type, stroke_type;
+
+    if (group->type != SVG_ELEMENT_TYPE_GROUP ||
+	group->e.group.num_elements != 1 ||
+	group->e.group.view_box.aspect_ratio != SVG_PRESERVE_ASPECT_RATIO_UNKNOWN)
+	return 0;
+
+    child = group->e.group.element[0];
+    switch (child->type) {
+    case SVG_ELEMENT_TYPE_IMAGE:
+	return child->ref_count == 0;
+    case SVG_ELEMENT_TYPE_PATH:
+    case SVG_ELEMENT_TYPE_CIRCLE:
+    case SVG_ELEMENT_TYPE_ELLIPSE:
+    case SVG_ELEMENT_TYPE_LINE:
+    case SVG_ELEMENT_TYPE_RECT:
+	break;
+    default:
+	return 0;
+    }
+
+    for (e = child; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent) {
+	if (e->ref_count ||
+	    e->type == SVG_ELEMENT_TYPE_DEFS ||
+	    e->type == SVG_ELEMENT_TYPE_SYMBOL ||
+	    e->type == SVG_ELEMENT_TYPE_PATTERN)
+	    return 0;
+	if (fill == NULL && (e->style.flags & SVG_STYLE_FLAG_FILL_PAINT))
+	    fill = &e->style.fill_paint;
+	if (stroke == NULL && (e->style.flags & SVG_STYLE_FLAG_STROKE_PAINT))
+	    stroke = &e->style.stroke_paint;
+    }
+
+    fill_type = fill ? fill->type : SVG_PAINT_TYPE_COLOR;
+    stroke_type = stroke ? stroke->type : SVG_PAINT_TYPE_NONE;
+
+    if (fill_type == SVG_PAINT_TYPE_NONE)
+	return stroke_type != SVG_PAINT_TYPE_GRADIENT && stroke_type != SVG_PAINT_TYPE_PATTERN;
+    if (stroke_type == SVG_PAINT_TYPE_NONE)
+	return fill_type == SVG_PAINT_TYPE_COLOR;
+
+    /* stroke over fill would show through */
+    return 0;
+}
+
+/* Whether the element spans no more than the LOD threshold on the
+   device. Content drawn by reference from <defs> is left alone, as
+   the copies in a pattern add up to something that can be made
+   out however small the tile is. */
+static int
+_svg_element_is_below_lod (svg_element_t *element)
+{
+    svg_t *doc = element->doc;
+    svg_element_t *e;
+
+    if (doc->lod == SVG_LOD_NONE ||
+	element->bounding_box.right - element->bounding_box.left > doc->lod_threshold ||
+	element->bounding_box.bottom - element->bounding_box.top > doc->lod_threshold)
+	return 0;
+
+    for (e = element->parent; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent) {
+	if (e->type == SVG_ELEMENT_TYPE_DEFS ||
+	    e->type == SVG_ELEMENT_TYPE_SYMBOL ||
+	    e->type == SVG_ELEMENT_TYPE_PATTERN)
+	    return 0;
+    }
+
+    return 1;
+}
+
+static unsigned int
+_svg_element_splat_channel (double value, double alpha)
+{
+    value = value / alpha * 255.0 + 0.5;
+
+    return value < 0.0 ? 0 : value > 255.0 ? 255 : (unsigned int) value;
+}
+
+static svg_status_t
+_svg_element_render_splat (svg_rect_t		*extents,
+			   svg_splat_t		*splat,
+			   double		opacity,
+			   svg_render_engine_t	*engine,
+			   void			*closure)
+{
+    svg_color_t color;
+
+    opacity *= splat->alpha;
+    if (opacity <= 0.0)
+	return SVG_STATUS_SUCCESS;
+
+    color.is_current_color = 0;
+    color.rgb = (_svg_element_splat_channel (splat->red, splat->alpha) << 16) |
+		(_svg_element_splat_channel (splat->green, splat->alpha) << 8) |
+		_svg_element_splat_channel (splat->blue, splat->alpha);
+
+    return (engine->render_splat) (closure, extents, &color, opacity);
+}
+
 svg_status_t
 svg_element_render (svg_element_t		*element,
 		    svg_render_engine_t		*engine,
@@ -241,6 +354,15 @@ svg_element_render (svg_element_t		*element,
 {
 	svg_status_t status, fail_status = SVG_STATUS_SUCCESS, return_status = SVG_STATUS_SUCCESS;
     svg_transform_t transform = element->transform;
+    svg_extents_state_t extents_state = SVG_EXTENTS_UNKNOWN;
+    svg_rect_t extents;
+    svg_splat_t splat;
+    double opacity = 1.0, fold_opacity;
+
+    /* take the opacity a layerless parent group left for us, whatever
+       happens to this element below */
+    fold_opacity = element->doc->fold_opacity;
+    element->doc->fold_opacity = 1.0;
 
     /*
      * if this element's parent is SVG_DELETED_ELEMENT 
@@ -259,8 +381,44 @@ svg_element_render (svg_element_t		*element,
     if (status)
 	return status;
 
+    if (element->occluded_serial == element->doc->render_serial) {
+	element->doc->render_stats.elements_occluded++;
+	return SVG_STATUS_SUCCESS;
+    }
+
+    /* skip elements, and whole groups, that can't touch the visible
+       clip. The extents are in our parent's user space, which is
+       what the engine's current transform is at this point. What a
+       <use> draws inherits its style from the <use> rather than from
+       where it sits in the document, so its extents don't hold there:
+       the <use> itself is culled on its own extents instead. The same
+       goes for the content of patterns, see svg_pattern_render. */
+    if (engine->get_rect_bounding_box && element->doc->use_depth == 0) {
+	extents_state = _svg_element_get_extents (element, &extents);
+	if (extents_state == SVG_EXTENTS_EMPTY ||
+	    (extents_state == SVG_EXTENTS_VALID &&
+	     ! engine->get_rect_bounding_box (closure, &extents, &element->bounding_box))) {
+	    element->doc->render_stats.elements_culled++;
+	    return SVG_STATUS_SUCCESS;
+	}
+
+	/* and, if asked to, simplify those too small to make out */
+	if (extents_state == SVG_EXTENTS_VALID && _svg_element_is_below_lod (element)) {
+	    if (element->doc->lod == SVG_LOD_SKIP) {
+		element->doc->render_stats.elements_simplified++;
+		return SVG_STATUS_SUCCESS;
+	    }
+	    if (engine->render_splat && _svg_element_get_splat (element, &splat)) {
+		element->doc->render_stats.elements_simplified++;
+		return _svg_element_render_splat (&extents, &splat, fold_opacity,
+						  engine, closure);
+	    }
+	}
+    }
+    element->doc->render_stats.elements_rendered++;
+
     /* event handling */
-    if(element->do_events) {
+    if(element->do_events && ! element->doc->rendering_damage) {
 	    element->next_event = element->doc->event_stack;
 	    element->doc->event_stack = element;
     }
@@ -268,9 +426,20 @@ svg_element_render (svg_element_t		*element,
     if (element->type == SVG_ELEMENT_TYPE_SVG_GROUP
 	|| element->type == SVG_ELEMENT_TYPE_GROUP) {
 
-	status = (engine->begin_group) (closure, _svg_style_get_opacity(&element->style));
-	if (status)
+	/* a group whose only child paints once needs no layer: the
+	   child's paint alpha can carry the group opacity instead */
+	opacity = _svg_style_get_opacity (&element->style);
+	if (opacity != 1.0 && _svg_element_can_fold_opacity (element)) {
+	    element->doc->fold_opacity = opacity;
+	    opacity = 1.0;
+	}
+
+	status = (engine->begin_group) (closure, opacity,
+					extents_state == SVG_EXTENTS_VALID ? &extents : NULL);
+	if (status) {
+	    element->doc->fold_opacity = 1.0;
 	    return status;
+	}
 
 	/* if element->type == SVG_ELEMENT_TYPE_SVG_GROUP and
 	 * the overflow attribute is set to hide or scroll
@@ -338,6 +507,14 @@ svg_element_render (svg_element_t		*element,
 	    goto fail;
     }
 
+    if (fold_opacity != 1.0) {
+	status = (engine->set_opacity) (closure, fold_opacity * _svg_style_get_opacity (&element->style));
+	if (status) {
+		fail_status = status;
+		goto fail;
+	}
+    }
+
     /* If the element doesnt have children, we can check visibility property, otherwise
        the children will have to be processed. */
     if (element->type != SVG_ELEMENT_TYPE_SVG_GROUP &&
@@ -345,12 +522,27 @@ svg_element_render (svg_element_t		*element,
 	element->type != SVG_ELEMENT_TYPE_USE)
 	status = _svg_style_get_visibility (&element->style);
 
+    /* with the engine in the user space of the root's children, have
+       it draw only the damage if that is all there is to draw, and
+       find which of them, or of what's in them, end up painted over */
+    if (status == SVG_STATUS_SUCCESS && element == element->doc->group_element) {
+	if (element->doc->rendering_damage)
+	    status = _svg_damage_clip (element, engine, closure);
+	if (status == SVG_STATUS_SUCCESS && element->doc->occlusion_culling &&
+	    engine->get_rect_bounding_box && engine->get_rect_covered_box)
+	    _svg_occlusion_mark (element, engine, closure);
+    }
+
     if (status == SVG_STATUS_SUCCESS) {
 	switch (element->type) {
 	case SVG_ELEMENT_TYPE_SVG_GROUP:
 	case SVG_ELEMENT_TYPE_GROUP:
+	    status = _svg_group_render (&element->e.group, engine, closure);
+	    break;
 	case SVG_ELEMENT_TYPE_USE:
+	    element->doc->use_depth++;
 	    status = _svg_group_render (&element->e.group, engine, closure);
+	    element->doc->use_depth--;
 	    break;
 	case SVG_ELEMENT_TYPE_PATH:
 		status = _svg_path_render (&element->e.path, engine, closure, element->doc->do_path_cache);
@@ -371,7 +563,15 @@ svg_element_render (svg_element_t		*element,
 	    status = _svg_text_render (&element->e.text, engine, closure);
 	    break;
 	case SVG_ELEMENT_TYPE_IMAGE:
-	    status = _svg_image_render (&element->e.image, engine, closure);
+	    if (extents_state == SVG_EXTENTS_VALID && element->doc->image_scale > 0)
+		status = _svg_image_render (&element->e.image,
+					    ceil ((element->bounding_box.right - element->bounding_box.left) *
+						  element->doc->image_scale),
+					    ceil ((element->bounding_box.bottom - element->bounding_box.top) *
+						  element->doc->image_scale),
+					    engine, closure);
+	    else
+		status = _svg_image_render (&element->e.image, 0, 0, engine, closure);
 	    break;
 	case SVG_ELEMENT_TYPE_DEFS:
 	    break;
@@ -390,14 +590,18 @@ svg_element_render (svg_element_t		*element,
     if (status)
 	    fail_status = status;
 
-    
-    (void) engine->get_last_bounding_box(closure, &(element->bounding_box));
+
+    if (extents_state != SVG_EXTENTS_VALID && engine->get_last_bounding_box)
+	(void) engine->get_last_bounding_box(closure, &(element->bounding_box));
 
 fail:
     if (element->type == SVG_ELEMENT_TYPE_SVG_GROUP
 	|| element->type == SVG_ELEMENT_TYPE_GROUP) {
-	
-	status = (engine->end_group) (closure, _svg_style_get_opacity(&element->style));
+
+	/* in case the child never got to take it */
+	element->doc->fold_opacity = 1.0;
+
+	status = (engine->end_group) (closure, opacity);
 	if (status && !return_status)
 	    return_status = status;
     } else {
@@ -632,7 +836,9 @@ _svg_element_apply_attributes (svg_element_t	*element,
 void _svg_element_set_display(svg_element_t *element, const char *value) {
 	if(element == NULL) return;
 
+	_svg_damage_drawn (element);
 	_svg_style_parse_display(&(element->style), value);
+	_svg_damage_added (element);
 }
 
 svg_pattern_t *
@@ -654,6 +860,10 @@ svg_status_t _svg_element_init_copy (
 	
 	element->type   = other->type;
 	element->parent = NULL;
+	element->extents_serial = 0;
+	element->splat_serial = 0;
+	element->occluded_serial = 0;
+	element->damaged_serial = 0;
 	if(new_id) {
 		element->id = strdup(new_id);
 	} else {
@@ -766,6 +976,8 @@ svg_status_t _svg_inject_clone(const char *new_id, svg_element_t *group, svg_ele
 
 		clone->parent = group;
 		_svg_group_add_element(&(group->e.group), clone);
+		_svg_damage_added (clone);
+		_svg_extents_invalidate (group->doc);
 		
 		return SVG_STATUS_SUCCESS;
 	}
@@ -0,0 +1,335 @@
+/* svg_event.c: Finding the element an event lands on
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* The elements on the event stack are spread over a uniform grid of
+   device cells by their bounding boxes, each cell listing those that
+   reach into it in the order of the stack, topmost first. A point is
+   then only tested against the elements of the cell it is in.
+
+   The grid is laid out over the boxes on the stack the first time a
+   point is looked up after a render, as that is what moves them.
+   Elements starting to get events go on top of the cells they reach,
+   and dropped ones come out of theirs, without the rest being laid
+   out again. Without memory for the grid, the stack is gone through
+   from the top as it is. */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "svgint.h"
+
+/* cells are at least this many pixels across, and no more are made
+   than this, however many elements there are */
+#define SVG_EVENT_MIN_CELL_SIZE 16
+#define SVG_EVENT_MAX_CELLS (64 * 1024)
+
+/* an event at x, y hits element only strictly inside its box */
+static int
+_svg_event_hits (svg_element_t *element, int x, int y)
+{
+    return x > (int) element->bounding_box.left &&
+	x < (int) element->bounding_box.right &&
+	y > (int) element->bounding_box.top &&
+	y < (int) element->bounding_box.bottom;
+}
+
+/* Whether any pixel can hit element, and the cells those are in */
+static int
+_svg_event_index_get_cells (svg_event_index_t	*index,
+			    svg_element_t	*element,
+			    int *col0, int *row0, int *col1, int *row1)
+{
+    const svg_bounding_box_t *box = &element->bounding_box;
+    int left = box->left + 1, top = box->top + 1;
+    int right = (int) box->right - 1, bottom = (int) box->bottom - 1;
+
+    if (right < left || bottom < top)
+	return 0;
+
+    left -= index->x;
+    top -= index->y;
+    right -= index->x;
+    bottom -= index->y;
+
+    if (right < 0 || bottom < 0 ||
+	left >= index->cols * index->cell_size ||
+	top >= index->rows * index->cell_size)
+	return 0;
+
+    *col0 = left < 0 ? 0 : left / index->cell_size;
+    *row0 = top < 0 ? 0 : top / index->cell_size;
+    *col1 = right / index->cell_size;
+    *row1 = bottom / index->cell_size;
+    if (*col1 >= index->cols)
+	*col1 = index->cols - 1;
+    if (*row1 >= index->rows)
+	*row1 = index->rows - 1;
+
+    return 1;
+}
+
+static svg_status_t
+_svg_event_cell_grow (svg_event_cell_t *cell)
+{
+    svg_element_t **new_element;
+    int new_size = cell->element_size ? cell->element_size * 2 : 4;
+
+    new_element = realloc (cell->element, new_size * sizeof (svg_element_t *));
+    if (new_element == NULL)
+	return SVG_STATUS_NO_MEMORY;
+
+    cell->element = new_element;
+    cell->element_size = new_size;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+/* Puts element in every cell it reaches, below what is there already
+   if at_bottom, else on top */
+static svg_status_t
+_svg_event_index_add (svg_event_index_t *index, svg_element_t *element, int at_bottom)
+{
+    svg_event_cell_t *cell;
+    svg_status_t status;
+    int col0, row0, col1, row1;
+    int col, row, k;
+
+    if (! _svg_event_index_get_cells (index, element, &col0, &row0, &col1, &row1))
+	return SVG_STATUS_SUCCESS;
+
+    for (row = row0; row <= row1; row++) {
+	for (col = col0; col <= col1; col++) {
+	    cell = &index->cells[row * index->cols + col];
+	    if (cell->num_elements >= cell->element_size) {
+		status = _svg_event_cell_grow (cell);
+		if (status)
+		    return status;
+	    }
+	    if (at_bottom) {
+		cell->element[cell->num_elements] = element;
+	    } else {
+		for (k = cell->num_elements; k > 0; k--)
+		    cell->element[k] = cell->element[k - 1];
+		cell->element[0] = element;
+	    }
+	    cell->num_elements++;
+	}
+    }
+
+    return SVG_STATUS_SUCCESS;
+}
+
+static void
+_svg_event_index_free_cells (svg_event_index_t *index)
+{
+    int i;
+
+    for (i = 0; i < index->cols * index->rows; i++)
+	free (index->cells[i].element);
+    free (index->cells);
+
+    index->cells = NULL;
+    index->cols = 0;
+    index->rows = 0;
+}
+
+/* Lays the grid out over the boxes of the elements on the stack */
+static svg_status_t
+_svg_event_index_build (svg_t *svg)
+{
+    svg_event_index_t *index = &svg->event_index;
+    svg_element_t *e;
+    unsigned int num_elements = 0;
+    int left = 0, top = 0, right = -1, bottom = -1;
+    double cell_size;
+    int width, height;
+    svg_status_t status;
+
+    _svg_event_index_free_cells (index);
+
+    for (e = svg->event_stack; e != NULL; e = e->next_event) {
+	int l = e->bounding_box.left + 1, t = e->bounding_box.top + 1;
+	int r = (int) e->bounding_box.right - 1, b = (int) e->bounding_box.bottom - 1;
+
+	if (r < l || b < t)
+	    continue;
+	if (num_elements == 0 || l < left)
+	    left = l;
+	if (num_elements == 0 || t < top)
+	    top = t;
+	if (r > right)
+	    right = r;
+	if (b > bottom)
+	    bottom = b;
+	num_elements++;
+    }
+
+    index->x = left;
+    index->y = top;
+    index->valid = 1;
+    if (num_elements == 0)
+	return SVG_STATUS_SUCCESS;
+
+    /* about as many cells as elements */
+    width = right - left + 1;
+    height = bottom - top + 1;
+    cell_size = ceil (sqrt ((double) width * height / num_elements));
+    if (cell_size < SVG_EVENT_MIN_CELL_SIZE)
+	cell_size = SVG_EVENT_MIN_CELL_SIZE;
+    while (ceil (width / cell_size) * ceil (height / cell_size) > SVG_EVENT_MAX_CELLS)
+	cell_size *= 2;
+
+    index->cell_size = cell_size;
+    index->cols = (width + index->cell_size - 1) / index->cell_size;
+    index->rows = (height + index->cell_size - 1) / index->cell_size;
+    index->cells = calloc (index->cols * index->rows, sizeof (svg_event_cell_t));
+    if (index->cells == NULL) {
+	index->cols = 0;
+	index->rows = 0;
+	index->valid = 0;
+	return SVG_STATUS_NO_MEMORY;
+    }
+
+    for (e = svg->event_stack; e != NULL; e = e->next_event) {
+	status = _svg_event_index_add (index, e, 1);
+	if (status) {
+	    _svg_event_index_free_cells (index);
+	    index->valid = 0;
+	    return status;
+	}
+    }
+
+    return SVG_STATUS_SUCCESS;
+}
+
+void
+_svg_event_index_init (svg_event_index_t *index)
+{
+    index->valid = 0;
+    index->x = 0;
+    index->y = 0;
+    index->cell_size = SVG_EVENT_MIN_CELL_SIZE;
+    index->cols = 0;
+    index->rows = 0;
+    index->cells = NULL;
+}
+
+void
+_svg_event_index_fini (svg_event_index_t *index)
+{
+    _svg_event_index_free_cells (index);
+    index->valid = 0;
+}
+
+void
+_svg_event_index_invalidate (svg_t *svg)
+{
+    svg->event_index.valid = 0;
+}
+
+/* Whether the grid reaches as far as element's box */
+static int
+_svg_event_index_covers (svg_event_index_t *index, svg_element_t *element)
+{
+    const svg_bounding_box_t *box = &element->bounding_box;
+
+    if (box->right <= box->left + 1 || box->bottom <= box->top + 1)
+	return 1;
+
+    return (int) box->left + 1 >= index->x &&
+	(int) box->top + 1 >= index->y &&
+	(int) box->right - 1 < index->x + index->cols * index->cell_size &&
+	(int) box->bottom - 1 < index->y + index->rows * index->cell_size;
+}
+
+void
+_svg_event_index_push (svg_t *svg, svg_element_t *element)
+{
+    svg_event_index_t *index = &svg->event_index;
+
+    if (! index->valid)
+	return;
+
+    /* beyond the grid it is laid out afresh */
+    if (! _svg_event_index_covers (index, element) ||
+	_svg_event_index_add (index, element, 0))
+	index->valid = 0;
+}
+
+void
+_svg_event_index_remove (svg_t *svg, svg_element_t *element)
+{
+    svg_event_index_t *index = &svg->event_index;
+    svg_event_cell_t *cell;
+    int col0, row0, col1, row1;
+    int col, row, k;
+
+    if (! index->valid)
+	return;
+
+    /* the box hasn't moved since it was indexed, only a render moves it */
+    if (! _svg_event_index_get_cells (index, element, &col0, &row0, &col1, &row1))
+	return;
+
+    for (row = row0; row <= row1; row++) {
+	for (col = col0; col <= col1; col++) {
+	    cell = &index->cells[row * index->cols + col];
+	    for (k = 0; k < cell->num_elements; k++) {
+		if (cell->element[k] == element) {
+		    cell->num_elements--;
+		    for (; k < cell->num_elements; k++)
+			cell->element[k] = cell->element[k + 1];
+		    break;
+		}
+	    }
+	}
+    }
+}
+
+svg_element_t *
+_svg_event_index_find (svg_t *svg, int x, int y)
+{
+    svg_event_index_t *index = &svg->event_index;
+    svg_event_cell_t *cell;
+    svg_element_t *e;
+    int col, row, k;
+
+    if (! index->valid)
+	_svg_event_index_build (svg);
+
+    if (! index->valid) {
+	for (e = svg->event_stack; e != NULL; e = e->next_event)
+	    if (_svg_event_hits (e, x, y))
+		return e;
+	return NULL;
+    }
+
+    if (x < index->x || y < index->y)
+	return NULL;
+    col = (x - index->x) / index->cell_size;
+    row = (y - index->y) / index->cell_size;
+    if (col >= index->cols || row >= index->rows)
+	return NULL;
+
+    cell = &index->cells[row * index->cols + col];
+    for (k = 0; k < cell->num_elements; k++)
+	if (_svg_event_hits (cell->element[k], x, y))
+	    return cell->element[k];
+
+    return NULL;
+}
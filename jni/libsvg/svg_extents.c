@@ -0,0 +1,776 @@
+/* svg_extents.c: User-space extents of SVG elements
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* The extents computed here are conservative: they may be larger
+   than what actually gets drawn, but never smaller. Anything that
+   can't be resolved without the render engine (percentages, em/ex
+   units, nested viewports) is reported as SVG_EXTENTS_UNKNOWN, and
+   such elements are simply never culled.
+
+   The average colors at the end are what level-of-detail rendering
+   draws in place of elements too small to make out. */
+
+#include <math.h>
+#include <string.h>
+
+#include "svgint.h"
+
+typedef struct svg_extents_box {
+    double x1, y1, x2, y2;
+    int empty;
+
+    /* needed to bound arcs */
+    svg_pt_t current_pt;
+    svg_pt_t last_move_pt;
+} svg_extents_box_t;
+
+static void
+_svg_extents_box_init (svg_extents_box_t *box)
+{
+    box->x1 = box->y1 = box->x2 = box->y2 = 0;
+    box->empty = 1;
+    box->current_pt.x = box->current_pt.y = 0;
+    box->last_move_pt = box->current_pt;
+}
+
+static void
+_svg_extents_box_add_point (svg_extents_box_t *box, double x, double y)
+{
+    if (box->empty) {
+	box->x1 = box->x2 = x;
+	box->y1 = box->y2 = y;
+	box->empty = 0;
+	return;
+    }
+
+    if (x < box->x1)
+	box->x1 = x;
+    if (x > box->x2)
+	box->x2 = x;
+    if (y < box->y1)
+	box->y1 = y;
+    if (y > box->y2)
+	box->y2 = y;
+}
+
+static void
+_svg_extents_box_add_rect (svg_extents_box_t *box, const svg_rect_t *rect)
+{
+    _svg_extents_box_add_point (box, rect->x, rect->y);
+    _svg_extents_box_add_point (box, rect->x + rect->width, rect->y + rect->height);
+}
+
+static void
+_svg_extents_box_grow (svg_extents_box_t *box, double dx, double dy)
+{
+    if (box->empty)
+	return;
+
+    box->x1 -= dx;
+    box->y1 -= dy;
+    box->x2 += dx;
+    box->y2 += dy;
+}
+
+/* Path walking, see _svg_path_init_copy for the same trick */
+
+static svg_status_t
+_svg_extents_move_to (void *closure, double x, double y)
+{
+    svg_extents_box_t *box = closure;
+
+    _svg_extents_box_add_point (box, x, y);
+    box->current_pt.x = x;
+    box->current_pt.y = y;
+    box->last_move_pt = box->current_pt;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+static svg_status_t
+_svg_extents_line_to (void *closure, double x, double y)
+{
+    svg_extents_box_t *box = closure;
+
+    _svg_extents_box_add_point (box, x, y);
+    box->current_pt.x = x;
+    box->current_pt.y = y;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+/* Bezier curves are contained in the hull of their control points */
+static svg_status_t
+_svg_extents_curve_to (void *closure,
+		       double x1, double y1,
+		       double x2, double y2,
+		       double x3, double y3)
+{
+    svg_extents_box_t *box = closure;
+
+    _svg_extents_box_add_point (box, x1, y1);
+    _svg_extents_box_add_point (box, x2, y2);
+
+    return _svg_extents_line_to (closure, x3, y3);
+}
+
+static svg_status_t
+_svg_extents_quadratic_curve_to (void *closure,
+				 double x1, double y1,
+				 double x2, double y2)
+{
+    svg_extents_box_t *box = closure;
+
+    _svg_extents_box_add_point (box, x1, y1);
+
+    return _svg_extents_line_to (closure, x2, y2);
+}
+
+/* The arc lies on an ellipse through both end points, with the radii
+   scaled up as the engine does when they are too small to span the
+   chord. Its center is one of two points mirrored about the middle of
+   the chord, so the arc is within the box of the ellipse around
+   either. A little is added for the curves drawn in its place. */
+static svg_status_t
+_svg_extents_arc_to (void	*closure,
+		     double	rx,
+		     double	ry,
+		     double	x_axis_rotation,
+		     int	large_arc_flag,
+		     int	sweep_flag,
+		     double	x,
+		     double	y)
+{
+    svg_extents_box_t *box = closure;
+    double sin_th, cos_th, dx1, dy1, lambda, d, coef;
+    double mx, my, ox, oy, cx, cy, hx, hy;
+
+    rx = fabs (rx);
+    ry = fabs (ry);
+    if (rx == 0 || ry == 0 ||
+	(x == box->current_pt.x && y == box->current_pt.y))
+	return _svg_extents_line_to (closure, x, y);
+
+    sin_th = sin (x_axis_rotation * (M_PI / 180.0));
+    cos_th = cos (x_axis_rotation * (M_PI / 180.0));
+
+    /* half the chord, in the axes of the ellipse */
+    dx1 =  cos_th * (box->current_pt.x - x) / 2.0 + sin_th * (box->current_pt.y - y) / 2.0;
+    dy1 = -sin_th * (box->current_pt.x - x) / 2.0 + cos_th * (box->current_pt.y - y) / 2.0;
+
+    lambda = (dx1 * dx1) / (rx * rx) + (dy1 * dy1) / (ry * ry);
+    if (lambda > 1) {
+	rx *= sqrt (lambda);
+	ry *= sqrt (lambda);
+	coef = 0;
+    } else {
+	d = rx * rx * dy1 * dy1 + ry * ry * dx1 * dx1;
+	coef = sqrt ((rx * rx * ry * ry - d) / d);
+    }
+
+    /* the centers' offset from the middle of the chord */
+    ox = coef * rx * dy1 / ry;
+    oy = -coef * ry * dx1 / rx;
+    cx = fabs (cos_th * ox - sin_th * oy);
+    cy = fabs (sin_th * ox + cos_th * oy);
+
+    hx = sqrt (rx * rx * cos_th * cos_th + ry * ry * sin_th * sin_th) * 1.001;
+    hy = sqrt (rx * rx * sin_th * sin_th + ry * ry * cos_th * cos_th) * 1.001;
+
+    mx = (box->current_pt.x + x) / 2.0;
+    my = (box->current_pt.y + y) / 2.0;
+    _svg_extents_box_add_point (box, mx - cx - hx, my - cy - hy);
+    _svg_extents_box_add_point (box, mx + cx + hx, my + cy + hy);
+
+    return _svg_extents_line_to (closure, x, y);
+}
+
+static svg_status_t
+_svg_extents_close_path (void *closure)
+{
+    svg_extents_box_t *box = closure;
+
+    box->current_pt = box->last_move_pt;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+static svg_status_t
+_svg_extents_render_path (void *closure, void **path_cache)
+{
+    return SVG_STATUS_SUCCESS;
+}
+
+static svg_render_engine_t svg_extents_engine = {
+    NULL, NULL, NULL, NULL,
+    _svg_extents_move_to,
+    _svg_extents_line_to,
+    _svg_extents_curve_to,
+    _svg_extents_quadratic_curve_to,
+    _svg_extents_arc_to,
+    _svg_extents_close_path,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    _svg_extents_render_path,
+    NULL, NULL, NULL, NULL, NULL
+};
+
+void
+_svg_extents_invalidate (svg_t *svg)
+{
+    svg->extents_serial++;
+}
+
+/* Returns 0 for lengths that depend on the render state */
+int
+_svg_extents_length (svg_t *svg, svg_length_t *length, double *value)
+{
+    switch (length->unit) {
+    case SVG_LENGTH_UNIT_PX:
+	*value = length->value;
+	return 1;
+    case SVG_LENGTH_UNIT_CM:
+	*value = (length->value / 2.54) * svg->dpi;
+	return 1;
+    case SVG_LENGTH_UNIT_MM:
+	*value = (length->value / 25.4) * svg->dpi;
+	return 1;
+    case SVG_LENGTH_UNIT_IN:
+	*value = length->value * svg->dpi;
+	return 1;
+    case SVG_LENGTH_UNIT_PT:
+	*value = (length->value / 72.0) * svg->dpi;
+	return 1;
+    case SVG_LENGTH_UNIT_PC:
+	*value = (length->value / 6.0) * svg->dpi;
+	return 1;
+    case SVG_LENGTH_UNIT_EM:
+    case SVG_LENGTH_UNIT_EX:
+    case SVG_LENGTH_UNIT_PCT:
+    default:
+	return 0;
+    }
+}
+
+/* Half the area a stroke may cover beyond the geometry, using the
+   stroke properties the element inherits in the document tree. Paint
+   is ignored on purpose: <use> may supply a stroke paint that the
+   static tree doesn't know about. What is drawn through a <use>
+   inherits from it instead, and isn't culled on these extents. */
+static int
+_svg_extents_stroke_pad (svg_element_t *element, double *pad)
+{
+    svg_element_t *e;
+    svg_length_t *width = NULL;
+    svg_stroke_line_join_t join = SVG_STROKE_LINE_JOIN_MITER;
+    double miter_limit = 4.0, w, scale;
+    int have_join = 0, have_limit = 0;
+
+    for (e = element; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent) {
+	if (width == NULL && (e->style.flags & SVG_STYLE_FLAG_STROKE_WIDTH))
+	    width = &e->style.stroke_width;
+	if (! have_join && (e->style.flags & SVG_STYLE_FLAG_STROKE_LINE_JOIN)) {
+	    join = e->style.stroke_line_join;
+	    have_join = 1;
+	}
+	if (! have_limit && (e->style.flags & SVG_STYLE_FLAG_STROKE_MITER_LIMIT)) {
+	    miter_limit = e->style.stroke_miter_limit;
+	    have_limit = 1;
+	}
+    }
+
+    w = 1.0;
+    if (width && ! _svg_extents_length (element->doc, width, &w))
+	return 0;
+
+    /* square caps reach sqrt(2) * w / 2 out, miters up to limit * w / 2 */
+    scale = M_SQRT2;
+    if (join == SVG_STROKE_LINE_JOIN_MITER && miter_limit > scale)
+	scale = miter_limit;
+
+    *pad = fabs (w) / 2.0 * scale;
+
+    return 1;
+}
+
+/* Same lookup the engine does for the inherited font size. Returns 0
+   for sizes relative to the parent's font or the viewport. The engine
+   is handed the bare number of the others, so take whichever of that
+   and the size in user units is larger. */
+static int
+_svg_extents_font_size (svg_element_t *element, double *size)
+{
+    svg_element_t *e;
+    svg_length_t *font_size = NULL;
+    double converted;
+
+    for (e = element; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent)
+	if (e->style.flags & SVG_STYLE_FLAG_FONT_SIZE) {
+	    font_size = &e->style.font_size;
+	    break;
+	}
+
+    if (font_size == NULL) {
+	*size = 10.0;
+	return 1;
+    }
+
+    if (! _svg_extents_length (element->doc, font_size, &converted))
+	return 0;
+
+    *size = fabs (font_size->value) > fabs (converted) ? fabs (font_size->value) : fabs (converted);
+
+    return 1;
+}
+
+static svg_extents_state_t
+_svg_element_get_local_extents (svg_element_t *element, svg_extents_box_t *box)
+{
+    svg_t *svg = element->doc;
+    double x, y, w, h, pad;
+    svg_rect_t child;
+    int i;
+
+    switch (element->type) {
+    case SVG_ELEMENT_TYPE_GROUP:
+	if (element->e.group.view_box.aspect_ratio != SVG_PRESERVE_ASPECT_RATIO_UNKNOWN)
+	    return SVG_EXTENTS_UNKNOWN;
+	/* fall-through */
+    case SVG_ELEMENT_TYPE_USE:
+	for (i = 0; i < element->e.group.num_elements; i++) {
+	    switch (_svg_element_get_extents (element->e.group.element[i], &child)) {
+	    case SVG_EXTENTS_UNKNOWN:
+		return SVG_EXTENTS_UNKNOWN;
+	    case SVG_EXTENTS_EMPTY:
+		break;
+	    case SVG_EXTENTS_VALID:
+		_svg_extents_box_add_rect (box, &child);
+		break;
+	    }
+	}
+	/* referenced content inherits its stroke from the <use> at
+	   render time, so pad for that too */
+	if (element->type == SVG_ELEMENT_TYPE_USE) {
+	    if (! _svg_extents_stroke_pad (element, &pad))
+		return SVG_EXTENTS_UNKNOWN;
+	    _svg_extents_box_grow (box, pad, pad);
+	}
+	return box->empty ? SVG_EXTENTS_EMPTY : SVG_EXTENTS_VALID;
+
+    case SVG_ELEMENT_TYPE_PATH:
+	_svg_path_render (&element->e.path, &svg_extents_engine, box, 0);
+	break;
+
+    case SVG_ELEMENT_TYPE_CIRCLE:
+    case SVG_ELEMENT_TYPE_ELLIPSE:
+	if (element->e.ellipse.rx.value == 0 ||
+	    (element->type == SVG_ELEMENT_TYPE_ELLIPSE && element->e.ellipse.ry.value == 0))
+	    return SVG_EXTENTS_EMPTY;
+	if (! _svg_extents_length (svg, &element->e.ellipse.cx, &x) ||
+	    ! _svg_extents_length (svg, &element->e.ellipse.cy, &y) ||
+	    ! _svg_extents_length (svg, &element->e.ellipse.rx, &w))
+	    return SVG_EXTENTS_UNKNOWN;
+	h = w;
+	if (element->type == SVG_ELEMENT_TYPE_ELLIPSE &&
+	    ! _svg_extents_length (svg, &element->e.ellipse.ry, &h))
+	    return SVG_EXTENTS_UNKNOWN;
+	_svg_extents_box_add_point (box, x - fabs (w), y - fabs (h));
+	_svg_extents_box_add_point (box, x + fabs (w), y + fabs (h));
+	break;
+
+    case SVG_ELEMENT_TYPE_LINE:
+	if (! _svg_extents_length (svg, &element->e.line.x1, &x) ||
+	    ! _svg_extents_length (svg, &element->e.line.y1, &y))
+	    return SVG_EXTENTS_UNKNOWN;
+	_svg_extents_box_add_point (box, x, y);
+	if (! _svg_extents_length (svg, &element->e.line.x2, &x) ||
+	    ! _svg_extents_length (svg, &element->e.line.y2, &y))
+	    return SVG_EXTENTS_UNKNOWN;
+	_svg_extents_box_add_point (box, x, y);
+	break;
+
+    case SVG_ELEMENT_TYPE_RECT:
+	if (! _svg_extents_length (svg, &element->e.rect.x, &x) ||
+	    ! _svg_extents_length (svg, &element->e.rect.y, &y) ||
+	    ! _svg_extents_length (svg, &element->e.rect.width, &w) ||
+	    ! _svg_extents_length (svg, &element->e.rect.height, &h))
+	    return SVG_EXTENTS_UNKNOWN;
+	_svg_extents_box_add_point (box, x, y);
+	_svg_extents_box_add_point (box, x + w, y + h);
+	break;
+
+    case SVG_ELEMENT_TYPE_TEXT:
+	if (element->e.text.chars == NULL)
+	    return SVG_EXTENTS_EMPTY;
+	if (! _svg_extents_length (svg, &element->e.text.x, &x) ||
+	    ! _svg_extents_length (svg, &element->e.text.y, &y))
+	    return SVG_EXTENTS_UNKNOWN;
+	/* No font metrics here. Allow one em of advance per byte of
+	   UTF-8 on either side of the anchor, which covers every text
+	   anchor, and generous room above and below the baseline. */
+	if (! _svg_extents_font_size (element, &h))
+	    return SVG_EXTENTS_UNKNOWN;
+	w = h * strlen (element->e.text.chars);
+	_svg_extents_box_add_point (box, x - w, y - 2 * h);
+	_svg_extents_box_add_point (box, x + w, y + h);
+	break;
+
+    case SVG_ELEMENT_TYPE_IMAGE:
+	if (! _svg_extents_length (svg, &element->e.image.x, &x) ||
+	    ! _svg_extents_length (svg, &element->e.image.y, &y) ||
+	    ! _svg_extents_length (svg, &element->e.image.width, &w) ||
+	    ! _svg_extents_length (svg, &element->e.image.height, &h))
+	    return SVG_EXTENTS_UNKNOWN;
+	_svg_extents_box_add_point (box, x, y);
+	_svg_extents_box_add_point (box, x + w, y + h);
+	/* images aren't stroked */
+	return SVG_EXTENTS_VALID;
+
+    case SVG_ELEMENT_TYPE_DEFS:
+    case SVG_ELEMENT_TYPE_GRADIENT:
+    case SVG_ELEMENT_TYPE_GRADIENT_STOP:
+    case SVG_ELEMENT_TYPE_PATTERN:
+	return SVG_EXTENTS_EMPTY;
+
+    case SVG_ELEMENT_TYPE_SVG_GROUP:
+    case SVG_ELEMENT_TYPE_SYMBOL:
+    default:
+	return SVG_EXTENTS_UNKNOWN;
+    }
+
+    if (box->empty)
+	return SVG_EXTENTS_EMPTY;
+
+    if (! _svg_extents_stroke_pad (element, &pad))
+	return SVG_EXTENTS_UNKNOWN;
+    _svg_extents_box_grow (box, pad, pad);
+
+    return SVG_EXTENTS_VALID;
+}
+
+/* Extents of element (including its own transform) in the user space
+   of its parent. Results are cached until the document changes. */
+svg_extents_state_t
+_svg_element_get_extents (svg_element_t *element, svg_rect_t *extents)
+{
+    svg_extents_box_t local, box;
+    svg_transform_t transform;
+    double x[4], y[4];
+    int i;
+
+    if (element->extents_serial == element->doc->extents_serial) {
+	*extents = element->extents;
+	return element->extents_state;
+    }
+
+    _svg_extents_box_init (&local);
+    element->extents_state = _svg_element_get_local_extents (element, &local);
+
+    if (element->extents_state == SVG_EXTENTS_VALID) {
+	transform = element->transform;
+	if (element->type == SVG_ELEMENT_TYPE_USE)
+	    _svg_transform_add_translate (&transform, element->e.group.x.value, element->e.group.y.value);
+
+	x[0] = local.x1; y[0] = local.y1;
+	x[1] = local.x2; y[1] = local.y1;
+	x[2] = local.x1; y[2] = local.y2;
+	x[3] = local.x2; y[3] = local.y2;
+
+	_svg_extents_box_init (&box);
+	for (i = 0; i < 4; i++)
+	    _svg_extents_box_add_point (&box,
+					transform.m[0][0] * x[i] + transform.m[1][0] * y[i] + transform.m[2][0],
+					transform.m[0][1] * x[i] + transform.m[1][1] * y[i] + transform.m[2][1]);
+
+	element->extents.x = box.x1;
+	element->extents.y = box.y1;
+	element->extents.width = box.x2 - box.x1;
+	element->extents.height = box.y2 - box.y1;
+    }
+
+    element->extents_serial = element->doc->extents_serial;
+    *extents = element->extents;
+
+    return element->extents_state;
+}
+
+/* Splats: the colors elements average out to over their extents, for
+   drawing them when they are too small to make out. They are worked
+   out from the paint inherited in the document tree, so, as with
+   folded opacity, content that may be drawn through <use> has none,
+   and neither has anything painted with a pattern or an image. */
+
+/* Fraction of its bounding box an arbitrary path is taken to cover */
+#define SVG_SPLAT_PATH_COVERAGE 0.5
+
+/* Ink of an average glyph, in ems */
+#define SVG_SPLAT_GLYPH_AREA (0.5 * 0.7)
+
+static int
+_svg_splat_paint (svg_element_t *element, const svg_paint_t *paint, svg_splat_t *splat)
+{
+    const svg_color_t *color = NULL;
+    svg_gradient_stop_t *stop;
+    svg_element_t *e;
+    int i;
+
+    splat->red = splat->green = splat->blue = splat->alpha = 0.0;
+
+    switch (paint->type) {
+    case SVG_PAINT_TYPE_NONE:
+	return 1;
+
+    case SVG_PAINT_TYPE_COLOR:
+	color = &paint->p.color;
+	if (color->is_current_color) {
+	    color = NULL;
+	    for (e = element; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent) {
+		if (e->style.flags & SVG_STYLE_FLAG_COLOR) {
+		    color = &e->style.color;
+		    break;
+		}
+	    }
+	}
+	if (color) {
+	    splat->red = svg_color_get_red (color) / 255.0;
+	    splat->green = svg_color_get_green (color) / 255.0;
+	    splat->blue = svg_color_get_blue (color) / 255.0;
+	}
+	splat->alpha = 1.0;
+	return 1;
+
+    case SVG_PAINT_TYPE_GRADIENT:
+	/* every stop counts the same, whatever its offset */
+	for (i = 0; i < paint->p.gradient->num_stops; i++) {
+	    stop = &paint->p.gradient->stops[i];
+	    splat->red += svg_color_get_red (&stop->color) / 255.0 * stop->opacity;
+	    splat->green += svg_color_get_green (&stop->color) / 255.0 * stop->opacity;
+	    splat->blue += svg_color_get_blue (&stop->color) / 255.0 * stop->opacity;
+	    splat->alpha += stop->opacity;
+	}
+	if (i) {
+	    splat->red /= i;
+	    splat->green /= i;
+	    splat->blue /= i;
+	    splat->alpha /= i;
+	}
+	return 1;
+
+    case SVG_PAINT_TYPE_PATTERN:
+    default:
+	return 0;
+    }
+}
+
+static void
+_svg_splat_scale (svg_splat_t *splat, double factor)
+{
+    splat->red *= factor;
+    splat->green *= factor;
+    splat->blue *= factor;
+    splat->alpha *= factor;
+}
+
+static int
+_svg_element_get_shape_splat (svg_element_t *element, svg_splat_t *splat)
+{
+    svg_paint_t *fill = NULL, *stroke = NULL;
+    svg_length_t *stroke_width = NULL;
+    double fill_opacity = 1.0, stroke_opacity = 1.0;
+    int have_fill_opacity = 0, have_stroke_opacity = 0;
+    svg_extents_box_t box;
+    svg_splat_t fill_splat, stroke_splat;
+    double area, pad, w, h, sw, coverage, fill_area, stroke_area;
+    svg_element_t *e;
+
+    for (e = element; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent) {
+	if (fill == NULL && (e->style.flags & SVG_STYLE_FLAG_FILL_PAINT))
+	    fill = &e->style.fill_paint;
+	if (stroke == NULL && (e->style.flags & SVG_STYLE_FLAG_STROKE_PAINT))
+	    stroke = &e->style.stroke_paint;
+	if (stroke_width == NULL && (e->style.flags & SVG_STYLE_FLAG_STROKE_WIDTH))
+	    stroke_width = &e->style.stroke_width;
+	if (! have_fill_opacity && (e->style.flags & SVG_STYLE_FLAG_FILL_OPACITY)) {
+	    fill_opacity = e->style.fill_opacity;
+	    have_fill_opacity = 1;
+	}
+	if (! have_stroke_opacity && (e->style.flags & SVG_STYLE_FLAG_STROKE_OPACITY)) {
+	    stroke_opacity = e->style.stroke_opacity;
+	    have_stroke_opacity = 1;
+	}
+    }
+
+    fill_splat.red = fill_splat.green = fill_splat.blue = 0.0;
+    fill_splat.alpha = 1.0;
+    stroke_splat.red = stroke_splat.green = stroke_splat.blue = stroke_splat.alpha = 0.0;
+    if ((fill && ! _svg_splat_paint (element, fill, &fill_splat)) ||
+	(stroke && ! _svg_splat_paint (element, stroke, &stroke_splat)))
+	return 0;
+
+    sw = 1.0;
+    if (stroke_width && ! _svg_extents_length (element->doc, stroke_width, &sw))
+	return 0;
+    sw = fabs (sw);
+
+    /* the extents are padded for the worst stroke, work out how much
+       of them the geometry and its stroke cover */
+    _svg_extents_box_init (&box);
+    if (_svg_element_get_local_extents (element, &box) != SVG_EXTENTS_VALID ||
+	! _svg_extents_stroke_pad (element, &pad))
+	return 0;
+    area = (box.x2 - box.x1) * (box.y2 - box.y1);
+    w = box.x2 - box.x1 - 2 * pad;
+    h = box.y2 - box.y1 - 2 * pad;
+    if (area <= 0.0 || w < 0.0 || h < 0.0)
+	return 0;
+
+    switch (element->type) {
+    case SVG_ELEMENT_TYPE_RECT:
+	coverage = 1.0;
+	break;
+    case SVG_ELEMENT_TYPE_CIRCLE:
+    case SVG_ELEMENT_TYPE_ELLIPSE:
+	coverage = M_PI / 4.0;
+	break;
+    default:
+	coverage = SVG_SPLAT_PATH_COVERAGE;
+	break;
+    }
+
+    if (element->type == SVG_ELEMENT_TYPE_TEXT) {
+	if (! _svg_extents_font_size (element, &h))
+	    return 0;
+	fill_area = strlen (element->e.text.chars) * h * h * SVG_SPLAT_GLYPH_AREA;
+	stroke_area = 0.0;
+    } else {
+	fill_area = w * h * coverage;
+	stroke_area = ((w + sw) * (h + sw) -
+		       (w > sw ? w - sw : 0.0) * (h > sw ? h - sw : 0.0)) * coverage;
+    }
+
+    _svg_splat_scale (&fill_splat, fill_opacity * (fill_area < area ? fill_area / area : 1.0));
+    _svg_splat_scale (&stroke_splat, stroke_opacity * (stroke_area < area ? stroke_area / area : 1.0));
+
+    /* the stroke goes over the fill */
+    _svg_splat_scale (&fill_splat, 1.0 - stroke_splat.alpha);
+    splat->red = stroke_splat.red + fill_splat.red;
+    splat->green = stroke_splat.green + fill_splat.green;
+    splat->blue = stroke_splat.blue + fill_splat.blue;
+    splat->alpha = stroke_splat.alpha + fill_splat.alpha;
+
+    return 1;
+}
+
+static int
+_svg_element_get_group_splat (svg_element_t *element, svg_splat_t *splat)
+{
+    svg_extents_box_t box;
+    svg_splat_t child_splat;
+    svg_rect_t child;
+    double area;
+    int i;
+
+    splat->red = splat->green = splat->blue = splat->alpha = 0.0;
+    _svg_extents_box_init (&box);
+
+    for (i = 0; i < element->e.group.num_elements; i++) {
+	switch (_svg_element_get_extents (element->e.group.element[i], &child)) {
+	case SVG_EXTENTS_UNKNOWN:
+	    return 0;
+	case SVG_EXTENTS_EMPTY:
+	    continue;
+	case SVG_EXTENTS_VALID:
+	    break;
+	}
+	if (! _svg_element_get_splat (element->e.group.element[i], &child_splat))
+	    return 0;
+
+	area = child.width * child.height;
+	splat->red += child_splat.red * area;
+	splat->green += child_splat.green * area;
+	splat->blue += child_splat.blue * area;
+	splat->alpha += child_splat.alpha * area;
+	_svg_extents_box_add_rect (&box, &child);
+    }
+
+    area = (box.x2 - box.x1) * (box.y2 - box.y1);
+    if (box.empty || area <= 0.0)
+	return 1;
+
+    /* overlapping children can't cover more than all of it */
+    _svg_splat_scale (splat, splat->alpha > area ? 1.0 / splat->alpha : 1.0 / area);
+
+    return 1;
+}
+
+/* The color element averages out to over its extents, including its
+   opacity. Returns 0 when there is no telling. Results are cached
+   until the document changes. */
+int
+_svg_element_get_splat (svg_element_t *element, svg_splat_t *splat)
+{
+    svg_element_t *e;
+
+    if (element->splat_serial == element->doc->extents_serial) {
+	*splat = element->splat;
+	return element->has_splat;
+    }
+
+    element->has_splat = 0;
+    for (e = element; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent) {
+	if (e->ref_count ||
+	    e->type == SVG_ELEMENT_TYPE_DEFS ||
+	    e->type == SVG_ELEMENT_TYPE_SYMBOL ||
+	    e->type == SVG_ELEMENT_TYPE_PATTERN)
+	    break;
+    }
+
+    if (e == NULL || e == SVG_DELETED_ELEMENT_OBJECT) {
+	switch (element->type) {
+	case SVG_ELEMENT_TYPE_GROUP:
+	    element->has_splat = _svg_element_get_group_splat (element, &element->splat);
+	    break;
+	case SVG_ELEMENT_TYPE_PATH:
+	case SVG_ELEMENT_TYPE_CIRCLE:
+	case SVG_ELEMENT_TYPE_ELLIPSE:
+	case SVG_ELEMENT_TYPE_LINE:
+	case SVG_ELEMENT_TYPE_RECT:
+	case SVG_ELEMENT_TYPE_TEXT:
+	    element->has_splat = _svg_element_get_shape_splat (element, &element->splat);
+	    if (element->has_splat && _svg_style_get_visibility (&element->style))
+		element->splat.red = element->splat.green =
+		    element->splat.blue = element->splat.alpha = 0.0;
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    if (element->has_splat && (element->style.flags & SVG_STYLE_FLAG_DISPLAY) == 0)
+	element->splat.red = element->splat.green =
+	    element->splat.blue = element->splat.alpha = 0.0;
+
+    if (element->has_splat)
+	_svg_splat_scale (&element->splat, _svg_style_get_opacity (&element->style));
+
+    element->splat_serial = element->doc->extents_serial;
+    *splat = element->splat;
+
+    return element->has_splat;
+}
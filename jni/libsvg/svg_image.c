@@ -20,6 +20,7 @@
    Author: Carl Worth <cworth@isi.edu>
 */
 
+#include <stdio.h>
 #include <string.h>
 #include <png.h>
 #include <jpeglib.h>
@@ -29,19 +30,36 @@
 #include "svgint.h"
 
 static svg_status_t
-_svg_image_read_image (svg_image_t *image);
+_svg_image_read_image (svg_image_t	*image,
+		       unsigned int	target_width,
+		       unsigned int	target_height);
 
 static svg_status_t
-_svg_image_read_png (const char		*filename,
-		     char	 	**data,
-		     unsigned int	*width,
-		     unsigned int	*height);
+_svg_image_decode (const char		*filename,
+		   unsigned int		target_width,
+		   unsigned int		target_height,
+		   svg_image_data_t	*image);
+
+/* Where the encoded bytes come from: a file, or memory for the
+   contents of a data: URI */
+typedef struct svg_image_source {
+    FILE *file;
+    unsigned char *data;
+    size_t length;
+    size_t offset;
+} svg_image_source_t;
+
+static svg_status_t
+_svg_image_read_png (svg_image_source_t	*source,
+		     unsigned int	target_width,
+		     unsigned int	target_height,
+		     svg_image_data_t	*image);
 
 static svg_status_t
-_svg_image_read_jpeg (const char	*filename,
-		      char	 	**data,
-		      unsigned int	*width,
-		      unsigned int	*height);
+_svg_image_read_jpeg (svg_image_source_t	*source,
+		      unsigned int	target_width,
+		      unsigned int	target_height,
+		      svg_image_data_t	*image);
 
 svg_status_t
 _svg_image_init (svg_image_t *image)
@@ -65,6 +83,8 @@ svg_status_t _svg_image_init_copy (svg_image_t *image,
 		image->url = strdup (other->url);
 	else
 		image->url = NULL;
+	if (other->data)
+		image->data = _svg_image_data_reference (other->data);
 	
 	return SVG_STATUS_SUCCESS;
 }
@@ -78,7 +98,7 @@ _svg_image_deinit (svg_image_t *image)
     }
 
     if (image->data) {
-	free (image->data);
+	_svg_image_data_destroy (image->data);
 	image->data = NULL;
     }
 
@@ -125,6 +145,8 @@ _svg_image_apply_attributes (svg_image_t	*image,
 
 svg_status_t
 _svg_image_render (svg_image_t		*image,
+		   unsigned int		target_width,
+		   unsigned int		target_height,
 		   svg_render_engine_t	*engine,
 		   void			*closure)
 {
@@ -133,14 +155,14 @@ _svg_image_render (svg_image_t		*image,
     if (image->width.value == 0 || image->height.value == 0)
 	return SVG_STATUS_SUCCESS;
 
-    status = _svg_image_read_image (image);
+    status = _svg_image_read_image (image, target_width, target_height);
     if (status)
 	return status;
 
     status = (engine->render_image) (closure,
-				     (unsigned char*) image->data,
-				     image->data_width,
-				     image->data_height,
+				     (unsigned char*) image->data->data,
+				     image->data->width,
+				     image->data->height,
 				     &image->x,
 				     &image->y,
 				     &image->width,
@@ -151,66 +173,199 @@ _svg_image_render (svg_image_t		*image,
     return SVG_STATUS_SUCCESS;
 }
 
+/* Keeps what was decoded for an earlier render unless it is now too
+   coarse. A finer level looks no worse, it is only slower to draw. */
 static svg_status_t
-_svg_image_read_image (svg_image_t *image)
+_svg_image_read_image (svg_image_t	*image,
+		       unsigned int	target_width,
+		       unsigned int	target_height)
 {
-    svgint_status_t status;
+    if (image->data) {
+	if (image->data->level <= _svg_image_level (image->data->natural_width,
+						    image->data->natural_height,
+						    target_width, target_height))
+	    return SVG_STATUS_SUCCESS;
 
-    if (image->data)
-	return SVG_STATUS_SUCCESS;
+	_svg_image_data_destroy (image->data);
+	image->data = NULL;
+    }
 
-    /* XXX: _svg_image_read_png only deals with filenames, not URLs */
-    status = _svg_image_read_png (image->url,
-				  &image->data,
-				  &image->data_width,
-				  &image->data_height);
-    if (status == 0)
-	return SVG_STATUS_SUCCESS;
+    return _svg_image_load (image->url, target_width, target_height, 0, &image->data);
+}
 
-    if (status != SVGINT_STATUS_IMAGE_NOT_PNG)
-	return status;
+svg_status_t
+_svg_image_load (const char		*url,
+		 unsigned int		target_width,
+		 unsigned int		target_height,
+		 int			any_size,
+		 svg_image_data_t	**data)
+{
+    /* XXX: the cache only deals with filenames and data: URIs */
+    return _svg_image_cache_load (url, target_width, target_height,
+				  _svg_image_decode, any_size, data);
+}
 
-    /* XXX: _svg_image_read_jpeg only deals with filenames, not URLs */
-    status = _svg_image_read_jpeg (image->url,
-				   &image->data,
-				   &image->data_width,
-				   &image->data_height);
-    if (status == 0)
-	return SVG_STATUS_SUCCESS;
+static svg_status_t
+_svg_image_decode (const char		*filename,
+		   unsigned int		target_width,
+		   unsigned int		target_height,
+		   svg_image_data_t	*image)
+{
+    svgint_status_t status;
+    svg_image_source_t source;
+
+    memset (&source, 0, sizeof (svg_image_source_t));
+    if (_svg_data_uri_is (filename)) {
+	status = _svg_data_uri_decode (filename, &source.data, &source.length);
+	if (status)
+	    return status;
+    } else {
+	source.file = fopen (filename, "rb");
+	if (source.file == NULL)
+	    return SVG_STATUS_FILE_NOT_FOUND;
+    }
+
+    status = _svg_image_read_png (&source, target_width, target_height, image);
+
+    if (status == SVGINT_STATUS_IMAGE_NOT_PNG) {
+	if (source.file)
+	    rewind (source.file);
+	source.offset = 0;
+	status = _svg_image_read_jpeg (&source, target_width, target_height, image);
+    }
 
     /* XXX: need to support SVG images as well */
 
-    if (status != SVGINT_STATUS_IMAGE_NOT_JPEG)
-	return status;
+    if (status == SVGINT_STATUS_IMAGE_NOT_JPEG)
+	status = SVG_STATUS_PARSE_ERROR;
+
+    /* the pixels are all that is kept */
+    if (source.file)
+	fclose (source.file);
+    free (source.data);
+
+    return status;
+}
+
+static size_t
+_svg_image_source_read (svg_image_source_t *source, unsigned char *buf, size_t length)
+{
+    if (source->file)
+	return fread (buf, 1, length, source->file);
+
+    if (length > source->length - source->offset)
+	length = source->length - source->offset;
+    memcpy (buf, source->data + source->offset, length);
+    source->offset += length;
+
+    return length;
+}
+
+static void
+_svg_image_png_read (png_structp png, png_bytep data, png_size_t length)
+{
+    svg_image_source_t *source = png_get_io_ptr (png);
 
-    return SVG_STATUS_PARSE_ERROR;
+    if (_svg_image_source_read (source, data, length) != length)
+	png_error (png, "Read Error");
 }
 
 static void
 premultiply_data (png_structp png, png_row_infop row_info, png_bytep data)
 {
-    int i;
-  
-    for (i = 0; i < row_info->rowbytes; i += 4) {
-	unsigned char *b = &data[i];
-	unsigned char alpha = b[3];
-	unsigned long pixel = ((((b[0] * alpha) / 255) << 0) |
-			       (((b[1] * alpha) / 255) << 8) |
-			       (((b[2] * alpha) / 255) << 16) |
-			       (alpha << 24));
-	unsigned long *p = (unsigned long *) b;
-	*p = pixel;
+    _svg_pixels_premultiply (data, row_info->rowbytes / 4);
+}
+
+/* Box filter taking an image down to a level as its rows come in */
+typedef struct svg_image_shrink {
+    unsigned int level;
+    unsigned int width;
+    unsigned int rows;
+    unsigned int *sums;
+    unsigned char *out;
+    svg_image_data_t *image;
+} svg_image_shrink_t;
+
+static svg_status_t
+_svg_image_shrink_init (svg_image_shrink_t	*shrink,
+			svg_image_data_t	*image,
+			unsigned int		level)
+{
+    shrink->level = level;
+    shrink->width = image->natural_width;
+    shrink->rows = 0;
+    shrink->image = image;
+
+    image->level = level;
+    image->width = (image->natural_width + (1u << level) - 1) >> level;
+    image->height = (image->natural_height + (1u << level) - 1) >> level;
+
+    image->data = malloc (image->width * image->height * 4);
+    shrink->sums = calloc (image->width * 4, sizeof (unsigned int));
+    if (image->data == NULL || shrink->sums == NULL) {
+	free (shrink->sums);
+	return SVG_STATUS_NO_MEMORY;
+    }
+    shrink->out = (unsigned char *) image->data;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+static void
+_svg_image_shrink_flush (svg_image_shrink_t *shrink)
+{
+    unsigned int x, c, span, count;
+    unsigned int block = 1u << shrink->level;
+    unsigned int *sum = shrink->sums;
+
+    /* the last column and row of blocks may be cut short */
+    for (x = 0; x < shrink->image->width; x++) {
+	span = shrink->width - (x << shrink->level);
+	if (span > block)
+	    span = block;
+	count = span * shrink->rows;
+	for (c = 0; c < 4; c++) {
+	    *shrink->out++ = (*sum + count / 2) / count;
+	    *sum++ = 0;
+	}
+    }
+
+    shrink->rows = 0;
+}
+
+static void
+_svg_image_shrink_row (svg_image_shrink_t *shrink, const unsigned char *row)
+{
+    unsigned int x, *sum;
+
+    for (x = 0; x < shrink->width; x++, row += 4) {
+	sum = shrink->sums + (x >> shrink->level) * 4;
+	sum[0] += row[0];
+	sum[1] += row[1];
+	sum[2] += row[2];
+	sum[3] += row[3];
     }
+
+    if (++shrink->rows == 1u << shrink->level)
+	_svg_image_shrink_flush (shrink);
+}
+
+static void
+_svg_image_shrink_fini (svg_image_shrink_t *shrink)
+{
+    if (shrink->rows)
+	_svg_image_shrink_flush (shrink);
+
+    free (shrink->sums);
 }
 
 static svg_status_t
-_svg_image_read_png (const char		*filename,
-		     char	 	**data,
-		     unsigned int	*width,
-		     unsigned int	*height)
+_svg_image_read_png (svg_image_source_t	*source,
+		     unsigned int	target_width,
+		     unsigned int	target_height,
+		     svg_image_data_t	*image)
 {
     int i;
-    FILE *file;
     static const int PNG_SIG_SIZE = 8;
     unsigned char png_sig[PNG_SIG_SIZE];
     int sig_bytes;
@@ -218,37 +373,30 @@ _svg_image_read_png (const char		*filename,
     png_info *info;
     png_uint_32 png_width, png_height;
     int depth, color_type, interlace;
-    unsigned int pixel_size;
+    unsigned int pixel_size, level;
     png_byte **row_pointers;
+    png_byte *pixels;
+    svg_image_shrink_t shrink;
 
-    file = fopen (filename, "rb");
-    if (file == NULL)
-	return SVG_STATUS_FILE_NOT_FOUND;
-
-    sig_bytes = fread (png_sig, 1, PNG_SIG_SIZE, file);
-    if (png_sig_cmp (png_sig, 0, sig_bytes) != 0) {
-	fclose (file);
+    sig_bytes = _svg_image_source_read (source, png_sig, PNG_SIG_SIZE);
+    if (png_sig_cmp (png_sig, 0, sig_bytes) != 0)
 	return SVGINT_STATUS_IMAGE_NOT_PNG;
-    }
 
     /* XXX: Perhaps we'll want some other error handlers? */
     png = png_create_read_struct (PNG_LIBPNG_VER_STRING,
 				  NULL,
 				  NULL,
 				  NULL);
-    if (png == NULL) {
-	fclose (file);
+    if (png == NULL)
 	return SVG_STATUS_NO_MEMORY;
-    }
 
     info = png_create_info_struct (png);
     if (info == NULL) {
-	fclose (file);
 	png_destroy_read_struct (&png, NULL, NULL);
 	return SVG_STATUS_NO_MEMORY;
     }
 
-    png_init_io (png, file);
+    png_set_read_fn (png, source, _svg_image_png_read);
     png_set_sig_bytes (png, sig_bytes);
 
     png_read_info (png, info);
@@ -256,8 +404,8 @@ _svg_image_read_png (const char		*filename,
     png_get_IHDR (png, info,
 		  &png_width, &png_height, &depth,
 		  &color_type, &interlace, NULL, NULL);
-    *width = png_width;
-    *height = png_height;
+    image->natural_width = png_width;
+    image->natural_height = png_height;
 
     /* XXX: I still don't know what formats will be exported in the
        libsvg -> svg_render_engine interface. For now, I'm converting
@@ -297,21 +445,61 @@ _svg_image_read_png (const char		*filename,
     png_read_update_info (png, info);
 
     pixel_size = 4;
-    *data = malloc (png_width * png_height * pixel_size);
-    if (*data == NULL) {
-	fclose (file);
-	return SVG_STATUS_NO_MEMORY;
+    level = _svg_image_level (png_width, png_height, target_width, target_height);
+
+    if (level == 0) {
+	image->level = 0;
+	image->width = png_width;
+	image->height = png_height;
+	image->data = malloc (png_width * png_height * pixel_size);
+	if (image->data == NULL) {
+	    png_destroy_read_struct (&png, &info, NULL);
+	    return SVG_STATUS_NO_MEMORY;
+	}
+	pixels = (png_byte *) image->data;
+    } else {
+	if (_svg_image_shrink_init (&shrink, image, level)) {
+	    png_destroy_read_struct (&png, &info, NULL);
+	    return SVG_STATUS_NO_MEMORY;
+	}
+
+	/* an interlaced image only comes out whole, any other is
+	   shrunk a row at a time without ever being there in full */
+	if (interlace != PNG_INTERLACE_NONE)
+	    pixels = malloc (png_width * png_height * pixel_size);
+	else
+	    pixels = malloc (png_width * pixel_size);
+	if (pixels == NULL) {
+	    _svg_image_shrink_fini (&shrink);
+	    png_destroy_read_struct (&png, &info, NULL);
+	    return SVG_STATUS_NO_MEMORY;
+	}
     }
 
-    row_pointers = malloc (png_height * sizeof(char *));
-    for (i=0; i < png_height; i++)
-	row_pointers[i] = (png_byte *) (*data + i * png_width * pixel_size);
+    if (level && interlace == PNG_INTERLACE_NONE) {
+	for (i = 0; i < png_height; i++) {
+	    png_read_row (png, pixels, NULL);
+	    _svg_image_shrink_row (&shrink, pixels);
+	}
+    } else {
+	row_pointers = malloc (png_height * sizeof(char *));
+	for (i=0; i < png_height; i++)
+	    row_pointers[i] = pixels + i * png_width * pixel_size;
+
+	png_read_image (png, row_pointers);
+	free (row_pointers);
 
-    png_read_image (png, row_pointers);
+	if (level) {
+	    for (i = 0; i < png_height; i++)
+		_svg_image_shrink_row (&shrink, pixels + i * png_width * pixel_size);
+	}
+    }
     png_read_end (png, info);
 
-    free (row_pointers);
-    fclose (file);
+    if (level) {
+	_svg_image_shrink_fini (&shrink);
+	free (pixels);
+    }
 
     png_destroy_read_struct (&png, &info, NULL);
 
@@ -343,46 +531,57 @@ _svg_image_jpeg_error_exit (j_common_ptr cinfo)
 }
 
 static svg_status_t
-_svg_image_read_jpeg (const char	*filename,
-		      char	 	**data,
-		      unsigned int	*width,
-		      unsigned int	*height)
+_svg_image_read_jpeg (svg_image_source_t	*source,
+		      unsigned int	target_width,
+		      unsigned int	target_height,
+		      svg_image_data_t	*image)
 {
-    FILE *file;
     svgint_status_t status;
     struct jpeg_decompress_struct cinfo;
     svg_image_jpeg_err_t jpeg_err;
     JSAMPARRAY buf;
     int i, row_stride;
     unsigned char *out, *in;
-    
-    file = fopen (filename, "rb");
-    if (file == NULL)
-	return SVG_STATUS_FILE_NOT_FOUND;
-    
+
     cinfo.err = jpeg_std_error (&jpeg_err.pub);
     jpeg_err.pub.error_exit = _svg_image_jpeg_error_exit;
-    
+
     status = setjmp (jpeg_err.setjmp_buf);
     if (status) {
 	jpeg_destroy_decompress(&cinfo);
-	fclose(file);
 	return status;
     }
-    
+
     jpeg_create_decompress (&cinfo);
-    jpeg_stdio_src (&cinfo, file);
+    if (source->file)
+	jpeg_stdio_src (&cinfo, source->file);
+    else
+	jpeg_mem_src (&cinfo, source->data, source->length);
     jpeg_read_header (&cinfo, TRUE);
+
+    /* the IDCT can scale by 1/2, 1/4 and 1/8 for free, rounding up
+       the way levels do */
+    image->natural_width = cinfo.image_width;
+    image->natural_height = cinfo.image_height;
+    image->level = _svg_image_level (cinfo.image_width, cinfo.image_height,
+				     target_width, target_height);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1 << image->level;
+
     jpeg_start_decompress (&cinfo);
-    
+
     row_stride = cinfo.output_width * cinfo.output_components;
-    *width = cinfo.output_width;
-    *height= cinfo.output_height;
+    image->width = cinfo.output_width;
+    image->height = cinfo.output_height;
     buf = (*cinfo.mem->alloc_sarray)
 	((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
-    
-    *data = malloc (cinfo.output_width * cinfo.output_height * 4);
-    out = (unsigned char*) *data;
+
+    image->data = malloc (cinfo.output_width * cinfo.output_height * 4);
+    if (image->data == NULL) {
+	jpeg_destroy_decompress (&cinfo);
+	return SVG_STATUS_NO_MEMORY;
+    }
+    out = (unsigned char*) image->data;
     while (cinfo.output_scanline < cinfo.output_height) {
 	jpeg_read_scanlines (&cinfo, buf, 1);
 	in = buf[0];
@@ -391,8 +590,8 @@ _svg_image_read_jpeg (const char	*filename,
 	    case 1:
 		out[3] = 0xff;
 		out[2] = in[0];
-		out[1] = in[1];
-		out[0] = in[2];
+		out[1] = in[0];
+		out[0] = in[0];
 		in += 1;
 		out += 4;
 		break;
@@ -409,8 +608,6 @@ _svg_image_read_jpeg (const char	*filename,
     }
     jpeg_finish_decompress (&cinfo);
     jpeg_destroy_decompress (&cinfo);
-    fclose(file);
-    
+
     return SVG_STATUS_SUCCESS;
 }
-
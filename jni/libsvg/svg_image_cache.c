@@ -0,0 +1,356 @@
+/* svg_image_cache.c: Decoded images shared across elements and documents
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* An image is kept once per level it was decoded at. Every one in
+   here is on one list, most recently used first, and is freed once it
+   is neither held by an <image> element nor wanted for staying under
+   the byte cap. An image whose file is found to have changed leaves
+   the list right away, and is freed as soon as the last element
+   holding it lets go.
+
+   An image goes on the list before it is decoded, which happens
+   without the lock held. Anyone wanting it meanwhile waits for that
+   decode instead of starting one of their own, which is what lets
+   svg_prefetch_images decode ahead of the render.
+
+   A file is known by its real path and told from an older version of
+   itself by its time stamp and size. A data: URI carries its bytes, so
+   it is known by a hash of them and never goes stale. */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "svgint.h"
+
+static pthread_mutex_t _svg_image_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _svg_image_cache_decoded = PTHREAD_COND_INITIALIZER;
+
+static struct {
+    svg_image_data_t *head;
+    svg_image_data_t *tail;
+    unsigned int images;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned int hits;
+    unsigned int misses;
+} _svg_image_cache = {
+    NULL, NULL, 0, 0, SVG_IMAGE_CACHE_DEFAULT_MAX_BYTES, 0, 0
+};
+
+static void
+_svg_image_cache_unlink (svg_image_data_t *image)
+{
+    if (image->prev)
+	image->prev->next = image->next;
+    else
+	_svg_image_cache.head = image->next;
+    if (image->next)
+	image->next->prev = image->prev;
+    else
+	_svg_image_cache.tail = image->prev;
+
+    image->prev = NULL;
+    image->next = NULL;
+}
+
+static void
+_svg_image_cache_push (svg_image_data_t *image)
+{
+    image->prev = NULL;
+    image->next = _svg_image_cache.head;
+    if (image->next)
+	image->next->prev = image;
+    else
+	_svg_image_cache.tail = image;
+    _svg_image_cache.head = image;
+}
+
+static void
+_svg_image_data_free (svg_image_data_t *image)
+{
+    free (image->data);
+    free (image->path);
+    free (image);
+}
+
+/* Called with the lock held. Only images nobody holds can go. */
+static void
+_svg_image_cache_trim (void)
+{
+    svg_image_data_t *image, *prev;
+
+    for (image = _svg_image_cache.tail;
+	 image && _svg_image_cache.bytes > _svg_image_cache.max_bytes;
+	 image = prev) {
+	prev = image->prev;
+	if (image->ref_count)
+	    continue;
+
+	_svg_image_cache_unlink (image);
+	_svg_image_cache.images--;
+	_svg_image_cache.bytes -= image->bytes;
+	_svg_image_data_free (image);
+    }
+}
+
+static svg_status_t
+_svg_image_cache_key (const char *filename, char *key, struct stat *st)
+{
+    const unsigned char *c;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t length;
+
+    if (_svg_data_uri_is (filename)) {
+	/* FNV-1a */
+	for (c = (const unsigned char *) filename; *c; c++)
+	    hash = (hash ^ *c) * 1099511628211ULL;
+	length = c - (const unsigned char *) filename;
+	snprintf (key, PATH_MAX, "data:%016llx:%lu",
+		  (unsigned long long) hash, (unsigned long) length);
+	memset (st, 0, sizeof (struct stat));
+	return SVG_STATUS_SUCCESS;
+    }
+
+    if (realpath (filename, key) == NULL) {
+	strncpy (key, filename, PATH_MAX - 1);
+	key[PATH_MAX - 1] = '\0';
+    }
+    if (stat (key, st) != 0)
+	return SVG_STATUS_FILE_NOT_FOUND;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+unsigned int
+_svg_image_level (unsigned int width, unsigned int height,
+		  unsigned int target_width, unsigned int target_height)
+{
+    unsigned int level = 0;
+
+    if (target_width == 0 || target_height == 0)
+	return 0;
+
+    while (level < SVG_IMAGE_MAX_LEVEL &&
+	   (width + (2u << level) - 1) >> (level + 1) >= target_width &&
+	   (height + (2u << level) - 1) >> (level + 1) >= target_height)
+	level++;
+
+    return level;
+}
+
+/* Whether an image decoded for one target is good enough for another */
+static int
+_svg_image_cache_covers (unsigned int width, unsigned int height,
+			 unsigned int target_width, unsigned int target_height)
+{
+    return (width == 0 && height == 0) ||
+	(target_width && width >= target_width && height >= target_height);
+}
+
+/* Called with the lock held. Finds the coarsest level of the file
+   that still covers the target, or failing that an image being
+   decoded for a target at least as large. With any_size, the first
+   one of the file will do. */
+static svg_image_data_t *
+_svg_image_cache_find (const char	*path,
+		       const struct stat	*st,
+		       unsigned int	target_width,
+		       unsigned int	target_height,
+		       int		any_size)
+{
+    svg_image_data_t *image, *next, *best = NULL, *pending = NULL;
+    unsigned int level;
+
+    for (image = _svg_image_cache.head; image; image = next) {
+	next = image->next;
+	if (strcmp (image->path, path) != 0)
+	    continue;
+
+	if (image->mtime != st->st_mtime || image->size != st->st_size) {
+	    _svg_image_cache_unlink (image);
+	    _svg_image_cache.images--;
+	    _svg_image_cache.bytes -= image->bytes;
+	    if (image->ref_count)
+		image->stale = 1;
+	    else
+		_svg_image_data_free (image);
+	    continue;
+	}
+
+	if (any_size)
+	    return image;
+
+	if (image->pending) {
+	    if (pending == NULL &&
+		_svg_image_cache_covers (image->target_width, image->target_height,
+					 target_width, target_height))
+		pending = image;
+	    continue;
+	}
+
+	level = _svg_image_level (image->natural_width, image->natural_height,
+				  target_width, target_height);
+	if (image->level <= level && (best == NULL || image->level > best->level))
+	    best = image;
+    }
+
+    return best ? best : pending;
+}
+
+svg_status_t
+_svg_image_cache_load (const char		*filename,
+		       unsigned int		target_width,
+		       unsigned int		target_height,
+		       svg_image_decode_func_t	decode,
+		       int			any_size,
+		       svg_image_data_t		**image)
+{
+    svg_status_t status;
+    svg_image_data_t *found, *decoded;
+    char path[PATH_MAX];
+    struct stat st;
+
+    status = _svg_image_cache_key (filename, path, &st);
+    if (status)
+	return status;
+
+    pthread_mutex_lock (&_svg_image_cache_mutex);
+    found = _svg_image_cache_find (path, &st, target_width, target_height, any_size);
+    if (found) {
+	_svg_image_cache.hits++;
+	found->ref_count++;
+	while (found->pending)
+	    pthread_cond_wait (&_svg_image_cache_decoded, &_svg_image_cache_mutex);
+	status = found->status;
+	if (status == SVG_STATUS_SUCCESS && ! found->stale) {
+	    _svg_image_cache_unlink (found);
+	    _svg_image_cache_push (found);
+	}
+	pthread_mutex_unlock (&_svg_image_cache_mutex);
+
+	if (status) {
+	    _svg_image_data_destroy (found);
+	    return status;
+	}
+
+	*image = found;
+	return SVG_STATUS_SUCCESS;
+    }
+
+    _svg_image_cache.misses++;
+
+    decoded = calloc (1, sizeof (svg_image_data_t));
+    if (decoded)
+	decoded->path = strdup (path);
+    if (decoded == NULL || decoded->path == NULL) {
+	pthread_mutex_unlock (&_svg_image_cache_mutex);
+	free (decoded);
+	return SVG_STATUS_NO_MEMORY;
+    }
+
+    decoded->mtime = st.st_mtime;
+    decoded->size = st.st_size;
+    decoded->ref_count = 1;
+    decoded->pending = 1;
+    decoded->target_width = target_width;
+    decoded->target_height = target_height;
+    _svg_image_cache_push (decoded);
+    _svg_image_cache.images++;
+    pthread_mutex_unlock (&_svg_image_cache_mutex);
+
+    status = decode (_svg_data_uri_is (filename) ? filename : path,
+		     target_width, target_height, decoded);
+
+    pthread_mutex_lock (&_svg_image_cache_mutex);
+    decoded->pending = 0;
+    decoded->status = status;
+    if (status) {
+	/* whoever waited on it lets go of it too */
+	if (! decoded->stale) {
+	    _svg_image_cache_unlink (decoded);
+	    _svg_image_cache.images--;
+	    decoded->stale = 1;
+	}
+	if (--decoded->ref_count == 0)
+	    _svg_image_data_free (decoded);
+    } else {
+	decoded->bytes = (size_t) decoded->width * decoded->height * 4;
+	if (! decoded->stale) {
+	    _svg_image_cache.bytes += decoded->bytes;
+	    _svg_image_cache_trim ();
+	}
+    }
+    pthread_cond_broadcast (&_svg_image_cache_decoded);
+    pthread_mutex_unlock (&_svg_image_cache_mutex);
+
+    if (status)
+	return status;
+
+    *image = decoded;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+svg_image_data_t *
+_svg_image_data_reference (svg_image_data_t *image)
+{
+    pthread_mutex_lock (&_svg_image_cache_mutex);
+    image->ref_count++;
+    pthread_mutex_unlock (&_svg_image_cache_mutex);
+
+    return image;
+}
+
+void
+_svg_image_data_destroy (svg_image_data_t *image)
+{
+    pthread_mutex_lock (&_svg_image_cache_mutex);
+    if (--image->ref_count == 0) {
+	if (image->stale)
+	    _svg_image_data_free (image);
+	else
+	    _svg_image_cache_trim ();
+    }
+    pthread_mutex_unlock (&_svg_image_cache_mutex);
+}
+
+void
+svg_image_cache_set_max_bytes (size_t max_bytes)
+{
+    pthread_mutex_lock (&_svg_image_cache_mutex);
+    _svg_image_cache.max_bytes = max_bytes;
+    _svg_image_cache_trim ();
+    pthread_mutex_unlock (&_svg_image_cache_mutex);
+}
+
+void
+svg_image_cache_get_stats (svg_image_cache_stats_t *stats)
+{
+    pthread_mutex_lock (&_svg_image_cache_mutex);
+    stats->hits = _svg_image_cache.hits;
+    stats->misses = _svg_image_cache.misses;
+    stats->images = _svg_image_cache.images;
+    stats->bytes = _svg_image_cache.bytes;
+    stats->max_bytes = _svg_image_cache.max_bytes;
+    pthread_mutex_unlock (&_svg_image_cache_mutex);
+}
@@ -0,0 +1,307 @@
+/* svg_image_prefetch.c: Decoding a document's images ahead of rendering
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Every <image> the document would draw is handed to a few threads,
+   which decode it into the image cache at the size it is expected to
+   take on the device. The render then finds it there, or waits for
+   the decode already under way rather than starting its own, so the
+   decodes overlap each other and whatever is drawn before them.
+
+   The expected size comes from the transforms and viewBoxes above the
+   image alone, it being too early for extents. An image whose size
+   can't be told that way is decoded in full, which the render can
+   always make do with. */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "svgint.h"
+
+typedef struct svg_prefetch_job {
+    char *path;
+    unsigned int target_width;
+    unsigned int target_height;
+    /* held until the document goes, so the cache keeps it around */
+    svg_image_data_t *data;
+} svg_prefetch_job_t;
+
+struct svg_prefetch {
+    svg_prefetch_job_t *jobs;
+    int num_jobs;
+    int job_size;
+    int next_job;
+
+    pthread_mutex_t mutex;
+    pthread_t *threads;
+    unsigned int num_threads;
+};
+
+/* Relative URLs are resolved against the document's directory here,
+   which svg_render only gets to by changing into it. data: URIs are
+   taken as they are. */
+static char *
+_svg_prefetch_path (svg_t *svg, const char *url)
+{
+    char *path;
+
+    if (url[0] == '/' || _svg_data_uri_is (url) || svg->dir_name == NULL)
+	return strdup (url);
+
+    path = malloc (strlen (svg->dir_name) + strlen (url) + 2);
+    if (path)
+	sprintf (path, "%s/%s", svg->dir_name, url);
+
+    return path;
+}
+
+static svg_status_t
+_svg_prefetch_add (svg_t		*svg,
+		   svg_prefetch_t	*prefetch,
+		   const char		*url,
+		   unsigned int		target_width,
+		   unsigned int		target_height)
+{
+    svg_prefetch_job_t *job, *new_jobs;
+    char *path;
+    int i;
+
+    if (url == NULL || url[0] == '\0')
+	return SVG_STATUS_SUCCESS;
+
+    path = _svg_prefetch_path (svg, url);
+    if (path == NULL)
+	return SVG_STATUS_NO_MEMORY;
+
+    /* an image drawn more than once is decoded for the largest use */
+    for (i = 0; i < prefetch->num_jobs; i++) {
+	job = &prefetch->jobs[i];
+	if (strcmp (job->path, path) != 0)
+	    continue;
+
+	free (path);
+	if (job->target_width == 0 || target_width == 0) {
+	    job->target_width = 0;
+	    job->target_height = 0;
+	} else {
+	    if (target_width > job->target_width)
+		job->target_width = target_width;
+	    if (target_height > job->target_height)
+		job->target_height = target_height;
+	}
+	return SVG_STATUS_SUCCESS;
+    }
+
+    if (prefetch->num_jobs >= prefetch->job_size) {
+	int job_size = prefetch->job_size ? prefetch->job_size * 2 : 8;
+
+	new_jobs = realloc (prefetch->jobs, job_size * sizeof (svg_prefetch_job_t));
+	if (new_jobs == NULL) {
+	    free (path);
+	    return SVG_STATUS_NO_MEMORY;
+	}
+	prefetch->jobs = new_jobs;
+	prefetch->job_size = job_size;
+    }
+
+    job = &prefetch->jobs[prefetch->num_jobs++];
+    job->path = path;
+    job->target_width = target_width;
+    job->target_height = target_height;
+    job->data = NULL;
+
+    return SVG_STATUS_SUCCESS;
+}
+
+/* what the render asks for, given the device bounding box is rounded
+   out to whole pixels on both sides */
+static unsigned int
+_svg_prefetch_target (double size, double scale)
+{
+    return (unsigned int) ceil ((ceil (size) + 1.0) * scale);
+}
+
+/* ctm maps the element's parent's user space to the device, without
+   the translation; known is 0 once something above couldn't be told */
+static svg_status_t
+_svg_prefetch_walk (svg_t		*svg,
+		    svg_prefetch_t	*prefetch,
+		    svg_element_t	*element,
+		    svg_transform_t	ctm,
+		    int			known)
+{
+    svg_status_t status;
+    svg_group_t *group;
+    svg_image_t *image;
+    double width, height, sx, sy;
+    unsigned int target_width, target_height;
+    int i;
+
+    _svg_transform_multiply_into_right (&element->transform, &ctm);
+
+    switch (element->type) {
+    case SVG_ELEMENT_TYPE_IMAGE:
+	image = &element->e.image;
+	target_width = target_height = 0;
+	if (known && svg->image_scale > 0.0 &&
+	    _svg_extents_length (svg, &image->width, &width) &&
+	    _svg_extents_length (svg, &image->height, &height)) {
+	    if (width <= 0.0 || height <= 0.0)
+		return SVG_STATUS_SUCCESS;
+	    target_width = _svg_prefetch_target (fabs (ctm.m[0][0]) * width +
+						 fabs (ctm.m[1][0]) * height,
+						 svg->image_scale);
+	    target_height = _svg_prefetch_target (fabs (ctm.m[0][1]) * width +
+						  fabs (ctm.m[1][1]) * height,
+						  svg->image_scale);
+	}
+	return _svg_prefetch_add (svg, prefetch, image->url,
+				  target_width, target_height);
+    case SVG_ELEMENT_TYPE_SVG_GROUP:
+    case SVG_ELEMENT_TYPE_GROUP:
+    case SVG_ELEMENT_TYPE_USE:
+	group = &element->e.group;
+	if (element->type != SVG_ELEMENT_TYPE_USE &&
+	    group->view_box.aspect_ratio != SVG_PRESERVE_ASPECT_RATIO_UNKNOWN) {
+	    if (_svg_extents_length (svg, &group->width, &width) &&
+		_svg_extents_length (svg, &group->height, &height) &&
+		group->view_box.box.width > 0.0 && group->view_box.box.height > 0.0) {
+		sx = width / group->view_box.box.width;
+		sy = height / group->view_box.box.height;
+		if (group->view_box.aspect_ratio != SVG_PRESERVE_ASPECT_RATIO_NONE) {
+		    if (group->view_box.meet_or_slice == SVG_MEET_OR_SLICE_SLICE)
+			sx = sy = sx > sy ? sx : sy;
+		    else
+			sx = sy = sx < sy ? sx : sy;
+		}
+		_svg_transform_add_scale (&ctm, sx, sy);
+	    } else {
+		known = 0;
+	    }
+	}
+	for (i = 0; i < group->num_elements; i++) {
+	    status = _svg_prefetch_walk (svg, prefetch, group->element[i], ctm, known);
+	    if (status)
+		return status;
+	}
+	return SVG_STATUS_SUCCESS;
+    default:
+	/* what's in defs, symbols and patterns is drawn through <use>
+	   and paints, at sizes this can't tell */
+	return SVG_STATUS_SUCCESS;
+    }
+}
+
+static void *
+_svg_prefetch_worker (void *closure)
+{
+    svg_prefetch_t *prefetch = closure;
+    svg_prefetch_job_t *job;
+
+    for (;;) {
+	pthread_mutex_lock (&prefetch->mutex);
+	job = prefetch->next_job < prefetch->num_jobs ?
+	    &prefetch->jobs[prefetch->next_job++] : NULL;
+	pthread_mutex_unlock (&prefetch->mutex);
+	if (job == NULL)
+	    return NULL;
+
+	/* if the render got to it first, it may have wanted it smaller
+	   than this would, so it is left at that; a broken image is the
+	   render's to report */
+	if (_svg_image_load (job->path, job->target_width, job->target_height,
+			     1, &job->data))
+	    job->data = NULL;
+    }
+}
+
+void
+_svg_prefetch_destroy (svg_prefetch_t *prefetch)
+{
+    unsigned int i;
+    int j;
+
+    if (prefetch == NULL)
+	return;
+
+    for (i = 0; i < prefetch->num_threads; i++)
+	pthread_join (prefetch->threads[i], NULL);
+    free (prefetch->threads);
+    pthread_mutex_destroy (&prefetch->mutex);
+
+    for (j = 0; j < prefetch->num_jobs; j++) {
+	if (prefetch->jobs[j].data)
+	    _svg_image_data_destroy (prefetch->jobs[j].data);
+	free (prefetch->jobs[j].path);
+    }
+    free (prefetch->jobs);
+
+    free (prefetch);
+}
+
+svg_status_t
+svg_prefetch_images (svg_t *svg, double scale, unsigned int threads)
+{
+    svg_status_t status;
+    svg_prefetch_t *prefetch;
+    svg_transform_t ctm;
+    long cpus;
+
+    _svg_prefetch_destroy (svg->prefetch);
+    svg->prefetch = NULL;
+
+    if (svg->group_element == NULL)
+	return SVG_STATUS_SUCCESS;
+
+    prefetch = calloc (1, sizeof (svg_prefetch_t));
+    if (prefetch == NULL)
+	return SVG_STATUS_NO_MEMORY;
+    pthread_mutex_init (&prefetch->mutex, NULL);
+
+    _svg_transform_init_scale (&ctm, scale, scale);
+    status = _svg_prefetch_walk (svg, prefetch, svg->group_element, ctm, scale > 0.0);
+    if (status) {
+	_svg_prefetch_destroy (prefetch);
+	return status;
+    }
+
+    if (threads == 0) {
+	cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	threads = cpus > 0 ? cpus : 1;
+    }
+    if (threads > (unsigned int) prefetch->num_jobs)
+	threads = prefetch->num_jobs;
+
+    prefetch->threads = malloc (threads * sizeof (pthread_t));
+    if (threads && prefetch->threads == NULL) {
+	_svg_prefetch_destroy (prefetch);
+	return SVG_STATUS_NO_MEMORY;
+    }
+    while (prefetch->num_threads < threads &&
+	   pthread_create (&prefetch->threads[prefetch->num_threads], NULL,
+			   _svg_prefetch_worker, prefetch) == 0)
+	prefetch->num_threads++;
+
+    /* without any thread to do it, the render decodes as before */
+    svg->prefetch = prefetch;
+
+    return SVG_STATUS_SUCCESS;
+}
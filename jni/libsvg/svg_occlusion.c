@@ -0,0 +1,275 @@
+/* svg_occlusion.c: Finding elements hidden behind opaque ones
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Before the root's children are drawn, the document is walked the
+   other way round, from the last element painted to the first. Each
+   device pixel an opaque rectangle covers completely is noted as it is
+   come across, and an element whose extents fall on noted pixels only
+   is marked to be skipped, it being painted over in full later on.
+
+   Only rectangles filled with an opaque color, that stay rectangles on
+   the device, hide anything. Whatever is in a nested <svg>, reached
+   through <use> or inside a group with a layer of its own can't hide
+   what is outside of it, and content <use> draws again elsewhere is
+   never skipped. Whole pixels are what makes this exact: where the
+   edges of two rectangles meet within a pixel, it isn't covered by
+   either, and what's below still shows through the seam. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "svgint.h"
+
+/* the most pixels the coverage is kept for, beyond which rectangles
+   hide nothing */
+#define SVG_OCCLUSION_MAX_PIXELS (16 * 1024 * 1024)
+
+typedef struct svg_occlusion {
+    svg_t *svg;
+    svg_render_engine_t *engine;
+    void *closure;
+
+    /* a byte per device pixel, set where it is covered */
+    unsigned char *covered;
+    unsigned int width;
+    unsigned int height;
+} svg_occlusion_t;
+
+static int
+_svg_occlusion_is_covered (svg_occlusion_t *occlusion, const svg_bounding_box_t *box)
+{
+    unsigned int y;
+
+    if (box->right <= box->left || box->bottom <= box->top ||
+	box->right > occlusion->width || box->bottom > occlusion->height)
+	return 0;
+
+    for (y = box->top; y < box->bottom; y++)
+	if (memchr (occlusion->covered + (size_t) y * occlusion->width + box->left,
+		    0, box->right - box->left))
+	    return 0;
+
+    return 1;
+}
+
+/* Makes room for coverage up to right and bottom, by half again as
+   much each time so that growing it stays rare */
+static int
+_svg_occlusion_reserve (svg_occlusion_t *occlusion, unsigned int right, unsigned int bottom)
+{
+    unsigned char *covered;
+    unsigned int width, height, y;
+
+    if (right <= occlusion->width && bottom <= occlusion->height)
+	return 1;
+
+    width = occlusion->width + occlusion->width / 2;
+    height = occlusion->height + occlusion->height / 2;
+    if (width < right)
+	width = right;
+    if (height < bottom)
+	height = bottom;
+    if ((double) width * height > SVG_OCCLUSION_MAX_PIXELS) {
+	width = right > occlusion->width ? right : occlusion->width;
+	height = bottom > occlusion->height ? bottom : occlusion->height;
+	if ((double) width * height > SVG_OCCLUSION_MAX_PIXELS)
+	    return 0;
+    }
+
+    covered = calloc ((size_t) width * height, 1);
+    if (covered == NULL)
+	return 0;
+
+    for (y = 0; y < occlusion->height; y++)
+	memcpy (covered + (size_t) y * width,
+		occlusion->covered + (size_t) y * occlusion->width,
+		occlusion->width);
+    free (occlusion->covered);
+
+    occlusion->covered = covered;
+    occlusion->width = width;
+    occlusion->height = height;
+
+    return 1;
+}
+
+static void
+_svg_occlusion_cover (svg_occlusion_t *occlusion, const svg_bounding_box_t *box)
+{
+    unsigned int y;
+
+    if (box->right <= box->left || box->bottom <= box->top ||
+	! _svg_occlusion_reserve (occlusion, box->right, box->bottom))
+	return;
+
+    for (y = box->top; y < box->bottom; y++)
+	memset (occlusion->covered + (size_t) y * occlusion->width + box->left,
+		1, box->right - box->left);
+}
+
+/* Whether the rect element paints all of itself in an opaque color,
+   going by the document tree as the splats do. Its stroke can only
+   add to that. */
+static int
+_svg_occlusion_is_opaque_rect (svg_element_t *element)
+{
+    svg_rect_element_t *rect = &element->e.rect;
+    svg_paint_t *fill = NULL;
+    double fill_opacity = 1.0;
+    int have_fill_opacity = 0;
+    svg_element_t *e;
+
+    if (rect->rx.value != 0 || rect->ry.value != 0 ||
+	element->style.opacity != 1.0 ||
+	_svg_style_get_visibility (&element->style))
+	return 0;
+
+    for (e = element; e && e != SVG_DELETED_ELEMENT_OBJECT; e = e->parent) {
+	if (fill == NULL && (e->style.flags & SVG_STYLE_FLAG_FILL_PAINT))
+	    fill = &e->style.fill_paint;
+	if (! have_fill_opacity && (e->style.flags & SVG_STYLE_FLAG_FILL_OPACITY)) {
+	    fill_opacity = e->style.fill_opacity;
+	    have_fill_opacity = 1;
+	}
+    }
+
+    /* no fill at all is black */
+    return (fill == NULL || fill->type == SVG_PAINT_TYPE_COLOR) && fill_opacity >= 1.0;
+}
+
+/* Same test as the render's, with some room for the box having been
+   worked out in a different space */
+static int
+_svg_occlusion_is_below_lod (svg_t *svg, const svg_bounding_box_t *box)
+{
+    return svg->lod != SVG_LOD_NONE &&
+	box->right - box->left <= svg->lod_threshold + 2 &&
+	box->bottom - box->top <= svg->lod_threshold + 2;
+}
+
+/* ctm maps element's parent's user space to the engine's. opaque is 0
+   inside groups with a layer. */
+static void
+_svg_occlusion_walk (svg_occlusion_t	*occlusion,
+		     svg_element_t	*element,
+		     const svg_transform_t *ctm,
+		     int		opaque,
+		     int		referenced)
+{
+    svg_t *svg = occlusion->svg;
+    svg_extents_state_t extents_state;
+    svg_transform_t transform;
+    svg_rect_t extents, rect;
+    svg_bounding_box_t box;
+    int i;
+
+    if (_svg_style_get_display (&element->style))
+	return;
+
+    switch (element->type) {
+    case SVG_ELEMENT_TYPE_GROUP:
+    case SVG_ELEMENT_TYPE_USE:
+    case SVG_ELEMENT_TYPE_PATH:
+    case SVG_ELEMENT_TYPE_CIRCLE:
+    case SVG_ELEMENT_TYPE_ELLIPSE:
+    case SVG_ELEMENT_TYPE_LINE:
+    case SVG_ELEMENT_TYPE_RECT:
+    case SVG_ELEMENT_TYPE_TEXT:
+    case SVG_ELEMENT_TYPE_IMAGE:
+	break;
+    default:
+	/* nested viewports, and what isn't drawn where it is */
+	return;
+    }
+
+    if (element->ref_count)
+	referenced = 1;
+
+    extents_state = _svg_element_get_extents (element, &extents);
+    if (extents_state == SVG_EXTENTS_EMPTY)
+	return;
+    if (extents_state == SVG_EXTENTS_VALID) {
+	_svg_transform_bound_rect (ctm, &extents, &rect);
+	if (! occlusion->engine->get_rect_bounding_box (occlusion->closure, &rect, &box))
+	    return;
+	if (! referenced && _svg_occlusion_is_covered (occlusion, &box)) {
+	    element->occluded_serial = svg->render_serial;
+	    return;
+	}
+    }
+
+    switch (element->type) {
+    case SVG_ELEMENT_TYPE_GROUP:
+	if (element->e.group.view_box.aspect_ratio != SVG_PRESERVE_ASPECT_RATIO_UNKNOWN)
+	    return;
+	if (_svg_style_get_opacity (&element->style) != 1.0)
+	    opaque = 0;
+	transform = *ctm;
+	_svg_transform_multiply_into_right (&element->transform, &transform);
+	for (i = element->e.group.num_elements - 1; i >= 0; i--)
+	    _svg_occlusion_walk (occlusion, element->e.group.element[i],
+				 &transform, opaque, referenced);
+	break;
+
+    case SVG_ELEMENT_TYPE_RECT:
+	transform = *ctm;
+	_svg_transform_multiply_into_right (&element->transform, &transform);
+	if (! opaque || extents_state != SVG_EXTENTS_VALID ||
+	    transform.m[0][1] != 0.0 || transform.m[1][0] != 0.0 ||
+	    _svg_occlusion_is_below_lod (svg, &box) ||
+	    ! _svg_occlusion_is_opaque_rect (element) ||
+	    ! _svg_extents_length (svg, &element->e.rect.x, &rect.x) ||
+	    ! _svg_extents_length (svg, &element->e.rect.y, &rect.y) ||
+	    ! _svg_extents_length (svg, &element->e.rect.width, &rect.width) ||
+	    ! _svg_extents_length (svg, &element->e.rect.height, &rect.height) ||
+	    rect.width <= 0.0 || rect.height <= 0.0)
+	    return;
+	_svg_transform_bound_rect (&transform, &rect, &rect);
+	if (occlusion->engine->get_rect_covered_box (occlusion->closure, &rect, &box))
+	    _svg_occlusion_cover (occlusion, &box);
+	break;
+
+    default:
+	break;
+    }
+}
+
+void
+_svg_occlusion_mark (svg_element_t		*group_element,
+		     svg_render_engine_t	*engine,
+		     void			*closure)
+{
+    svg_occlusion_t occlusion;
+    svg_transform_t identity;
+    svg_group_t *group = &group_element->e.group;
+    int i;
+
+    occlusion.svg = group_element->doc;
+    occlusion.engine = engine;
+    occlusion.closure = closure;
+    occlusion.covered = NULL;
+    occlusion.width = 0;
+    occlusion.height = 0;
+
+    /* the engine is in the user space of group's children already */
+    _svg_transform_init (&identity);
+    for (i = group->num_elements - 1; i >= 0; i--)
+	_svg_occlusion_walk (&occlusion, group->element[i], &identity, 1, 0);
+
+    free (occlusion.covered);
+}
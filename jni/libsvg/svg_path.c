@@ -262,7 +262,7 @@ _svg_path_destroy (svg_render_engine_t *engine, void *closure, svg_path_t *path)
     svg_status_t status;
 
     if(path->cache)
-	    engine->free_path_cache(closure, path->cache);
+	    engine->free_path_cache(closure, &path->cache);
     
     status = _svg_path_deinit (path);
 
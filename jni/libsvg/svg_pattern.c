@@ -118,3 +118,54 @@ _svg_pattern_apply_attributes (svg_pattern_t	*pattern,
     
     return SVG_STATUS_SUCCESS;
 }
+
+/* Sets the style element and its ancestors have for their children,
+   from the root down. Opacity isn't inherited, it is drawn by the
+   layer of each group. */
+static svg_status_t
+_svg_pattern_render_inherited_style (svg_element_t		*element,
+				     svg_render_engine_t	*engine,
+				     void			*closure)
+{
+    svg_style_t style;
+    svg_status_t status;
+
+    if (element == NULL || element == SVG_DELETED_ELEMENT_OBJECT)
+	return SVG_STATUS_SUCCESS;
+
+    status = _svg_pattern_render_inherited_style (element->parent, engine, closure);
+    if (status)
+	return status;
+
+    style = element->style;
+    style.flags &= ~SVG_STYLE_FLAG_OPACITY;
+
+    return _svg_style_render (&style, engine, closure);
+}
+
+/* The content of a pattern inherits its style from the ancestors of
+   the <pattern>, not from whatever is painted with it, so it is drawn
+   the same for everything it paints. It isn't culled, as it is drawn
+   with a style its extents don't know about where it sits in the
+   document, much like what a <use> draws. */
+svg_status_t
+svg_pattern_render (svg_element_t	*element,
+		    svg_render_engine_t	*engine,
+		    void		*closure)
+{
+    svg_t *svg = element->doc;
+    svg_status_t status;
+
+    if (element->type != SVG_ELEMENT_TYPE_PATTERN)
+	return SVG_STATUS_INVALID_VALUE;
+
+    status = _svg_pattern_render_inherited_style (element, engine, closure);
+    if (status)
+	return status;
+
+    svg->use_depth++;
+    status = svg_element_render (element->e.pattern.group_element, engine, closure);
+    svg->use_depth--;
+
+    return status;
+}
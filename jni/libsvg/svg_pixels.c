@@ -0,0 +1,307 @@
+/* svg_pixels.c: Converting pixels between layouts
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Every conversion comes in plain C, which the others finish off and
+   give exactly the same results as, and as NEON on armeabi-v7a or
+   SSE2 and SSSE3 on x86 where the CPU has it, picked the first time
+   one is called.
+
+   Dividing by 255 takes a shift and an add. Dividing by alpha takes a
+   multiply by its reciprocal from a table: 2^31 / alpha rounded up,
+   exact over 16-bit numerators, for plain C, and a float a little
+   over 1 / alpha, exact to the same integer once truncated, for the
+   vectors, which have a float multiply but no 32 by 32 bit one. Runs
+   of opaque or clear pixels take neither. */
+
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__ANDROID__) || defined(ANDROID)
+#include <cpu-features.h>
+#define SVG_PIXELS_CPU_HAS(family, feature) \
+    (android_getCpuFamily () == (family) && (android_getCpuFeatures () & (feature)))
+#else
+/* built for it is as good as having it */
+#define SVG_PIXELS_CPU_HAS(family, feature) 1
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "svg_pixels.h"
+
+float _svg_pixels_reciprocal[256];
+static uint32_t _svg_pixels_reciprocal_31[256];
+
+/* how many pixels from the start the fastest the CPU has converts */
+static unsigned int (*_svg_pixels_premultiply_fast) (unsigned char *, unsigned int);
+static unsigned int (*_svg_pixels_argb32_to_rgba8888_fast) (unsigned char *, unsigned int);
+
+static pthread_once_t _svg_pixels_once = PTHREAD_ONCE_INIT;
+
+/* t / 255 rounded down, for t up to 255 * 255 */
+#define SVG_PIXELS_DIV_255(t) (((t) + 1 + ((t) >> 8)) >> 8)
+
+static void
+_svg_pixels_premultiply_c (unsigned char *data, unsigned int num_pixels)
+{
+    unsigned int i, alpha;
+
+    for (i = 0; i < num_pixels; i++, data += 4) {
+	alpha = data[3];
+	if (alpha == 0xff)
+	    continue;
+	if (alpha == 0) {
+	    data[0] = data[1] = data[2] = 0;
+	    continue;
+	}
+	data[0] = SVG_PIXELS_DIV_255 (data[0] * alpha);
+	data[1] = SVG_PIXELS_DIV_255 (data[1] * alpha);
+	data[2] = SVG_PIXELS_DIV_255 (data[2] * alpha);
+    }
+}
+
+static unsigned int
+_svg_pixels_unpremultiply_c (uint32_t color, uint32_t alpha)
+{
+    uint32_t value;
+
+    value = ((uint64_t) (color * 0xff + alpha / 2) * _svg_pixels_reciprocal_31[alpha]) >> 31;
+
+    return value > 0xff ? 0xff : value;
+}
+
+static void
+_svg_pixels_argb32_to_rgba8888_c (unsigned char *data, unsigned int num_pixels)
+{
+    uint32_t pixel, alpha;
+    unsigned int i;
+
+    for (i = 0; i < num_pixels; i++, data += 4) {
+	pixel = *(uint32_t *) data;
+	alpha = pixel >> 24;
+	if (alpha == 0) {
+	    data[0] = data[1] = data[2] = data[3] = 0;
+	} else if (alpha == 0xff) {
+	    data[0] = pixel >> 16;
+	    data[1] = pixel >> 8;
+	    data[2] = pixel;
+	    data[3] = 0xff;
+	} else {
+	    data[0] = _svg_pixels_unpremultiply_c ((pixel >> 16) & 0xff, alpha);
+	    data[1] = _svg_pixels_unpremultiply_c ((pixel >> 8) & 0xff, alpha);
+	    data[2] = _svg_pixels_unpremultiply_c (pixel & 0xff, alpha);
+	    data[3] = alpha;
+	}
+    }
+}
+
+#ifdef __SSE2__
+
+static unsigned int
+_svg_pixels_premultiply_sse2 (unsigned char *data, unsigned int num_pixels)
+{
+    const __m128i alpha_mask = _mm_set1_epi32 (0xff000000);
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i one = _mm_set1_epi16 (1);
+    __m128i pixels, alpha, lo, hi;
+    unsigned int i;
+
+    for (i = 0; i + 4 <= num_pixels; i += 4, data += 16) {
+	pixels = _mm_loadu_si128 ((__m128i *) data);
+	alpha = _mm_and_si128 (pixels, alpha_mask);
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, alpha_mask)) == 0xffff)
+	    continue;
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, zero)) == 0xffff) {
+	    _mm_storeu_si128 ((__m128i *) data, zero);
+	    continue;
+	}
+
+	/* two pixels to each half, alpha spread over all four words */
+	lo = _mm_unpacklo_epi8 (pixels, zero);
+	hi = _mm_unpackhi_epi8 (pixels, zero);
+	lo = _mm_mullo_epi16 (lo, _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (lo, 0xff), 0xff));
+	hi = _mm_mullo_epi16 (hi, _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (hi, 0xff), 0xff));
+	lo = _mm_srli_epi16 (_mm_add_epi16 (_mm_add_epi16 (lo, one), _mm_srli_epi16 (lo, 8)), 8);
+	hi = _mm_srli_epi16 (_mm_add_epi16 (_mm_add_epi16 (hi, one), _mm_srli_epi16 (hi, 8)), 8);
+
+	/* alpha itself stays as it is */
+	pixels = _mm_or_si128 (_mm_andnot_si128 (alpha_mask, _mm_packus_epi16 (lo, hi)), alpha);
+	_mm_storeu_si128 ((__m128i *) data, pixels);
+    }
+
+    return i;
+}
+
+/* The colors of four pixels, each in a 32-bit word of its own */
+#define SVG_PIXELS_SSE2_CHANNEL(pixels, shift) \
+    _mm_and_si128 (_mm_srli_epi32 ((pixels), (shift)), _mm_set1_epi32 (0xff))
+
+/* (c * 255 + alpha / 2) / alpha, over 255 where c is over alpha */
+static __m128i
+_svg_pixels_unpremultiply_sse2 (__m128i color, __m128i half, __m128 reciprocal)
+{
+    color = _mm_add_epi32 (_mm_sub_epi32 (_mm_slli_epi32 (color, 8), color), half);
+
+    return _mm_cvttps_epi32 (_mm_mul_ps (_mm_cvtepi32_ps (color), reciprocal));
+}
+
+/* Four pixels with straight R, G, B, A in 32-bit words, packed down to
+   bytes, at most 255, and grouped by color */
+static __m128i
+_svg_pixels_unpremultiply_four_sse2 (const unsigned char *data, __m128i pixels, __m128i alpha)
+{
+    __m128i red, green, blue, half;
+    __m128 reciprocal;
+
+    red = SVG_PIXELS_SSE2_CHANNEL (pixels, 16);
+    green = SVG_PIXELS_SSE2_CHANNEL (pixels, 8);
+    blue = SVG_PIXELS_SSE2_CHANNEL (pixels, 0);
+
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, _mm_set1_epi32 (0xff))) != 0xffff) {
+	reciprocal = _mm_set_ps (_svg_pixels_reciprocal[data[15]],
+				 _svg_pixels_reciprocal[data[11]],
+				 _svg_pixels_reciprocal[data[7]],
+				 _svg_pixels_reciprocal[data[3]]);
+	half = _mm_srli_epi32 (alpha, 1);
+	red = _svg_pixels_unpremultiply_sse2 (red, half, reciprocal);
+	green = _svg_pixels_unpremultiply_sse2 (green, half, reciprocal);
+	blue = _svg_pixels_unpremultiply_sse2 (blue, half, reciprocal);
+    }
+
+    /* r0 r1 r2 r3 g0 g1 g2 g3 b0 b1 b2 b3 a0 a1 a2 a3 */
+    return _mm_packus_epi16 (_mm_packs_epi32 (red, green), _mm_packs_epi32 (blue, alpha));
+}
+
+static unsigned int
+_svg_pixels_argb32_to_rgba8888_sse2 (unsigned char *data, unsigned int num_pixels)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    __m128i pixels, alpha, planes, rg, ba;
+    unsigned int i;
+
+    for (i = 0; i + 4 <= num_pixels; i += 4, data += 16) {
+	pixels = _mm_loadu_si128 ((__m128i *) data);
+	alpha = _mm_srli_epi32 (pixels, 24);
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, zero)) == 0xffff) {
+	    _mm_storeu_si128 ((__m128i *) data, zero);
+	    continue;
+	}
+
+	planes = _svg_pixels_unpremultiply_four_sse2 (data, pixels, alpha);
+	rg = _mm_unpacklo_epi8 (planes, _mm_srli_si128 (planes, 4));
+	ba = _mm_unpacklo_epi8 (_mm_srli_si128 (planes, 8), _mm_srli_si128 (planes, 12));
+	_mm_storeu_si128 ((__m128i *) data, _mm_unpacklo_epi16 (rg, ba));
+    }
+
+    return i;
+}
+
+#endif /* __SSE2__ */
+
+#ifdef __SSSE3__
+
+static unsigned int
+_svg_pixels_argb32_to_rgba8888_ssse3 (unsigned char *data, unsigned int num_pixels)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i opaque = _mm_set1_epi32 (0xff000000);
+    /* B, G, R, A bytes of each pixel to R, G, B, A */
+    const __m128i swap = _mm_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    /* four bytes of each color to the four bytes of each pixel */
+    const __m128i interleave = _mm_setr_epi8 (0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    __m128i pixels, alpha;
+    unsigned int i;
+
+    for (i = 0; i + 4 <= num_pixels; i += 4, data += 16) {
+	pixels = _mm_loadu_si128 ((__m128i *) data);
+	alpha = _mm_and_si128 (pixels, opaque);
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, opaque)) == 0xffff) {
+	    _mm_storeu_si128 ((__m128i *) data, _mm_shuffle_epi8 (pixels, swap));
+	    continue;
+	}
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (alpha, zero)) == 0xffff) {
+	    _mm_storeu_si128 ((__m128i *) data, zero);
+	    continue;
+	}
+
+	pixels = _svg_pixels_unpremultiply_four_sse2 (data, pixels, _mm_srli_epi32 (pixels, 24));
+	_mm_storeu_si128 ((__m128i *) data, _mm_shuffle_epi8 (pixels, interleave));
+    }
+
+    return i;
+}
+
+#endif /* __SSSE3__ */
+
+static void
+_svg_pixels_init (void)
+{
+    unsigned int alpha;
+
+    _svg_pixels_reciprocal[0] = 0;
+    _svg_pixels_reciprocal_31[0] = 0;
+    for (alpha = 1; alpha < 256; alpha++) {
+	_svg_pixels_reciprocal[alpha] = (1.0f / alpha) * (1.0f + 1.0f / (1 << 18));
+	_svg_pixels_reciprocal_31[alpha] = ((1ull << 31) + alpha - 1) / alpha;
+    }
+
+#ifdef SVG_PIXELS_NEON
+    if (SVG_PIXELS_CPU_HAS (ANDROID_CPU_FAMILY_ARM, ANDROID_CPU_ARM_FEATURE_NEON)) {
+	_svg_pixels_premultiply_fast = _svg_pixels_premultiply_neon;
+	_svg_pixels_argb32_to_rgba8888_fast = _svg_pixels_argb32_to_rgba8888_neon;
+    }
+#endif
+
+#ifdef __SSE2__
+    _svg_pixels_premultiply_fast = _svg_pixels_premultiply_sse2;
+    _svg_pixels_argb32_to_rgba8888_fast = _svg_pixels_argb32_to_rgba8888_sse2;
+#endif
+#ifdef __SSSE3__
+    if (SVG_PIXELS_CPU_HAS (ANDROID_CPU_FAMILY_X86, ANDROID_CPU_X86_FEATURE_SSSE3))
+	_svg_pixels_argb32_to_rgba8888_fast = _svg_pixels_argb32_to_rgba8888_ssse3;
+#endif
+}
+
+void
+_svg_pixels_premultiply (unsigned char *data, unsigned int num_pixels)
+{
+    unsigned int done = 0;
+
+    pthread_once (&_svg_pixels_once, _svg_pixels_init);
+
+    if (_svg_pixels_premultiply_fast)
+	done = _svg_pixels_premultiply_fast (data, num_pixels);
+    _svg_pixels_premultiply_c (data + done * 4, num_pixels - done);
+}
+
+void
+_svg_pixels_argb32_to_rgba8888 (unsigned char *data, unsigned int num_pixels)
+{
+    unsigned int done = 0;
+
+    pthread_once (&_svg_pixels_once, _svg_pixels_init);
+
+    if (_svg_pixels_argb32_to_rgba8888_fast)
+	done = _svg_pixels_argb32_to_rgba8888_fast (data, num_pixels);
+    _svg_pixels_argb32_to_rgba8888_c (data + done * 4, num_pixels - done);
+}
@@ -0,0 +1,50 @@
+/* svg_pixels.h: Converting pixels between layouts
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef SVG_PIXELS_H
+#define SVG_PIXELS_H
+
+/* Shared by libsvg, which premultiplies what it decodes, and
+   libsvg-cairo, which unpremultiplies what it writes out. Pixels are
+   four bytes each, converted in place, and need no alignment. */
+
+/* Straight alpha, in the fourth byte of each pixel, to premultiplied:
+   each of the other three becomes c * alpha / 255, rounded down */
+void
+_svg_pixels_premultiply (unsigned char *data, unsigned int num_pixels);
+
+/* Premultiplied native-endian ARGB32 words to R, G, B, A bytes with
+   straight alpha: each color becomes (c * 255 + alpha / 2) / alpha, at
+   most 255, and all of a pixel with no alpha 0 */
+void
+_svg_pixels_argb32_to_rgba8888 (unsigned char *data, unsigned int num_pixels);
+
+/* svg_pixels_neon.c, built for armeabi-v7a only. These convert a
+   multiple of 8 pixels from the start and return how many, the rest is
+   left for plain C. */
+
+/* 1 / alpha, a little over, and 0 for no alpha */
+extern float _svg_pixels_reciprocal[256];
+
+unsigned int
+_svg_pixels_premultiply_neon (unsigned char *data, unsigned int num_pixels);
+
+unsigned int
+_svg_pixels_argb32_to_rgba8888_neon (unsigned char *data, unsigned int num_pixels);
+
+#endif
@@ -0,0 +1,123 @@
+/* svg_pixels_neon.c: Converting pixels between layouts with NEON
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/* Eight pixels at a time, their bytes loaded into four vectors, one
+   for each place in a pixel, so that all eight alphas are in one and
+   reordering is a matter of storing the vectors in another order. */
+
+#include <stdint.h>
+#include <arm_neon.h>
+
+#include "svg_pixels.h"
+
+unsigned int
+_svg_pixels_premultiply_neon (unsigned char *data, unsigned int num_pixels)
+{
+    const uint16x8_t one = vdupq_n_u16 (1);
+    uint8x8x4_t pixels;
+    uint16x8_t product;
+    uint64_t alpha;
+    unsigned int i;
+    int k;
+
+    for (i = 0; i + 8 <= num_pixels; i += 8, data += 32) {
+	pixels = vld4_u8 (data);
+	alpha = vget_lane_u64 (vreinterpret_u64_u8 (pixels.val[3]), 0);
+	if (alpha == ~(uint64_t) 0)
+	    continue;
+	if (alpha == 0) {
+	    vst1q_u8 (data, vdupq_n_u8 (0));
+	    vst1q_u8 (data + 16, vdupq_n_u8 (0));
+	    continue;
+	}
+
+	/* c * alpha / 255 as in svg_pixels.c */
+	for (k = 0; k < 3; k++) {
+	    product = vmull_u8 (pixels.val[k], pixels.val[3]);
+	    product = vaddq_u16 (vaddq_u16 (product, one), vshrq_n_u16 (product, 8));
+	    pixels.val[k] = vshrn_n_u16 (product, 8);
+	}
+	vst4_u8 (data, pixels);
+    }
+
+    return i;
+}
+
+/* numerator / alpha for four colors, truncated */
+static uint16x4_t
+_svg_pixels_divide_neon (uint16x4_t numerator, float32x4_t reciprocal)
+{
+    uint32x4_t quotient;
+
+    quotient = vcvtq_u32_f32 (vmulq_f32 (vcvtq_f32_u32 (vmovl_u16 (numerator)), reciprocal));
+
+    return vqmovn_u32 (quotient);
+}
+
+unsigned int
+_svg_pixels_argb32_to_rgba8888_neon (unsigned char *data, unsigned int num_pixels)
+{
+    const uint8x8_t max = vdup_n_u8 (0xff);
+    uint8x8x4_t pixels, rgba;
+    float32x4_t reciprocal_lo, reciprocal_hi;
+    uint16x8_t numerator;
+    uint64_t alpha;
+    unsigned int i;
+    int k;
+
+    for (i = 0; i + 8 <= num_pixels; i += 8, data += 32) {
+	/* B, G, R, A in memory */
+	pixels = vld4_u8 (data);
+	alpha = vget_lane_u64 (vreinterpret_u64_u8 (pixels.val[3]), 0);
+	if (alpha == 0) {
+	    vst1q_u8 (data, vdupq_n_u8 (0));
+	    vst1q_u8 (data + 16, vdupq_n_u8 (0));
+	    continue;
+	}
+
+	rgba.val[0] = pixels.val[2];
+	rgba.val[1] = pixels.val[1];
+	rgba.val[2] = pixels.val[0];
+	rgba.val[3] = pixels.val[3];
+
+	if (alpha != ~(uint64_t) 0) {
+	    reciprocal_lo = vdupq_n_f32 (0);
+	    reciprocal_lo = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[3]], reciprocal_lo, 0);
+	    reciprocal_lo = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[7]], reciprocal_lo, 1);
+	    reciprocal_lo = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[11]], reciprocal_lo, 2);
+	    reciprocal_lo = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[15]], reciprocal_lo, 3);
+	    reciprocal_hi = vdupq_n_f32 (0);
+	    reciprocal_hi = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[19]], reciprocal_hi, 0);
+	    reciprocal_hi = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[23]], reciprocal_hi, 1);
+	    reciprocal_hi = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[27]], reciprocal_hi, 2);
+	    reciprocal_hi = vld1q_lane_f32 (&_svg_pixels_reciprocal[data[31]], reciprocal_hi, 3);
+
+	    /* (c * 255 + alpha / 2) / alpha, saturated to 255 where c
+	       is over alpha */
+	    for (k = 0; k < 3; k++) {
+		numerator = vmlal_u8 (vmovl_u8 (vshr_n_u8 (rgba.val[3], 1)), rgba.val[k], max);
+		rgba.val[k] = vqmovn_u16 (vcombine_u16 (
+		    _svg_pixels_divide_neon (vget_low_u16 (numerator), reciprocal_lo),
+		    _svg_pixels_divide_neon (vget_high_u16 (numerator), reciprocal_hi)));
+	    }
+	}
+	vst4_u8 (data, rgba);
+    }
+
+    return i;
+}
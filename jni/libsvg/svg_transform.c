@@ -208,6 +208,37 @@ _svg_transform_multiply_into_right (const svg_transform_t *t1, svg_transform_t *
     return status;
 }
 
+/* The box around rect, once transform maps it */
+void
+_svg_transform_bound_rect (const svg_transform_t *transform,
+			   const svg_rect_t	 *rect,
+			   svg_rect_t		 *result)
+{
+    double x[4] = { rect->x, rect->x + rect->width, rect->x, rect->x + rect->width };
+    double y[4] = { rect->y, rect->y, rect->y + rect->height, rect->y + rect->height };
+    double tx, ty, x1, y1, x2, y2;
+    int i;
+
+    x1 = x2 = y1 = y2 = 0;
+    for (i = 0; i < 4; i++) {
+	tx = transform->m[0][0] * x[i] + transform->m[1][0] * y[i] + transform->m[2][0];
+	ty = transform->m[0][1] * x[i] + transform->m[1][1] * y[i] + transform->m[2][1];
+	if (i == 0 || tx < x1)
+	    x1 = tx;
+	if (i == 0 || tx > x2)
+	    x2 = tx;
+	if (i == 0 || ty < y1)
+	    y1 = ty;
+	if (i == 0 || ty > y2)
+	    y2 = ty;
+    }
+
+    result->x = x1;
+    result->y = y1;
+    result->width = x2 - x1;
+    result->height = y2 - y1;
+}
+
 static svg_status_t
 _svg_transform_multiply (svg_transform_t	*result,
 			 const svg_transform_t	*t1,
@@ -29,6 +29,8 @@ extern "C" {
 
 #include <expat.h>
 #include "strhmap_cc.h"
+#include <stddef.h>
+#include <sys/types.h>
 
 typedef XML_Char xmlChar;
 typedef XML_Parser svg_xml_parser_context_t;
@@ -37,6 +39,7 @@ typedef XML_Parser svg_xml_parser_context_t;
 #include "svg_version.h"
 #include "svg.h"
 #include "svg_ascii.h"
+#include "svg_pixels.h"
 
 #define container_of(ptr, type, member) ({ \
 	const typeof( ((type *)0)->member ) *__mptr = (ptr);  \
@@ -257,12 +260,47 @@ typedef struct svg_rect_element {
     svg_length_t ry;
 } svg_rect_element_t;
 
+/* Decoded ARGB32 pixels, premultiplied, shared through the image
+   cache. Level n is the image box filtered down to 1/2^n of its
+   natural size, rounding up. */
+#define SVG_IMAGE_MAX_LEVEL 3
+
+typedef struct svg_image_data {
+    char *data;
+    unsigned int width;
+    unsigned int height;
+    unsigned int level;
+    unsigned int natural_width;
+    unsigned int natural_height;
+
+    /* the cache's, see svg_image_cache.c */
+    char *path;
+    time_t mtime;
+    off_t size;
+    size_t bytes;
+    unsigned int ref_count;
+    int stale;
+    /* still being decoded, for a target of this size, and how that
+       went once done */
+    int pending;
+    unsigned int target_width;
+    unsigned int target_height;
+    svg_status_t status;
+    struct svg_image_data *prev;
+    struct svg_image_data *next;
+} svg_image_data_t;
+
+/* Decodes filename at the level that still covers target_width x
+   target_height pixels, or at its natural size for a 0 target */
+typedef svg_status_t (*svg_image_decode_func_t) (const char		*filename,
+						 unsigned int		target_width,
+						 unsigned int		target_height,
+						 svg_image_data_t	*image);
+
 typedef struct svg_image {
     char *url;
 
-    char *data;
-    unsigned int data_width;
-    unsigned int data_height;
+    svg_image_data_t *data;
 
     /* User-space position and size */
     svg_length_t x;
@@ -271,6 +309,21 @@ typedef struct svg_image {
     svg_length_t height;
 } svg_image_t;
 
+/* A color averaged over an area, premultiplied by its alpha */
+typedef struct svg_splat {
+    double red;
+    double green;
+    double blue;
+    double alpha;
+} svg_splat_t;
+
+/* State of the cached user-space extents of an element */
+typedef enum svg_extents_state {
+    SVG_EXTENTS_UNKNOWN,	/* can't be resolved without the render engine */
+    SVG_EXTENTS_EMPTY,		/* element draws nothing */
+    SVG_EXTENTS_VALID
+} svg_extents_state_t;
+
 typedef enum svg_element_type {
     SVG_ELEMENT_TYPE_SVG_GROUP,
     SVG_ELEMENT_TYPE_GROUP,
@@ -303,6 +356,26 @@ struct svg_element {
 	svg_bounding_box_t bounding_box;
     svg_element_type_t type;
 
+	/* extents in the parent's user space, valid while extents_serial
+	   matches doc->extents_serial */
+	svg_rect_t extents;
+	svg_extents_state_t extents_state;
+	unsigned int extents_serial;
+
+	/* what the element averages out to over its extents, valid while
+	   splat_serial matches doc->extents_serial */
+	svg_splat_t splat;
+	int has_splat;
+	unsigned int splat_serial;
+
+	/* painted over by what comes after it in the render with this
+	   doc->render_serial */
+	unsigned int occluded_serial;
+
+	/* added or changed since the last render while this matches
+	   doc->damage_serial, see svg_damage.c */
+	unsigned int damaged_serial;
+
 	int ref_count, do_events;
 	struct svg_element *next_event;
 	
@@ -362,6 +435,28 @@ struct svg_parser {
     svg_status_t status;
 };
 
+typedef struct svg_prefetch svg_prefetch_t;
+
+typedef struct svg_event_cell {
+    svg_element_t **element;
+    int num_elements;
+    int element_size;
+} svg_event_cell_t;
+
+/* the event stack by where its elements are on the device, see
+   svg_event.c */
+typedef struct svg_event_index {
+    int valid;
+    /* device pixel the first cell starts at */
+    int x, y;
+    int cell_size;
+    int cols, rows;
+    svg_event_cell_t *cells;
+} svg_event_index_t;
+
+/* damage made of more boxes than this is merged into one */
+#define SVG_DAMAGE_MAX_BOXES 16
+
 struct svg {
     double dpi;
 
@@ -369,6 +464,7 @@ struct svg {
 
     svg_element_t *group_element;
 	svg_element_t *event_stack;
+	svg_event_index_t event_index;
 
     StrHmap *element_ids;
 
@@ -377,6 +473,39 @@ struct svg {
     svg_render_engine_t *engine;
 
 	int do_path_cache;
+
+	unsigned int extents_serial;
+	svg_render_stats_t render_stats;
+
+	/* opacity of a layerless group, waiting for its only child */
+	double fold_opacity;
+
+	/* how many <use>s and patterns what is being rendered is drawn
+	   through, which it inherits its style from */
+	int use_depth;
+
+	svg_lod_t lod;
+	double lod_threshold;
+
+	int occlusion_culling;
+	/* counts calls to svg_render */
+	unsigned int render_serial;
+
+	/* device boxes svg_render_damage is to draw again, on top of
+	   the elements flagged with damage_serial */
+	svg_bounding_box_t damage[SVG_DAMAGE_MAX_BOXES];
+	int num_damage;
+	int damage_all;
+	unsigned int damage_serial;
+	unsigned int num_damaged;
+	int rendering_damage;
+	/* the box being drawn again */
+	int damage_pass;
+
+	double image_scale;
+
+	/* images still being decoded by svg_prefetch_images */
+	svg_prefetch_t *prefetch;
 };
 
 /* svg.c */
@@ -432,8 +561,59 @@ _svg_color_init_from_str (svg_color_t *color, const char *str);
 svg_status_t
 _svg_color_deinit (svg_color_t *color);
 
+/* svg_damage.c */
+
+void
+_svg_damage_drawn (svg_element_t *element);
+
+void
+_svg_damage_added (svg_element_t *element);
+
+svg_status_t
+_svg_damage_clip (svg_element_t		*group_element,
+		  svg_render_engine_t	*engine,
+		  void			*closure);
+
+int
+_svg_damage_is_pending (svg_t *svg);
+
+void
+_svg_damage_reset (svg_t *svg);
+
+/* svg_event.c */
+
+void
+_svg_event_index_init (svg_event_index_t *index);
+
+void
+_svg_event_index_fini (svg_event_index_t *index);
+
+void
+_svg_event_index_invalidate (svg_t *svg);
+
+void
+_svg_event_index_push (svg_t *svg, svg_element_t *element);
+
+void
+_svg_event_index_remove (svg_t *svg, svg_element_t *element);
+
+svg_element_t *
+_svg_event_index_find (svg_t *svg, int x, int y);
+
+/* svg_data_uri.c */
+
+int
+_svg_data_uri_is (const char *uri);
+
+svg_status_t
+_svg_data_uri_decode (const char	*uri,
+		      unsigned char	**data,
+		      size_t		*length);
+
 /* svg_element.c */
 
+extern svg_element_t *SVG_DELETED_ELEMENT_OBJECT;
+
 svgint_status_t
 _svg_element_create (svg_element_t	**element,
 		     svg_element_type_t	type,
@@ -485,6 +665,20 @@ _svg_element_parse_view_box (const char	*view_box_str,
 svg_status_t
 _svg_element_get_nearest_viewport (svg_element_t *element, svg_element_t **viewport);
 
+/* svg_extents.c */
+
+void
+_svg_extents_invalidate (svg_t *svg);
+
+svg_extents_state_t
+_svg_element_get_extents (svg_element_t *element, svg_rect_t *extents);
+
+int
+_svg_element_get_splat (svg_element_t *element, svg_splat_t *splat);
+
+int
+_svg_extents_length (svg_t *svg, svg_length_t *length, double *value);
+
 /* svg_gradient.c */
 
 svg_status_t
@@ -525,6 +719,9 @@ _svg_group_deinit (svg_group_t *group, int group_is_use_element);
 svg_status_t
 _svg_group_add_element (svg_group_t *group, svg_element_t *element);
 
+void
+_svg_group_drop_element (svg_group_t *group, svg_element_t *element);
+
 svg_status_t
 _svg_group_render (svg_group_t		*group,
 		   svg_render_engine_t	*engine,
@@ -567,9 +764,50 @@ _svg_image_apply_attributes (svg_image_t	*image,
 
 svg_status_t
 _svg_image_render (svg_image_t		*image,
+		   unsigned int		target_width,
+		   unsigned int		target_height,
 		   svg_render_engine_t	*engine,
 		   void			*closure);
 
+svg_status_t
+_svg_image_load (const char		*url,
+		 unsigned int		target_width,
+		 unsigned int		target_height,
+		 int			any_size,
+		 svg_image_data_t	**data);
+
+/* svg_image_cache.c */
+
+svg_status_t
+_svg_image_cache_load (const char		*filename,
+		       unsigned int		target_width,
+		       unsigned int		target_height,
+		       svg_image_decode_func_t	decode,
+		       int			any_size,
+		       svg_image_data_t		**image);
+
+unsigned int
+_svg_image_level (unsigned int width, unsigned int height,
+		  unsigned int target_width, unsigned int target_height);
+
+svg_image_data_t *
+_svg_image_data_reference (svg_image_data_t *image);
+
+void
+_svg_image_data_destroy (svg_image_data_t *image);
+
+/* svg_image_prefetch.c */
+
+void
+_svg_prefetch_destroy (svg_prefetch_t *prefetch);
+
+/* svg_occlusion.c */
+
+void
+_svg_occlusion_mark (svg_element_t		*group_element,
+		     svg_render_engine_t	*engine,
+		     void			*closure);
+
 /* svg_length.c */
 
 svg_status_t
@@ -959,6 +1197,11 @@ _svg_transform_multiply_into_left (svg_transform_t *t1, const svg_transform_t *t
 svg_status_t
 _svg_transform_multiply_into_right (const svg_transform_t *t1, svg_transform_t *t2);
 
+void
+_svg_transform_bound_rect (const svg_transform_t *transform,
+			   const svg_rect_t	 *rect,
+			   svg_rect_t		 *result);
+
 svg_status_t
 _svg_transform_render (svg_transform_t		*transform,
 		       svg_render_engine_t	*engine,
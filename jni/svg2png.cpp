@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define CAIRO_HAS_PNG_FUNCTIONS 1
 
@@ -38,11 +39,41 @@
 
 #define MIN(a, b)     (((a) < (b)) ? (a) : (b))
 
+/* Offscreen surfaces are kept from one render to the next, so that
+ * rendering images of the same size over and over doesn't allocate.
+ * A render that finds the pool busy on another thread uses the
+ * private one of its svg_cairo_t instead. */
+static svg_cairo_surface_pool_t *surface_pool = NULL;
+static pthread_mutex_t surface_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* How every PNG is encoded, as set by Svg2Png.setPngOptions and
+ * setPngThreads */
+static svg_cairo_png_options_t png_options = {
+    -1, SVG_CAIRO_PNG_STRATEGY_DEFAULT, SVG_CAIRO_PNG_FILTER_ADAPTIVE, 1, 1
+};
+static pthread_mutex_t png_options_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* How every JPEG is encoded, as set by Svg2Png.setJpegOptions */
+static svg_cairo_jpeg_options_t jpeg_options = { 90, 0xffffff };
+static pthread_mutex_t jpeg_options_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Encodes the rendered surface into file, as PNG or JPEG */
+typedef svg_cairo_status_t (*write_surface_func_t) (cairo_surface_t *surface, FILE *file);
+
+static svg_cairo_status_t
+write_surface_to_png_file (cairo_surface_t *surface, FILE *file);
+
+static svg_cairo_status_t
+write_surface_to_jpeg_file (cairo_surface_t *surface, FILE *file);
+
 static svg_cairo_status_t
-render_to_png (FILE *svg_file, FILE *png_file, double scale, int width, int height);
+render_to_png (FILE *svg_file, FILE *png_file, double scale, int width, int height, svg_cairo_quality_t quality, write_surface_func_t write_surface);
 
 static svg_cairo_status_t
-svg_to_png (const char * svg_filename, const char * png_filename, double scale, int width, int height);
+svg_to_png (const char * svg_filename, const char * png_filename, double scale, int width, int height, svg_cairo_quality_t quality, write_surface_func_t write_surface);
+
+static svg_cairo_status_t
+render_to_pixels (FILE *svg_file, unsigned char *pixels, svg_cairo_pixel_format_t format, double scale, int width, int height, svg_cairo_quality_t quality);
 
 #include "com_etb_lab_svg2png_Svg2Png.h"
 #include <android/log.h>
@@ -51,17 +82,17 @@ svg_to_png (const char * svg_filename, const char * png_filename, double scale,
 /*
  * Class:     com_etb_lab_svg2png_Svg2Png
  * Method:    renderSVG
- * Signature: (Ljava/lang/String;Ljava/lang/String;DII)I
+ * Signature: (Ljava/lang/String;Ljava/lang/String;DIII)I
  */
 JNIEXPORT jint JNICALL Java_com_etb_1lab_svg2png_Svg2Png_renderSVG
-  (JNIEnv *env, jclass clazz, jstring svgFileName, jstring pngFileName, jdouble scale, jint width, jint height)
+  (JNIEnv *env, jclass clazz, jstring svgFileName, jstring pngFileName, jdouble scale, jint width, jint height, jint quality)
 {
 
     const char *svgFile = env->GetStringUTFChars(svgFileName, 0);
     const char *pngFile = env->GetStringUTFChars(pngFileName, 0);
 
     __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "Java_com_etb_1lab_svg2png_Svg2Png_renderSVG %s => %s", svgFile, pngFile);
-    jint result = svg_to_png(svgFile, pngFile, scale, width, height);
+    jint result = svg_to_png(svgFile, pngFile, scale, width, height, (svg_cairo_quality_t) quality, write_surface_to_png_file);
     __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "Java_com_etb_1lab_svg2png_Svg2Png_renderSVG %s => %s", svgFile, pngFile);
 
     env->ReleaseStringUTFChars(svgFileName, svgFile);
@@ -70,8 +101,113 @@ JNIEXPORT jint JNICALL Java_com_etb_1lab_svg2png_Svg2Png_renderSVG
     return result;
 }
 
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    renderSVGToJPEG
+ * Signature: (Ljava/lang/String;Ljava/lang/String;DIII)I
+ */
+JNIEXPORT jint JNICALL Java_com_etb_1lab_svg2png_Svg2Png_renderSVGToJPEG
+  (JNIEnv *env, jclass clazz, jstring svgFileName, jstring jpegFileName, jdouble scale, jint width, jint height, jint quality)
+{
+
+    const char *svgFile = env->GetStringUTFChars(svgFileName, 0);
+    const char *jpegFile = env->GetStringUTFChars(jpegFileName, 0);
+
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "Java_com_etb_1lab_svg2png_Svg2Png_renderSVGToJPEG %s => %s", svgFile, jpegFile);
+    jint result = svg_to_png(svgFile, jpegFile, scale, width, height, (svg_cairo_quality_t) quality, write_surface_to_jpeg_file);
+
+    env->ReleaseStringUTFChars(svgFileName, svgFile);
+    env->ReleaseStringUTFChars(jpegFileName, jpegFile);
+
+    return result;
+}
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    renderSVGToPixels
+ * Signature: (Ljava/lang/String;Ljava/nio/ByteBuffer;IDIII)I
+ */
+JNIEXPORT jint JNICALL Java_com_etb_1lab_svg2png_Svg2Png_renderSVGToPixels
+  (JNIEnv *env, jclass clazz, jstring svgFileName, jobject pixels, jint format, jdouble scale, jint width, jint height, jint quality)
+{
+    unsigned char *data = (unsigned char *) env->GetDirectBufferAddress(pixels);
+    jlong capacity = env->GetDirectBufferCapacity(pixels);
+    int bytes_per_pixel = svg_cairo_pixel_format_bytes_per_pixel((svg_cairo_pixel_format_t) format);
+
+    if (data == NULL || bytes_per_pixel == 0 || width <= 0 || height <= 0 ||
+        capacity < (jlong) width * height * bytes_per_pixel)
+    {
+        __android_log_print(ANDROID_LOG_ERROR, "svg2png", "renderSVGToPixels: no room for %dx%d pixels of format %d\n", width, height, format);
+        return SVG_CAIRO_STATUS_INVALID_VALUE;
+    }
+
+    const char *svgFile = env->GetStringUTFChars(svgFileName, 0);
+    FILE *svg_file = fopen(svgFile, "r");
+    jint result;
+
+    if (svg_file == NULL)
+    {
+        __android_log_print(ANDROID_LOG_ERROR, "svg2png", "renderSVGToPixels:  failed to open %s: %s\n",
+            svgFile, strerror(errno));
+        result = SVG_CAIRO_STATUS_FILE_NOT_FOUND;
+    }
+    else
+    {
+        __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "renderSVGToPixels %s => %dx%d format %d", svgFile, width, height, format);
+        result = render_to_pixels(svg_file, data, (svg_cairo_pixel_format_t) format, scale, width, height, (svg_cairo_quality_t) quality);
+        fclose(svg_file);
+    }
+
+    env->ReleaseStringUTFChars(svgFileName, svgFile);
+
+    return result;
+}
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    setPngOptions
+ * Signature: (IIIZ)V
+ */
+JNIEXPORT void JNICALL Java_com_etb_1lab_svg2png_Svg2Png_setPngOptions
+  (JNIEnv *env, jclass clazz, jint compressionLevel, jint strategy, jint filter, jboolean reduceColorType)
+{
+    pthread_mutex_lock (&png_options_mutex);
+    png_options.compression_level = compressionLevel < 0 || compressionLevel > 9 ? -1 : compressionLevel;
+    png_options.strategy = (svg_cairo_png_strategy_t) strategy;
+    png_options.filter = (svg_cairo_png_filter_t) filter;
+    png_options.reduce_color_type = reduceColorType ? 1 : 0;
+    pthread_mutex_unlock (&png_options_mutex);
+}
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    setPngThreads
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_com_etb_1lab_svg2png_Svg2Png_setPngThreads
+  (JNIEnv *env, jclass clazz, jint threads)
+{
+    pthread_mutex_lock (&png_options_mutex);
+    png_options.threads = threads < 0 ? 1 : threads;
+    pthread_mutex_unlock (&png_options_mutex);
+}
+
+/*
+ * Class:     com_etb_lab_svg2png_Svg2Png
+ * Method:    setJpegOptions
+ * Signature: (II)V
+ */
+JNIEXPORT void JNICALL Java_com_etb_1lab_svg2png_Svg2Png_setJpegOptions
+  (JNIEnv *env, jclass clazz, jint quality, jint background)
+{
+    pthread_mutex_lock (&jpeg_options_mutex);
+    jpeg_options.quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    jpeg_options.background = background & 0xffffff;
+    pthread_mutex_unlock (&jpeg_options_mutex);
+}
+
 static svg_cairo_status_t
-svg_to_png (const char * svg_filename, const char * png_filename, double scale, int width, int height)
+svg_to_png (const char * svg_filename, const char * png_filename, double scale, int width, int height, svg_cairo_quality_t quality, write_surface_func_t write_surface)
 {
     FILE *svg_file, *png_file;
     svg_cairo_status_t status;
@@ -92,7 +228,7 @@ svg_to_png (const char * svg_filename, const char * png_filename, double scale,
     }
 
     __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "svg_to_png %s => %s", svg_filename, png_filename);
-    status = render_to_png(svg_file, png_file, scale, width, height);
+    status = render_to_png(svg_file, png_file, scale, width, height, quality, write_surface);
     if (status) 
     {
         __android_log_print(ANDROID_LOG_ERROR, "svg2png", "svg_to_png:  failed to render %s\n",
@@ -123,41 +259,64 @@ write_callback (void *closure, const unsigned char *data, unsigned int length)
 static svg_cairo_status_t
 write_surface_to_png_file (cairo_surface_t *surface, FILE *file)
 {
-    cairo_status_t status;
+    svg_cairo_png_options_t options;
 
-    status = cairo_surface_write_to_png_stream (surface, write_callback, file);
+    pthread_mutex_lock (&png_options_mutex);
+    options = png_options;
+    pthread_mutex_unlock (&png_options_mutex);
 
-    if (status)
-	return SVG_CAIRO_STATUS_IO_ERROR;
-    else
-	return SVG_CAIRO_STATUS_SUCCESS;
+    return svg_cairo_write_png (surface, &options, write_callback, file);
+}
+
+static svg_cairo_status_t
+write_surface_to_jpeg_file (cairo_surface_t *surface, FILE *file)
+{
+    svg_cairo_jpeg_options_t options;
+
+    pthread_mutex_lock (&jpeg_options_mutex);
+    options = jpeg_options;
+    pthread_mutex_unlock (&jpeg_options_mutex);
+
+    return svg_cairo_write_jpeg (surface, &options, write_callback, file);
 }
 
+/* Parses svg_file and works out where it goes in the output: the size
+ * of the output where it isn't given, and the scale and offset the
+ * document is drawn at in it */
 static svg_cairo_status_t
-render_to_png (FILE *svg_file, FILE *png_file, double scale, int width, int height)
+load_svg (FILE *svg_file, svg_cairo_quality_t quality, svg_cairo_t **svgc_ret,
+          double *scale_ret, int *width_ret, int *height_ret, double *dx_ret, double *dy_ret)
 {
     unsigned int svg_width, svg_height;
 
     svg_cairo_status_t status;
-    cairo_t *cr;
     svg_cairo_t *svgc;
-    cairo_surface_t *surface;
+    double scale = *scale_ret;
+    int width = *width_ret, height = *height_ret;
     double dx = 0, dy = 0;
 
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: svg_cairo_create\n");
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "load_svg: svg_cairo_create\n");
     status = svg_cairo_create (&svgc);
     if (status)
     {
-        __android_log_print(ANDROID_LOG_ERROR, "svg2png", "render_to_png: Failed to create svg_cairo_t. Exiting.\n");
+        __android_log_print(ANDROID_LOG_ERROR, "svg2png", "load_svg: Failed to create svg_cairo_t. Exiting.\n");
 	    return status;
     }
 
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: svg_cairo_parse_file\n");
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "load_svg: svg_cairo_parse_file\n");
     status = svg_cairo_parse_file (svgc, svg_file);
     if (status)
 	    return status;
 
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: svg_cairo_get_size\n");
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "load_svg: svg_cairo_set_quality %d\n", (int) quality);
+    status = svg_cairo_set_quality (svgc, quality);
+    if (status)
+    {
+        svg_cairo_destroy (svgc);
+        return status;
+    }
+
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "load_svg: svg_cairo_get_size\n");
     svg_cairo_get_size (svgc, &svg_width, &svg_height);
 
     if (width < 0 && height < 0)
@@ -182,10 +341,82 @@ render_to_png (FILE *svg_file, FILE *png_file, double scale, int width, int heig
         dy = (height - (int) (svg_height * scale + 0.5)) / 2;
     }
 
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: cairo_image_surface_create with width:[%d] and height:[%d]\n", width, height);
-    surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: cairo_create\n");
-    cr = cairo_create (surface);
+    /* what ends up painted over needn't be drawn in the first place */
+    svg_cairo_set_occlusion_culling (svgc, 1);
+
+    /* the images decode while the surface is set up and the rest drawn */
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "load_svg: svg_cairo_prefetch_images\n");
+    svg_cairo_prefetch_images (svgc, scale, 0);
+
+    *svgc_ret = svgc;
+    *scale_ret = scale;
+    *width_ret = width;
+    *height_ret = height;
+    *dx_ret = dx;
+    *dy_ret = dy;
+
+    return SVG_CAIRO_STATUS_SUCCESS;
+}
+
+/* Has svgc use the shared surface pool, unless another thread is
+ * rendering with it, and returns whether it does */
+static int
+acquire_surface_pool (svg_cairo_t *svgc)
+{
+    if (pthread_mutex_trylock (&surface_pool_mutex) == 0)
+    {
+        if (surface_pool == NULL)
+            svg_cairo_surface_pool_create (&surface_pool, SVG_CAIRO_SURFACE_POOL_DEFAULT_MAX_BYTES);
+        if (surface_pool != NULL && svg_cairo_set_surface_pool (svgc, surface_pool) == SVG_CAIRO_STATUS_SUCCESS)
+            return 1;
+        pthread_mutex_unlock (&surface_pool_mutex);
+    }
+
+    return 0;
+}
+
+static void
+log_render_stats (const char *caller, svg_cairo_t *svgc)
+{
+    svg_render_stats_t stats;
+    svg_cairo_get_render_stats (svgc, &stats);
+    unsigned int elements = stats.elements_rendered + stats.elements_culled + stats.elements_simplified + stats.elements_occluded;
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "%s: rendered %u elements, culled %u, simplified %u, occluded %u (%.1f%%), %u allocations\n", caller, stats.elements_rendered, stats.elements_culled, stats.elements_simplified, stats.elements_occluded,
+        elements ? 100.0 * stats.elements_occluded / elements : 0.0, stats.allocations);
+}
+
+/* Renders into a surface from the pool and has write_surface encode it
+ * into png_file */
+static svg_cairo_status_t
+render_to_png (FILE *svg_file, FILE *png_file, double scale, int width, int height, svg_cairo_quality_t quality, write_surface_func_t write_surface)
+{
+    svg_cairo_status_t status;
+    cairo_t *cr;
+    svg_cairo_t *svgc;
+    cairo_surface_t *surface;
+    svg_cairo_surface_pool_t *pool;
+    svg_cairo_surface_pool_stats_t pool_stats;
+    int shared_pool;
+    double dx, dy;
+
+    status = load_svg (svg_file, quality, &svgc, &scale, &width, &height, &dx, &dy);
+    if (status)
+        return status;
+
+    shared_pool = acquire_surface_pool (svgc);
+    pool = svg_cairo_get_surface_pool (svgc);
+
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: svg_cairo_surface_pool_acquire with width:[%d] and height:[%d]\n", width, height);
+    cr = svg_cairo_surface_pool_acquire (pool, width, height);
+    if (cr == NULL)
+    {
+        __android_log_print(ANDROID_LOG_ERROR, "svg2png", "render_to_png: Failed to create a %dx%d surface.\n", width, height);
+        svg_cairo_destroy (svgc);
+        if (shared_pool)
+            pthread_mutex_unlock (&surface_pool_mutex);
+        return SVG_CAIRO_STATUS_NO_MEMORY;
+    }
+    surface = cairo_get_target (cr);
 
     __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: cairo_save\n");
     cairo_save (cr);
@@ -208,18 +439,59 @@ render_to_png (FILE *svg_file, FILE *png_file, double scale, int width, int heig
     __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: svg_cairo_render\n");
     status = svg_cairo_render (svgc, cr);
 
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: write_surface_to_png_file\n");
-    status = write_surface_to_png_file (surface, png_file);
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: cairo_surface_destroy\n");
-    cairo_surface_destroy (surface);
-    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: cairo_destroy\n");
-    cairo_destroy (cr);
-    
-    if (status)
-	    return status;
+    log_render_stats ("render_to_png", svgc);
+
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: write_surface\n");
+    status = write_surface (surface, png_file);
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: svg_cairo_surface_pool_release\n");
+    svg_cairo_surface_pool_release (pool, cr);
+
+    svg_cairo_surface_pool_get_stats (pool, &pool_stats);
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: surface pool %u hits, %u misses, %u of %u bytes\n",
+        pool_stats.hits, pool_stats.misses, (unsigned int) pool_stats.bytes, (unsigned int) pool_stats.max_bytes);
+
+    svg_image_cache_stats_t image_stats;
+    svg_image_cache_get_stats (&image_stats);
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: image cache %u hits, %u misses, %u images, %u of %u bytes\n",
+        image_stats.hits, image_stats.misses, image_stats.images, (unsigned int) image_stats.bytes, (unsigned int) image_stats.max_bytes);
 
     __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_png: svg_cairo_destroy\n");
     svg_cairo_destroy (svgc);
+    if (shared_pool)
+        pthread_mutex_unlock (&surface_pool_mutex);
+
+    return status;
+}
+
+/* Renders straight into width x height pixels of format, rows packed
+ * one after the other, without going through a PNG */
+static svg_cairo_status_t
+render_to_pixels (FILE *svg_file, unsigned char *pixels, svg_cairo_pixel_format_t format, double scale, int width, int height, svg_cairo_quality_t quality)
+{
+    svg_cairo_status_t status;
+    svg_cairo_t *svgc;
+    cairo_matrix_t matrix;
+    int shared_pool;
+    double dx, dy;
+
+    status = load_svg (svg_file, quality, &svgc, &scale, &width, &height, &dx, &dy);
+    if (status)
+        return status;
+
+    shared_pool = acquire_surface_pool (svgc);
+
+    cairo_matrix_init_translate (&matrix, dx, dy);
+    cairo_matrix_scale (&matrix, scale, scale);
+
+    __android_log_print(ANDROID_LOG_DEBUG, "svg2png", "render_to_pixels: svg_cairo_render_pixels\n");
+    status = svg_cairo_render_pixels (svgc, &matrix, format, pixels, width, height,
+                                      width * svg_cairo_pixel_format_bytes_per_pixel (format));
+
+    log_render_stats ("render_to_pixels", svgc);
+
+    svg_cairo_destroy (svgc);
+    if (shared_pool)
+        pthread_mutex_unlock (&surface_pool_mutex);
 
     return status;
 }
@@ -1,9 +1,81 @@
 package com.etb_lab.svg2png;
 
+import java.nio.ByteBuffer;
+
 public class Svg2Png {
     static {
         System.loadLibrary("svg2png");
     }
 
-    public native static int renderSVG(String svgFileName, String pngFileName, double scale, int width, int height);
+    /* Rendering quality, QUALITY_FAST is meant for small thumbnails */
+    public static final int QUALITY_FAST = 0;
+    public static final int QUALITY_DEFAULT = 1;
+    public static final int QUALITY_BEST = 2;
+
+    public static int renderSVG(String svgFileName, String pngFileName, double scale, int width, int height) {
+        return renderSVG(svgFileName, pngFileName, scale, width, height, QUALITY_DEFAULT);
+    }
+
+    public native static int renderSVG(String svgFileName, String pngFileName, double scale, int width, int height, int quality);
+
+    /* Pixel formats for renderSVGToPixels. FORMAT_ARGB32 is premultiplied
+       native-endian words, FORMAT_RGBA8888 straight alpha in Bitmap byte
+       order, FORMAT_RGB565 for opaque documents (transparency comes out
+       black), FORMAT_A8 coverage only */
+    public static final int FORMAT_ARGB32 = 0;
+    public static final int FORMAT_RGBA8888 = 1;
+    public static final int FORMAT_RGB565 = 2;
+    public static final int FORMAT_A8 = 3;
+
+    public static int bytesPerPixel(int format) {
+        switch (format) {
+        case FORMAT_ARGB32:
+        case FORMAT_RGBA8888:
+            return 4;
+        case FORMAT_RGB565:
+            return 2;
+        case FORMAT_A8:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    /* Renders the document fitted and centered into width x height pixels
+       of format in pixels, a direct buffer holding at least
+       width * height * bytesPerPixel(format) bytes, rows packed */
+    public native static int renderSVGToPixels(String svgFileName, ByteBuffer pixels, int format, double scale, int width, int height, int quality);
+
+    /* PNG encoding for every renderSVG from now on. compressionLevel is
+       zlib's 0 to 9, or -1 for its default. PNG_STRATEGY_RLE at level 1
+       is the fast choice for icons. PNG_FILTER_ADAPTIVE picks a filter
+       per row. reduceColorType writes palette, gray or RGB images where
+       that loses nothing. */
+    public static final int PNG_STRATEGY_DEFAULT = 0;
+    public static final int PNG_STRATEGY_FILTERED = 1;
+    public static final int PNG_STRATEGY_HUFFMAN_ONLY = 2;
+    public static final int PNG_STRATEGY_RLE = 3;
+
+    public static final int PNG_FILTER_NONE = 0;
+    public static final int PNG_FILTER_SUB = 1;
+    public static final int PNG_FILTER_UP = 2;
+    public static final int PNG_FILTER_AVG = 3;
+    public static final int PNG_FILTER_PAETH = 4;
+    public static final int PNG_FILTER_ADAPTIVE = 5;
+
+    public native static void setPngOptions(int compressionLevel, int strategy, int filter, boolean reduceColorType);
+
+    /* Threads a large PNG is deflated on, 0 for one per CPU. The
+       default is 1. */
+    public native static void setPngThreads(int threads);
+
+    /* Renders like renderSVG but writes a JPEG, for opaque images such
+       as backgrounds, previews and photos. Transparent parts show the
+       background color set with setJpegOptions. */
+    public native static int renderSVGToJPEG(String svgFileName, String jpegFileName, double scale, int width, int height, int quality);
+
+    /* JPEG encoding for every renderSVGToJPEG from now on. quality is 1
+       to 100, background an RGB color whose alpha is ignored. The
+       defaults are quality 90 over white. */
+    public native static void setJpegOptions(int quality, int background);
 }